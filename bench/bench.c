@@ -0,0 +1,557 @@
+#include "../includes/gameboy.h"
+#include "../includes/log.h"
+#include "../includes/state.h"
+#include "../includes/rewind.h"
+#include "../includes/stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each result is printed as one JSON object per line:
+// {"bench":"cpu_alu_loop","ops":20000000,"seconds":0.151,"ns_per_op":7.55,"ops_per_sec":132450331}
+
+typedef struct 
+{
+    const char    *name;
+    const uint8_t *code;       // Copied to 0x0150, entry point
+    size_t         codeSize;
+    const uint8_t *bankCode;   // Copied to 0x4000 of every switchable bank, NULL for none
+    size_t         bankCodeSize;
+} Program;
+
+static volatile uint32_t sink; // Keeps the MMU loops from being optimized away
+static const char *filter;     // Only cases whose printed name contains it run, NULL for all
+static int failures;           // Checks that did not hold, turned into the exit status
+
+static int selected(const char *name)
+{
+    return !filter || strstr(name, filter);
+}
+
+static void report(const char *name, uint64_t ops, double seconds)
+{
+    printf("{\"bench\":\"%s\",\"ops\":%llu,\"seconds\":%.6f,\"ns_per_op\":%.3f,\"ops_per_sec\":%.0f}\n",
+           name, (unsigned long long)ops, seconds, seconds * 1e9 / ops, ops / seconds);
+}
+
+// Builds a 4-bank ROM that jumps from 0x0100 to the program at 0x0150.
+static Rom *buildRom(const Program *program)
+{
+    static uint8_t image[4 * 0x4000];
+    memset(image, 0, sizeof(image));
+    image[0x100] = 0xC3; image[0x101] = 0x50; image[0x102] = 0x01; // JP 0x0150
+    image[HEADER_ROM_SIZE_OFFSET] = 0x01;                           // 4 banks
+    memcpy(image + 0x150, program->code, program->codeSize);
+
+    for(int bank = 1; bank < 4 && program->bankCode; ++bank)
+        memcpy(image + bank * 0x4000, program->bankCode, program->bankCodeSize);
+    return romCreate(image, sizeof(image));
+}
+
+// ALU: ADD/XOR/INC in a DEC B / JR NZ loop
+static const uint8_t aluLoop[] =
+{
+    0x06, 0x00,       // LD B, 0
+    0x81,             // loop: ADD A, C
+    0xAA,             // XOR D
+    0x1C,             // INC E
+    0x05,             // DEC B
+    0x20, 0xFA,       // JR NZ, loop
+    0x18, 0xF6        // JR start
+};
+
+// memcpy: 256 bytes WRAM 0xC000 -> 0xD000 through (HL+) and (DE)
+static const uint8_t memcpyLoop[] =
+{
+    0x21, 0x00, 0xC0, // LD HL, 0xC000
+    0x16, 0xD0,       // LD D, 0xD0
+    0x1E, 0x00,       // LD E, 0x00
+    0x06, 0x00,       // LD B, 0
+    0x2A,             // loop: LD A, (HL+)
+    0x12,             // LD (DE), A
+    0x13,             // INC DE
+    0x05,             // DEC B
+    0x20, 0xFA,       // JR NZ, loop
+    0x18, 0xEF        // JR start
+};
+
+// Banked calls: select bank 1..3 through 0x2000 and CALL into it
+static const uint8_t bankedCalls[] =
+{
+    0x21, 0x00, 0x20, // LD HL, 0x2000
+    0x3E, 0x01,       // LD A, 1
+    0x77,             // LD (HL), A
+    0xCD, 0x00, 0x40, // CALL 0x4000
+    0x3C,             // INC A
+    0x77,             // LD (HL), A
+    0xCD, 0x00, 0x40, // CALL 0x4000
+    0x3C,             // INC A
+    0x77,             // LD (HL), A
+    0xCD, 0x00, 0x40, // CALL 0x4000
+    0x18, 0xEB        // JR start
+};
+static const uint8_t bankedRoutine[] =
+{
+    0x0C,             // INC C
+    0xC9              // RET
+};
+
+// I/O polling: spin on LY until it reads 0, then poll P1 once
+static const uint8_t ioPolling[] =
+{
+    0x21, 0x44, 0xFF, // LD HL, 0xFF44
+    0x7E,             // loop: LD A, (HL)
+    0xA7,             // AND A
+    0x20, 0xFC,       // JR NZ, loop
+    0x2E, 0x00,       // LD L, 0x00
+    0x7E,             // LD A, (HL)
+    0x18, 0xF4        // JR start
+};
+
+// Link master: sends its message from 0x0174, resending each byte the slave was
+// not armed for, and stores the replies from 0xC000 until the closing 0
+static const uint8_t linkMaster[] =
+{
+    0x16, 0x01,       // LD D, message >> 8
+    0x1E, 0x74,       // LD E, message & 0xFF
+    0x06, 0xC0,       // LD B, 0xC0
+    0x0E, 0x00,       // LD C, 0x00
+    0x21, 0x01, 0xFF, // LD HL, 0xFF01
+    0x1A,             // next: LD A, (DE)
+    0x77,             // LD (HL), A
+    0x2C,             // INC L
+    0x3E, 0x81,       // LD A, 0x81
+    0x77,             // LD (HL), A
+    0x7E,             // wait: LD A, (HL)
+    0x07,             // RLCA
+    0x38, 0xFC,       // JR C, wait
+    0x2D,             // DEC L
+    0x7E,             // LD A, (HL)
+    0x3C,             // INC A, zero when the slave was not armed
+    0x28, 0xF1,       // JR Z, next
+    0x3D,             // DEC A
+    0x02,             // LD (BC), A
+    0x03,             // INC BC
+    0x1A,             // LD A, (DE)
+    0x13,             // INC DE
+    0xA7,             // AND A
+    0x20, 0xE9,       // JR NZ, next
+    0x18, 0xFE,       // JR $
+    'P', 'I', 'N', 'G', ' ', 'M', 'E', '\n', 0
+};
+
+// Link slave: arms with its message from 0x016F and stores what the master sent
+// from 0xC000 until the closing 0
+static const uint8_t linkSlave[] =
+{
+    0x16, 0x01,       // LD D, message >> 8
+    0x1E, 0x6F,       // LD E, message & 0xFF
+    0x06, 0xC0,       // LD B, 0xC0
+    0x0E, 0x00,       // LD C, 0x00
+    0x21, 0x01, 0xFF, // LD HL, 0xFF01
+    0x1A,             // next: LD A, (DE)
+    0x77,             // LD (HL), A
+    0x2C,             // INC L
+    0x3E, 0x80,       // LD A, 0x80
+    0x77,             // LD (HL), A
+    0x7E,             // wait: LD A, (HL)
+    0x07,             // RLCA
+    0x38, 0xFC,       // JR C, wait
+    0x2D,             // DEC L
+    0x7E,             // LD A, (HL)
+    0x02,             // LD (BC), A
+    0x03,             // INC BC
+    0x13,             // INC DE
+    0xA7,             // AND A
+    0x20, 0xEE,       // JR NZ, next
+    0x18, 0xFE,       // JR $
+    'L', 'I', 'N', 'K', ' ', 'O', 'K', '\n', 0
+};
+
+static const Program programs[] =
+{
+    { "cpu_alu_loop",     aluLoop,     sizeof(aluLoop),     NULL,          0 },
+    { "cpu_memcpy_loop",  memcpyLoop,  sizeof(memcpyLoop),  NULL,          0 },
+    { "cpu_banked_calls", bankedCalls, sizeof(bankedCalls), bankedRoutine, sizeof(bankedRoutine) },
+    { "cpu_io_polling",   ioPolling,   sizeof(ioPolling),   NULL,          0 },
+};
+
+static void benchProgram(const Program *program, uint64_t instructions)
+{
+    Rom *rom = buildRom(program);
+    GameBoy *gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    if(!gb) return;
+
+    uint64_t start = statsClock();
+    for(uint64_t i = 0; i < instructions; ++i)
+        gbStep(gb);
+    report(program->name, instructions, (statsClock() - start) / 1e9);
+    gbDestroy(gb);
+}
+
+static void benchMMU(uint64_t accesses)
+{
+    static const struct { const char *name; uint16_t base; uint16_t span; } regions[] =
+    {
+        { "mmu_read_rom0",   0x0000, 0x4000 },
+        { "mmu_read_romx",   0x4000, 0x4000 },
+        { "mmu_read_vram",   0x8000, 0x2000 },
+        { "mmu_read_wram",   0xC000, 0x2000 },
+        { "mmu_read_io",     0xFF00, 0x0080 },
+        { "mmu_read_hram",   0xFF80, 0x007F },
+    };
+
+    int wanted = selected("mmu_read_mixed") || selected("mmu_write_wram");
+    for(size_t r = 0; r < sizeof(regions) / sizeof(regions[0]); ++r)
+        wanted |= selected(regions[r].name);
+    if(!wanted) return;
+
+    Program empty = { "mmu", aluLoop, sizeof(aluLoop), NULL, 0 };
+    Rom *rom = buildRom(&empty);
+    GameBoy *gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    if(!gb) return;
+
+    for(size_t r = 0; r < sizeof(regions) / sizeof(regions[0]); ++r)
+    {
+        if(!selected(regions[r].name)) continue;
+        uint32_t sum = 0;
+        uint16_t offset = 0;
+        uint64_t start = statsClock();
+        for(uint64_t i = 0; i < accesses; ++i)
+        {
+            sum += mmuReadByte(&gb->mmu, regions[r].base + offset);
+            offset = (offset + 1 == regions[r].span) ? 0 : offset + 1;
+        }
+        report(regions[r].name, accesses, (statsClock() - start) / 1e9);
+        sink = sum;
+    }
+
+    // Strided random-ish pattern across the whole map, like mixed game code
+    if(selected("mmu_read_mixed"))
+    {
+        uint32_t sum = 0, lcg = 1;
+        uint64_t start = statsClock();
+        for(uint64_t i = 0; i < accesses; ++i)
+        {
+            lcg = lcg * 1664525u + 1013904223u;
+            sum += mmuReadByte(&gb->mmu, (uint16_t)(lcg >> 16));
+        }
+        report("mmu_read_mixed", accesses, (statsClock() - start) / 1e9);
+        sink = sum;
+    }
+
+    if(selected("mmu_write_wram"))
+    {
+        uint64_t start = statsClock();
+        for(uint64_t i = 0; i < accesses; ++i)
+            mmuWriteByte(&gb->mmu, 0xC000 + (i & 0x1FFF), (uint8_t)i);
+        report("mmu_write_wram", accesses, (statsClock() - start) / 1e9);
+    }
+
+    gbDestroy(gb);
+}
+
+static void benchPPU(const char *name, PPURenderMode mode, int threads, uint64_t frames)
+{
+    char scanlines[64];
+    snprintf(scanlines, sizeof(scanlines), "%s_scanline", name);
+    if(!selected(name) && !selected(scanlines)) return;
+
+    Program empty = { "ppu", aluLoop, sizeof(aluLoop), NULL, 0 };
+    Rom *rom = buildRom(&empty);
+    GameBoy *gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    if(!gb) return;
+
+    // Random tiles and map so every pixel goes through the full lookup
+    uint32_t lcg = 12345;
+    for(size_t i = 0; i < VRAM_SIZE; ++i)
+    {
+        lcg = lcg * 1664525u + 1013904223u;
+        gb->mmu.vram[i] = (uint8_t)(lcg >> 24);
+    }
+    ppuSetRenderMode(&gb->ppu, &gb->mmu, mode, threads);
+
+    // Drive the PPU alone, one CPU-sized step at a time
+    uint64_t start = statsClock();
+    for(uint64_t target = gb->ppu.frames + frames; gb->ppu.frames < target; )
+        ppuStep(&gb->ppu, &gb->mmu, 4);
+    ppuSync(&gb->ppu);
+    double seconds = (statsClock() - start) / 1e9;
+
+    if(selected(name)) report(name, frames, seconds);
+    if(selected(scanlines)) report(scanlines, frames * SCREEN_HEIGHT, seconds);
+    gbDestroy(gb);
+}
+
+static void benchState(uint64_t iterations)
+{
+    if(!selected("state_save") && !selected("state_load")) return;
+    Rom *rom = buildRom(&programs[1]);
+    GameBoy *gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    if(!gb) return;
+
+    // Stop mid-frame so the latched scanlines are part of the state
+    for(int i = 0; i < 50000; ++i)
+        gbStep(gb);
+
+    size_t capacity = stateSize(gb);
+    uint8_t *buffer = malloc(capacity);
+    if(!buffer) { gbDestroy(gb); return; }
+
+    // Saved even when only loading is measured, it needs the state
+    size_t size = 0;
+    uint64_t start = statsClock();
+    for(uint64_t i = 0; i < iterations; ++i)
+        size = stateSave(gb, buffer, capacity);
+    if(selected("state_save")) report("state_save", iterations, (statsClock() - start) / 1e9);
+
+    if(selected("state_load"))
+    {
+        start = statsClock();
+        for(uint64_t i = 0; i < iterations && size; ++i)
+            stateLoad(gb, buffer, size);
+        report("state_load", iterations, (statsClock() - start) / 1e9);
+    }
+
+    free(buffer);
+    gbDestroy(gb);
+}
+
+static void benchRewind(uint64_t frames)
+{
+    // Popping needs the pushed frames, pushing needs the emulated ones
+    if(!selected("frame_memcpy_loop") && !selected("rewind_push") && !selected("rewind_step") && !selected("rewind_pop"))
+        return;
+    Rom *rom = buildRom(&programs[1]);
+    GameBoy *gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    Rewind *rewind = gb ? rewindCreate(4 << 20) : NULL;
+    if(!rewind) { gbDestroy(gb); return; }
+
+    // The frame the steps below have to land back on
+    uint64_t steps = frames / 10;
+    uint64_t targetFrame = 0, targetHash = 0;
+    double frameSeconds = 0;
+    for(uint64_t i = 0; i < frames; ++i)
+    {
+        uint64_t start = statsClock();
+        gbRunFrame(gb);
+        frameSeconds += (statsClock() - start) / 1e9;
+        rewindPush(rewind, gb);
+        if(i + 1 + steps == frames)
+        {
+            targetFrame = gb->ppu.frames;
+            targetHash = ppuFrameHash(&gb->ppu);
+        }
+    }
+
+    RewindStats stats;
+    rewindStats(rewind, &stats);
+    if(selected("frame_memcpy_loop")) report("frame_memcpy_loop", frames, frameSeconds);
+    if(selected("rewind_push")) report("rewind_push", stats.pushed, stats.seconds);
+
+    if(selected("rewind_step"))
+    {
+        uint64_t start = statsClock();
+        for(uint64_t i = 0; i < steps; ++i)
+            rewindStep(rewind, gb);
+        report("rewind_step", steps, (statsClock() - start) / 1e9);
+
+        if(gb->ppu.frames != targetFrame || ppuFrameHash(&gb->ppu) != targetHash)
+        {
+            fprintf(stderr, "rewind_step: stepped back to frame %llu, expected %llu with the same picture\n",
+                    (unsigned long long)gb->ppu.frames, (unsigned long long)targetFrame);
+            failures++;
+        }
+    }
+
+    if(selected("rewind_pop"))
+    {
+        uint64_t start = statsClock();
+        uint64_t popped = 0;
+        while(!rewindPop(rewind, gb))
+            popped++;
+        if(popped) report("rewind_pop", popped, (statsClock() - start) / 1e9);
+    }
+
+    rewindDestroy(rewind);
+    gbDestroy(gb);
+}
+
+static void benchClone(uint64_t clones)
+{
+    if(!selected("clone_destroy") && !selected("clone_step1000_destroy")) return;
+    Rom *rom = buildRom(&programs[1]);
+    GameBoy *gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    if(!gb) return;
+    gbRunFrame(gb);
+
+    if(selected("clone_destroy"))
+    {
+        uint64_t start = statsClock();
+        for(uint64_t i = 0; i < clones; ++i)
+            gbDestroy(gbClone(gb));
+        report("clone_destroy", clones, (statsClock() - start) / 1e9);
+
+        // The pages are no longer shared, the next write has to map them back in
+        mmuWriteByte(&gb->mmu, 0xC000, 0x42);
+        if(!gb->mmu.writeMap[0xC000 >> MMU_PAGE_SHIFT] || gb->mmu.readMap[0xC000 >> MMU_PAGE_SHIFT][0] != 0x42)
+        {
+            fprintf(stderr, "clone_destroy: WRAM stayed off the write map after the clones went away\n");
+            failures++;
+        }
+    }
+
+    // Branch and run a little, so some pages diverge and are copied
+    if(selected("clone_step1000_destroy"))
+    {
+        uint64_t start = statsClock();
+        for(uint64_t i = 0; i < clones / 10; ++i)
+        {
+            GameBoy *branch = gbClone(gb);
+            if(!branch) break;
+            for(int step = 0; step < 1000; ++step)
+                gbStep(branch);
+            gbDestroy(branch);
+        }
+        report("clone_step1000_destroy", clones / 10, (statsClock() - start) / 1e9);
+    }
+    gbDestroy(gb);
+}
+
+typedef struct
+{
+    GameBoy *gb;
+    uint64_t frames;
+} LinkRun;
+
+static void *runLinked(void *argument)
+{
+    LinkRun *run = argument;
+    for(uint64_t i = 0; i < run->frames; ++i)
+        gbRunFrame(run->gb);
+    return NULL;
+}
+
+// Whether the instance stored message from 0xC000 on, as the link programs do
+static int receivedMessage(GameBoy *gb, const char *message)
+{
+    for(size_t i = 0; i <= strlen(message); ++i)
+        if(mmuReadByte(&gb->mmu, (uint16_t)(0xC000 + i)) != (uint8_t)message[i]) return 0;
+    return 1;
+}
+
+static void benchLink(uint64_t frames)
+{
+    if(!selected("serial_local_link")) return;
+    static const Program master = { "link_master", linkMaster, sizeof(linkMaster), NULL, 0 };
+    static const Program slave = { "link_slave", linkSlave, sizeof(linkSlave), NULL, 0 };
+    Rom *rom = buildRom(&master);
+    LinkRun runs[2] = { { rom ? gbCreate(rom) : NULL, frames }, { NULL, frames } };
+    romRelease(rom);
+    rom = buildRom(&slave);
+    runs[1].gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    if(!runs[0].gb || !runs[1].gb || serialConnectLocal(&runs[0].gb->serial, &runs[1].gb->serial))
+    {
+        gbDestroy(runs[0].gb);
+        gbDestroy(runs[1].gb);
+        return;
+    }
+
+    // Local peers block on each other, so each one needs a thread of its own
+    uint64_t start = statsClock();
+    pthread_t threads[2];
+    int started = 0;
+    while(started < 2 && !pthread_create(&threads[started], NULL, runLinked, &runs[started]))
+        started++;
+    for(int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    if(started == 2) report("serial_local_link", 2 * frames, (statsClock() - start) / 1e9);
+
+    if(started < 2 || !receivedMessage(runs[0].gb, "LINK OK\n") || !receivedMessage(runs[1].gb, "PING ME\n"))
+    {
+        fprintf(stderr, "serial_local_link: the messages did not arrive intact, %llu and %llu transfers\n",
+                (unsigned long long)runs[0].gb->serial.transfers, (unsigned long long)runs[1].gb->serial.transfers);
+        failures++;
+    }
+    gbDestroy(runs[0].gb); // Disconnects, the last one frees the channel
+    gbDestroy(runs[1].gb);
+}
+
+static void benchAPU(uint64_t seconds)
+{
+    if(!selected("apu_output_frame")) return;
+    Rom *rom = buildRom(&programs[0]);
+    GameBoy *gb = rom ? gbCreate(rom) : NULL;
+    romRelease(rom);
+    AudioRing *ring = gb ? aligned_alloc(_Alignof(AudioRing), sizeof(AudioRing)) : NULL;
+    if(!ring) { gbDestroy(gb); return; }
+    audioRingInit(ring);
+    apuSetOutput(&gb->apu, ring);
+
+    // All four channels audible, the wave channel on a ramp
+    static const uint16_t setup[][2] =
+    {
+        { 0xFF26, 0x80 }, { 0xFF25, 0xFF }, { 0xFF24, 0x77 },
+        { 0xFF11, 0x80 }, { 0xFF12, 0xF0 }, { 0xFF13, 0xD6 }, { 0xFF14, 0x86 },
+        { 0xFF16, 0x40 }, { 0xFF17, 0xA0 }, { 0xFF18, 0x00 }, { 0xFF19, 0x87 },
+        { 0xFF1A, 0x80 }, { 0xFF1C, 0x20 }, { 0xFF1D, 0x00 }, { 0xFF1E, 0x87 },
+        { 0xFF21, 0xF0 }, { 0xFF22, 0x21 }, { 0xFF23, 0x80 },
+    };
+    for(int i = 0; i < 16; ++i)
+        mmuWriteByte(&gb->mmu, 0xFF30 + i, (uint8_t)(i * 0x11));
+    for(size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); ++i)
+        mmuWriteByte(&gb->mmu, setup[i][0], (uint8_t)setup[i][1]);
+
+    int16_t frames[1024][2];
+    uint64_t produced = 0;
+    uint64_t start = statsClock();
+    for(uint64_t cycles = 0; cycles < seconds * APU_CLOCK_RATE; cycles += 4)
+    {
+        apuStep(&gb->apu, 4);
+        if(!(cycles & 0xFFFF))
+            produced += audioRingRead(ring, frames, 1024);
+    }
+    apuCatchUp(&gb->apu);
+    while(audioRingFill(ring))
+        produced += audioRingRead(ring, frames, 1024);
+    report("apu_output_frame", produced, (statsClock() - start) / 1e9);
+
+    gbDestroy(gb);
+    free(ring);
+}
+
+int main(int argc, char *argv[])
+{
+    filter = argc > 1 ? argv[1] : NULL;
+    uint64_t scale = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    if(!scale) scale = 1;
+
+    logSetOutput(NULL); // Keep stdout machine-readable
+    if(logInit()) return 2;
+
+    for(size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); ++i)
+        if(selected(programs[i].name))
+            benchProgram(&programs[i], 20000000ull * scale);
+
+    // Each case checks its own printed names against the filter
+    benchMMU(50000000ull * scale);
+    benchPPU("ppu_frame_immediate", PPU_RENDER_IMMEDIATE, 1, 300 * scale);
+    benchPPU("ppu_frame_deferred", PPU_RENDER_DEFERRED, 1, 300 * scale);
+    benchState(20000 * scale);
+    benchAPU(10 * scale);
+    benchClone(20000 * scale);
+    benchRewind(600 * scale);
+    benchLink(60 * scale);
+
+    logFree();
+    return failures ? 1 : 0; // 1: a check failed
+}
@@ -0,0 +1,92 @@
+#ifndef APU_H
+    #define APU_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include <stdatomic.h>
+
+    #define APU_CLOCK_RATE       4194304 // Cycles per second
+    #define APU_SAMPLE_CYCLES    32      // Channels are sampled every 32 cycles, 131072 Hz
+    #define APU_SEQUENCER_CYCLES 8192    // Frame sequencer runs at 512 Hz
+    #define APU_BATCH_CYCLES     4096    // Pending cycles before channels are generated without an event
+    #define APU_OUTPUT_RATE      48000
+
+    #define APU_FIR_TAPS         64      // Band-limiting filter length, in 131072 Hz samples
+    #define APU_FIR_PHASES       128     // Fractional positions the filter is tabulated for
+    #define APU_BLOCK_SAMPLES    (APU_SEQUENCER_CYCLES / APU_SAMPLE_CYCLES)
+
+    #define AUDIO_RING_FRAMES    8192    // Stereo frames between the emulation and the audio device
+
+// Single producer (emulation) single consumer (audio callback or WAV writer) ring
+typedef struct
+{
+    // Written by the producer only
+    _Alignas(64) atomic_size_t head;
+    uint64_t dropped;           // Frames lost to a full ring
+    // Written by the consumer only
+    _Alignas(64) atomic_size_t tail;
+
+    _Alignas(64) int16_t frames[AUDIO_RING_FRAMES][2];
+} AudioRing;
+
+typedef struct
+{
+    bool     enabled;        // NR52 status bit
+    uint16_t length;         // Length counter, the channel stops when it reaches 0
+    uint8_t  volume;         // Envelope volume
+    uint8_t  envelopeTimer;
+    int32_t  timer;          // Cycles to the next waveform step
+    uint8_t  position;       // Duty step or wave sample index
+    uint16_t lfsr;           // Noise shift register
+} APUChannel;
+
+typedef struct APU
+{
+    uint8_t    regs[0x30];   // 0xFF10-0xFF3F as written, wave RAM at 0x20
+    APUChannel channels[4];  // Square 1 with sweep, square 2, wave, noise
+
+    uint16_t   sweepShadow;
+    uint8_t    sweepTimer;
+    bool       sweepEnabled;
+
+    uint8_t    sequencerStep;
+    uint16_t   sequencerSamples;  // Samples to the next frame sequencer step
+    uint32_t   cycleRemainder;    // Cycles not yet turned into a sample
+    uint32_t   pending;           // Cycles the channels have not caught up with
+
+    // Band-limited resampler, only used with an output ring
+    AudioRing *ring;
+    float      left [APU_FIR_TAPS + APU_BLOCK_SAMPLES]; // History then the current block
+    float      right[APU_FIR_TAPS + APU_BLOCK_SAMPLES];
+    int        buffered;          // Samples in left/right, history included
+    uint64_t   position;          // Next output sample, 32.32 fixed point input samples
+    uint64_t   step;              // Input samples per output sample, 32.32
+    double     rate;              // Output rate multiplier for dynamic rate control
+    float      highPass[2];       // DC blocking capacitor state
+    float      lastInput[2];
+
+    uint64_t   catchUpTime;       // Nanoseconds spent generating, read by the stats
+} APU;
+
+void    initAPU          (APU *apu);
+void    apuSetOutput     (APU *apu, AudioRing *ring);
+void    apuSetRate       (APU *apu, double rate);
+
+void    apuCatchUp       (APU *apu); // Generate every pending cycle
+
+// Cycles are only counted here, channels are generated in batches
+static inline void apuStep(APU *apu, int cycles)
+{
+    if((apu->pending += cycles) >= APU_BATCH_CYCLES) apuCatchUp(apu);
+}
+
+uint8_t apuReadRegister  (APU *apu, uint16_t address);
+void    apuWriteRegister (APU *apu, uint16_t address, uint8_t value);
+
+void    audioRingInit    (AudioRing *ring);
+size_t  audioRingWrite   (AudioRing *ring, const int16_t (*frames)[2], size_t count);
+size_t  audioRingRead    (AudioRing *ring, int16_t (*frames)[2], size_t count);
+size_t  audioRingFill    (AudioRing *ring);
+
+#endif // !APU_H
@@ -0,0 +1,18 @@
+#ifndef AUDIO_H
+    #define AUDIO_H
+
+    #include <SDL2/SDL.h>
+    #include "apu.h"
+
+typedef struct 
+{
+    SDL_AudioDeviceID device;   // SDL playback device
+    AudioRing        *ring;     // Filled by the APU, drained by the device callback
+    int16_t           last[2];  // Repeated on underrun instead of clicking to silence
+    uint64_t          underruns; // Frames the callback had to make up
+} Audio;
+
+int  initAudio(Audio *audio, AudioRing *ring);
+void freeAudio(Audio *audio);
+
+#endif // !AUDIO_H
@@ -0,0 +1,65 @@
+#ifndef DEBUGGER_H
+    #define DEBUGGER_H
+
+    #include <stdio.h>
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include "gameboy.h"
+
+    #define DEBUG_MAX_WATCHES 32
+
+typedef enum
+{
+    DEBUG_NONE = 0,    // The frame ran to its end
+    DEBUG_BREAKPOINT,  // About to execute a breakpoint address
+    DEBUG_WATCHPOINT,  // The last instruction touched a watched address
+    DEBUG_STEP         // Single step done
+} DebugStop;
+
+typedef struct
+{
+    uint16_t first;
+    uint16_t last;     // Inclusive
+    uint8_t  access;   // MMU_WATCH_* bits
+} Watchpoint;
+
+// Breakpoints cost nothing unless frames run through debuggerRunFrame, a copy of the
+// frame loop that tests a bit per PC. Watchpoints take their pages off the MMU's
+// direct maps, so only accesses to those pages reach debuggerAccess.
+typedef struct Debugger
+{
+    GameBoy   *gb;
+    uint64_t   breakpoints[0x10000 / 64]; // One bit per address
+    Watchpoint watches[DEBUG_MAX_WATCHES];
+    int        watchCount;
+
+    bool       pause;      // Prompt before running any further
+    int        stepping;   // Instructions left to single step, 0 runs freely
+    bool       resume;     // Execute the breakpoint the last run stopped at
+    uint16_t   pc;         // Instruction being executed
+
+    // First watchpoint hit by the last instruction, set from the MMU
+    bool       hit;
+    int        hitWatch;
+    uint16_t   hitAddress;
+    uint8_t    hitValue;
+    bool       hitWrite;
+} Debugger;
+
+Debugger *debuggerCreate (GameBoy *gb); // Attaches to the instance's MMU
+void      debuggerDestroy(Debugger *debugger);
+
+void      debuggerBreak  (Debugger *debugger, uint16_t address, bool set);
+int       debuggerWatch  (Debugger *debugger, uint16_t first, uint16_t last, uint8_t access); // Index, -1 when full
+void      debuggerUnwatch(Debugger *debugger, int index);
+int       debuggerParseWatch(const char *text, uint16_t *first, uint16_t *last, uint8_t *access); // ADDR[-END][:r|w|rw]
+
+void      debuggerAccess (Debugger *debugger, uint16_t address, uint8_t value, bool write); // From the MMU slow path
+
+DebugStop debuggerRunFrame(Debugger *debugger, int *cycles); // Until a breakpoint, a watchpoint or the end of the frame
+DebugStop debuggerStep    (Debugger *debugger, int *cycles);
+
+// Runs one frame, prompting for commands on in at every stop. False once the user quits.
+bool      debuggerFrame  (Debugger *debugger, FILE *in, FILE *out, int *cycles);
+
+#endif // !DEBUGGER_H
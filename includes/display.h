@@ -0,0 +1,25 @@
+#ifndef DISPLAY_H
+    #define DISPLAY_H
+
+    #include <SDL2/SDL.h>
+    #include "ppu.h"
+    #include "input.h"
+    #include "stats.h"
+
+typedef struct 
+{
+    SDL_Window   *window;   // SDL window for rendering
+    SDL_Renderer *renderer; // SDL renderer for drawing
+    SDL_Texture  *texture;  // SDL texture for the frame buffer
+    bool          closed;   // Quit requested, sticks once seen
+    const Stats  *overlay;  // Drawn over every presented frame, NULL for none
+} Display;
+
+int  initDisplay(Display *display);
+void freeDisplay(Display *display);
+
+void displayPresent(Display *display, PPU *ppu);
+void displayPollInput(Display *display, InputSnapshot *input); // Once per frame, publishes the keyboard state
+void displaySetSpeed(Display *display, double speed, bool fastForward); // Window title readout
+
+#endif // !DISPLAY_H
@@ -0,0 +1,52 @@
+#ifndef GAMEBOY_H
+    #define GAMEBOY_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include "cpu.h"
+    #include "mmu.h"
+    #include "ppu.h"
+    #include "apu.h"
+    #include "serial.h"
+    #include "profiler.h"
+    #include "metrics.h"
+    #include "trace.h"
+
+    #define GB_FRAME_RATE 59.7275 // Frames per second of real hardware
+
+// One emulated machine. Everything the hot path touches lives here, so any
+// number of instances can run side by side in one process.
+typedef struct 
+{
+    CPU      cpu;
+    MMU      mmu;
+    PPU      ppu;
+    APU      apu;
+    Serial   serial;
+
+    uint64_t cycles;       // Cycles executed since creation
+    uint64_t instructions; // Instructions executed since creation
+
+    uint8_t *aheadState;   // Run-ahead snapshot buffer
+    size_t   aheadCapacity;
+
+    MetricsSlot *metrics;  // Counters for whoever runs the instance to bump, NULL for none
+    TraceWriter *trace;    // Records every instruction when set, not copied by clones
+
+#ifdef GB_PROFILE
+    Profiler *profiler;    // Set to start profiling, not copied by clones
+#endif
+} GameBoy;
+
+GameBoy *gbCreate  (Rom *rom);
+GameBoy *gbClone   (GameBoy *gb); // Shares ROM and memory pages copy-on-write
+void     gbDestroy (GameBoy *gb);
+
+int      gbStep    (GameBoy *gb);
+int      gbStepTraced(GameBoy *gb); // gbStep, recording the instruction to gb->trace first
+int      gbRunFrame(GameBoy *gb);
+int      gbRunFrameAhead(GameBoy *gb, int frames, bool render); // Skips rendering when render is false
+
+void     gbSetButtons(GameBoy *gb, uint8_t buttons);
+
+#endif // !GAMEBOY_H
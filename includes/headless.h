@@ -0,0 +1,31 @@
+#ifndef HEADLESS_H
+    #define HEADLESS_H
+
+    #include <stdint.h>
+    #include "gameboy.h"
+    #include "rewind.h"
+    #include "movie.h"
+    #include "wav.h"
+    #include "stats.h"
+    #include "debugger.h"
+
+typedef struct 
+{
+    uint64_t    frames;      // Stop after this many frames, 0 for no frame limit
+    uint64_t    cycles;      // Stop after this many cycles, 0 for no cycle limit
+    const char *inputScript; // Optional "<frame> <buttons>" script, NULL for no input
+    Rewind     *rewind;      // Snapshot every frame into this ring, NULL for none
+    int         runAhead;    // Frames to run ahead for the hashed picture, 0 for none
+    Movie      *record;      // Append every frame's buttons to this movie, NULL for none
+    Movie      *replay;      // Take buttons from this movie instead of the script, NULL for none
+    WavWriter  *wav;         // Drain the APU's output ring into this file every frame, NULL for none
+    bool        stats;       // Print a host time breakdown every STATS_WINDOW
+    Debugger   *debugger;    // Run frames under the debugger, prompting on stdin, NULL for none
+} HeadlessOptions;
+
+// Runs without a window, printing one hash line per frame and a summary line.
+int headlessRun(GameBoy *gb, const HeadlessOptions *options);
+
+int inputParseButtons(const char *text, uint8_t *buttons);
+
+#endif // !HEADLESS_H
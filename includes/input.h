@@ -0,0 +1,29 @@
+#ifndef INPUT_H
+    #define INPUT_H
+
+    #include <stdatomic.h>
+
+    #define INPUT_BUTTONS      0xFFu     // JOYPAD_* bits
+    #define INPUT_FAST_FORWARD (1u << 8) // Hotkeys above the buttons
+    #define INPUT_QUIT         (1u << 9)
+    #define INPUT_OVERLAY      (1u << 10)
+    #define INPUT_REWIND       (1u << 11)
+
+// Input as of the last poll. The presentation side publishes it once per frame
+// and the emulation side takes it once per frame, the CPU never looks at it.
+typedef struct 
+{
+    _Alignas(64) atomic_uint state; // INPUT_* bits
+} InputSnapshot;
+
+static inline void inputPublish(InputSnapshot *input, unsigned state)
+{
+    atomic_store_explicit(&input->state, state, memory_order_release);
+}
+
+static inline unsigned inputLatest(InputSnapshot *input)
+{
+    return atomic_load_explicit(&input->state, memory_order_acquire);
+}
+
+#endif // !INPUT_H
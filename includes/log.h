@@ -1,10 +1,87 @@
 #ifndef LOG_H
     #define LOG_H
 
-    #define LOG logMessage
-    
+    #include <stddef.h>
+    #include <stdatomic.h>
+    #include <stdio.h>
+
+    #define LOG_LEVEL_TRACE 0
+    #define LOG_LEVEL_DEBUG 1
+    #define LOG_LEVEL_INFO  2
+    #define LOG_LEVEL_WARN  3
+    #define LOG_LEVEL_ERROR 4
+    #define LOG_LEVEL_NONE  5
+
+    // Levels below the floor are compiled out, arguments included
+    #ifndef LOG_LEVEL_FLOOR
+        #define LOG_LEVEL_FLOOR LOG_LEVEL_TRACE
+    #endif
+
+    #define LOG_GENERAL (1u << 0)
+    #define LOG_CPU     (1u << 1)
+    #define LOG_MMU     (1u << 2)
+    #define LOG_PPU     (1u << 3)
+    #define LOG_IO      (1u << 4)
+    #define LOG_ALL     0xFFFFFFFFu
+
+    // Runtime filter, checked before any argument is evaluated
+    #define LOG_AT(level, category, ...) \
+        do { if(logEnabled(level, category)) logMessage(__VA_ARGS__); } while(0)
+
+    // Compiled-out calls still type-check their arguments but generate no code
+    #define LOG_OFF(...) do { if(0) logMessage(__VA_ARGS__); } while(0)
+
+    #if LOG_LEVEL_FLOOR <= LOG_LEVEL_TRACE
+        #define LOG_TRACE(category, ...) LOG_AT(LOG_LEVEL_TRACE, category, __VA_ARGS__)
+    #else
+        #define LOG_TRACE(category, ...) LOG_OFF(__VA_ARGS__)
+    #endif
+    #if LOG_LEVEL_FLOOR <= LOG_LEVEL_DEBUG
+        #define LOG_DEBUG(category, ...) LOG_AT(LOG_LEVEL_DEBUG, category, __VA_ARGS__)
+    #else
+        #define LOG_DEBUG(category, ...) LOG_OFF(__VA_ARGS__)
+    #endif
+    #if LOG_LEVEL_FLOOR <= LOG_LEVEL_INFO
+        #define LOG_INFO(category, ...)  LOG_AT(LOG_LEVEL_INFO, category, __VA_ARGS__)
+    #else
+        #define LOG_INFO(category, ...)  LOG_OFF(__VA_ARGS__)
+    #endif
+    #if LOG_LEVEL_FLOOR <= LOG_LEVEL_WARN
+        #define LOG_WARN(category, ...)  LOG_AT(LOG_LEVEL_WARN, category, __VA_ARGS__)
+    #else
+        #define LOG_WARN(category, ...)  LOG_OFF(__VA_ARGS__)
+    #endif
+    #if LOG_LEVEL_FLOOR <= LOG_LEVEL_ERROR
+        #define LOG_ERROR(category, ...) LOG_AT(LOG_LEVEL_ERROR, category, __VA_ARGS__)
+    #else
+        #define LOG_ERROR(category, ...) LOG_OFF(__VA_ARGS__)
+    #endif
+
+    #define LOG(...) LOG_INFO(LOG_GENERAL, __VA_ARGS__)
+
+extern atomic_int  logLevel;      // Lowest level printed at runtime, set from any thread
+extern atomic_uint logCategories; // Mask of LOG_* categories printed at runtime
+
+static inline int logEnabled(int level, unsigned category)
+{
+    return level >= atomic_load_explicit(&logLevel, memory_order_relaxed)
+        && (atomic_load_explicit(&logCategories, memory_order_relaxed) & category);
+}
+
 int  logInit(void);
 void logFree(void);
 void logMessage(const char *message, ...);
 
-#endif // !LOG_H
\ No newline at end of file
+int  logSetOutput      (const char *path);               // "-" for stdout, NULL to disable text output
+int  logSetBinaryOutput(const char *path, size_t size);  // Memory-mapped rotating binary log, NULL to close
+int  logDumpBinary     (const char *path, FILE *out);    // Writes a binary log's records oldest first as text
+
+void logSetLevel     (int level);
+void logSetCategories(unsigned categories);
+int  logParseLevel   (const char *name);
+
+unsigned long      logDroppedCount(void);
+unsigned long      logQueueDepth  (void); // Messages queued but not yet written
+unsigned long long logTimeSpent   (void); // Nanoseconds spent queueing messages, every thread, sampled
+
+#endif // !LOG_H
@@ -0,0 +1,51 @@
+#ifndef METRICS_H
+    #define METRICS_H
+
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include <stdatomic.h>
+
+    #define METRICS_MAX_SLOTS    256  // Counter sets, one per instance being run
+    #define METRICS_LABEL_LENGTH 32
+    #define METRICS_POLL_MS      200  // How long the server sleeps before checking for shutdown
+
+typedef enum
+{
+    METRIC_FRAMES = 0,     // Frames emulated
+    METRIC_FRAMES_SKIPPED, // Frames of those never rasterized
+    METRIC_CYCLES,
+    METRIC_INSTRUCTIONS,
+    METRIC_COUNT
+} Metric;
+
+// Counters with a single writer at a time. Writers never share a cache line and never
+// use read-modify-write instructions; the server thread sums them only when scraped.
+typedef struct MetricsSlot
+{
+    _Alignas(64) atomic_ullong values[METRIC_COUNT];
+    atomic_bool  claimed; // Set once label is filled in
+    char         label[METRICS_LABEL_LENGTH];
+} MetricsSlot;
+
+typedef struct Metrics Metrics;
+
+Metrics     *metricsStart(const char *path); // Serves plain text metrics on a UNIX socket, NULL on failure
+void         metricsStop (Metrics *metrics);
+MetricsSlot *metricsSlot (Metrics *metrics, const char *label); // NULL when metrics is NULL or every slot is taken
+
+static inline void metricsAdd(MetricsSlot *slot, Metric metric, uint64_t amount)
+{
+    unsigned long long value = atomic_load_explicit(&slot->values[metric], memory_order_relaxed);
+    atomic_store_explicit(&slot->values[metric], value + amount, memory_order_relaxed);
+}
+
+static inline void metricsFrame(MetricsSlot *slot, uint64_t cycles, uint64_t instructions, bool skipped)
+{
+    if(!slot) return;
+    metricsAdd(slot, METRIC_FRAMES, 1);
+    metricsAdd(slot, METRIC_FRAMES_SKIPPED, skipped);
+    metricsAdd(slot, METRIC_CYCLES, cycles);
+    metricsAdd(slot, METRIC_INSTRUCTIONS, instructions);
+}
+
+#endif // !METRICS_H
@@ -2,13 +2,63 @@
     #define MMU_H
     #include <stdint.h>
     #include <stdbool.h>
+    #include <stdatomic.h>
 
     #define HEADER_ROM_SIZE_OFFSET 0x0148
     #define HEADER_RAM_SIZE_OFFSET 0x0149
 
+    #define VRAM_SIZE      0x2000
+    #define WRAM_SIZE      0x2000
+    #define MMU_PAGE_SHIFT 10                          // 1 KB pages in the read/write maps
+    #define MMU_PAGE_SIZE  (1 << MMU_PAGE_SHIFT)
+    #define MMU_PAGE_COUNT (0x10000 >> MMU_PAGE_SHIFT)
+    #define MMU_WRAM_PAGES (WRAM_SIZE / MMU_PAGE_SIZE)
+    #define MMU_TIME_SAMPLE 64                         // Slow path accesses per timed one, a power of two
+
+    #define JOYPAD_RIGHT  (1 << 0)
+    #define JOYPAD_LEFT   (1 << 1)
+    #define JOYPAD_UP     (1 << 2)
+    #define JOYPAD_DOWN   (1 << 3)
+    #define JOYPAD_A      (1 << 4)
+    #define JOYPAD_B      (1 << 5)
+    #define JOYPAD_SELECT (1 << 6)
+    #define JOYPAD_START  (1 << 7)
+
+    #define INT_VBLANK    (1 << 0) // IF/IE bits
+    #define INT_STAT      (1 << 1)
+    #define INT_TIMER     (1 << 2)
+    #define INT_SERIAL    (1 << 3)
+    #define INT_JOYPAD    (1 << 4)
+
+    #define MMU_WATCH_READ  (1 << 0) // Page kept off the read map for the debugger
+    #define MMU_WATCH_WRITE (1 << 1) // Page kept off the write map for the debugger
+
+struct PPU;
+struct APU;
+struct Serial;
+struct Debugger;
+
+typedef struct
+{
+    uint8_t   *data;
+    uint32_t   size;         // Bytes, padded up to the banks the header declares
+    uint8_t    romBankCount;
+    uint8_t    ramBankCount;
+    atomic_int refs;         // Instances sharing this image
+} Rom;
+
+// Reference counted memory shared copy-on-write between cloned instances
+typedef struct
+{
+    atomic_int refs;
+    uint8_t    data[];
+} MemoryPage;
+
 typedef struct 
 {
-    uint8_t *romData;
+    Rom     *rom;          // Shared, read-only
+    const uint8_t *romData;
+    uint8_t *ramData;      // Cartridge RAM, ramBankCount * 8 KB
     uint8_t  romBankCount;
     uint8_t  ramBankCount;
 
@@ -18,19 +68,55 @@ typedef struct
     uint8_t  currentRomBank;
     uint8_t  currentRamBank;
 
-    uint8_t  vram[8192];
-    uint8_t  wram[8192];
+    // VRAM is one page so the renderer always sees it contiguous, WRAM is split in 1 KB pages
+    MemoryPage *vramPage;
+    MemoryPage *wramPages[MMU_WRAM_PAGES];
+    uint8_t    *vram;      // vramPage->data
+
+    const uint8_t *readMap [MMU_PAGE_COUNT]; // Direct read pointer per page, NULL takes the slow path
+    uint8_t       *writeMap[MMU_PAGE_COUNT]; // Direct write pointer for pages this instance owns alone
+    const uint8_t *mappedRead [MMU_PAGE_COUNT]; // What the maps point at when the page is not watched
+    uint8_t       *mappedWrite[MMU_PAGE_COUNT];
+    uint8_t        watchPages [MMU_PAGE_COUNT]; // MMU_WATCH_* bits
+
     uint8_t  hram[127];
     uint8_t  oam [160];
     
     uint8_t  ieRegisters;
+    uint8_t  interruptFlags; // IF, requested interrupts
+
+    uint8_t  joypad;       // Buttons held, JOYPAD_* bits
+    uint8_t  joypadSelect; // P1 select bits 4-5 as last written
+
+    struct PPU *ppu;      // PPU owning the LCD registers and watching VRAM/OAM writes
+    struct APU *apu;      // APU owning the sound registers and wave RAM
+    struct Serial *serial; // Link port owning SB and SC
+    struct Debugger *debugger; // Told about every access to a watched page
+
+    bool     timed;        // Count and sample the slow paths, only while Stats shows them
+    uint64_t slowAccesses; // Reads and writes that missed the page maps, counted while timed
+    uint64_t slowTime;     // Nanoseconds in the slow paths, extrapolated from every MMU_TIME_SAMPLE-th access
 } MMU;
 
-int     initMMU     (MMU *mmu, const char *filename);
+Rom    *romCreate   (const uint8_t *image, uint32_t size);
+Rom    *romLoad     (const char *filename);
+void    romRetain   (Rom *rom);
+void    romRelease  (Rom *rom);
+uint64_t romHash    (const Rom *rom);
+
+int     initMMU     (MMU *mmu, Rom *rom);
+int     cloneMMU    (MMU *clone, MMU *mmu);
 void    freeMMU     (MMU *mmu);
+void    mmuRemap    (MMU *mmu);
+void    mmuWatchPage(MMU *mmu, int page, uint8_t watch); // MMU_WATCH_* bits, 0 restores the direct pointers
+
+void    mmuSetJoypad(MMU *mmu, uint8_t buttons); // Requests the joypad interrupt on new presses
+
+uint8_t *mmuVramWritable(MMU *mmu);           // Unshares VRAM
+uint8_t *mmuWramWritable(MMU *mmu, int page); // Unshares one WRAM page
 
-uint8_t ioReadByte  (uint16_t address);
-void    ioWriteByte (uint16_t address, uint8_t value);
+uint8_t ioReadByte  (MMU *mmu, uint16_t address);
+void    ioWriteByte (MMU *mmu, uint16_t address, uint8_t value);
 
 uint8_t mmuReadByte (MMU *mmu, uint16_t address);
 void    mmuWriteByte(MMU *mmu, uint16_t address, uint8_t value);
@@ -0,0 +1,29 @@
+#ifndef MOVIE_H
+    #define MOVIE_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include "gameboy.h"
+
+    #define MOVIE_MAGIC   0x564D4247u // "GBMV" little-endian
+    #define MOVIE_VERSION 1
+
+// A movie is the machine state it starts from plus the buttons held on every
+// frame after it. Replaying it on the same ROM reproduces the run bit for bit.
+// File layout, little-endian:
+//   magic u32, version u16, reserved u16, ROM hash u64, frames u64,
+//   state size u32, run count u32, save state, then (count varint, buttons u8) runs
+typedef struct Movie Movie;
+
+Movie   *movieRecord (const GameBoy *gb);              // Start recording from the current state
+int      movieAddFrame(Movie *movie, uint8_t buttons); // Buttons held for the next recorded frame
+int      movieSave   (const Movie *movie, const char *filename);
+
+Movie   *movieLoad   (const char *filename);
+int      movieStart  (Movie *movie, GameBoy *gb);      // Check the ROM and load the initial state
+int      movieInput  (Movie *movie, uint64_t frame, uint8_t *buttons); // 1 past the end
+
+uint64_t movieFrames (const Movie *movie);
+void     movieDestroy(Movie *movie);
+
+#endif // !MOVIE_H
@@ -0,0 +1,50 @@
+#ifndef PACER_H
+    #define PACER_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <stdbool.h>
+
+    #define PACER_SPIN_MIN      50000   // Nanoseconds always spun before a deadline
+    #define PACER_SPIN_MAX      2000000 // Upper bound on the learned sleep overshoot
+    #define PACER_MAX_SKEW      0.005   // Largest resampling ratio nudge, either way
+    #define PACER_AUDIO_TARGET  2048    // Ring fill, in stereo frames, the rate control aims for
+    #define PACER_MAX_SKIP      4       // Consecutive frames left unrendered while behind schedule
+    #define PACER_SPEED_WINDOW  1000000000 // Nanoseconds the speed readout is averaged over
+
+// Frame pacing against CLOCK_MONOTONIC: sleep to just before the deadline,
+// then spin the rest so wake-up jitter does not end up in frame times.
+typedef struct 
+{
+    uint64_t period;     // Nanoseconds per frame
+    uint64_t deadline;   // End of the current frame
+    uint64_t margin;     // Time left to spin after sleeping, tracks the scheduler's overshoot
+
+    double   fill;       // Smoothed audio ring fill
+    double   rate;       // Last resampling ratio handed out
+
+    int      skipping;   // Frames skipped in a row
+
+    uint64_t speedStart; // Start of the current speed window
+    uint64_t speedFrames;
+
+    uint64_t frames;
+    uint64_t late;       // Frames that missed their deadline by a whole period
+    uint64_t skipped;    // Frames never rendered
+} Pacer;
+
+void   pacerInit     (Pacer *pacer, double frameRate);
+void   pacerReset    (Pacer *pacer); // Restart the schedule from now, after running unthrottled
+void   pacerWait     (Pacer *pacer); // Block until the current frame's deadline
+
+// Whether the next frame is worth rendering: unthrottled frames are shown at
+// the frame rate, throttled ones are skipped while running behind schedule
+bool   pacerShouldRender(Pacer *pacer, bool unthrottled);
+
+// Counts an emulated frame, true once per window with the achieved speed multiple
+bool   pacerSpeed    (Pacer *pacer, double *speed);
+
+// Resampling ratio that steers the ring towards the target fill
+double pacerAudioRate(Pacer *pacer, size_t fill, size_t target);
+
+#endif // !PACER_H
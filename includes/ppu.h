@@ -2,12 +2,15 @@
     #define PPU_H
 
     #include <stdint.h>
-    #include <SDL2/SDL.h>
     #include "mmu.h"
 
     #define SCREEN_WIDTH 160
     #define SCREEN_HEIGHT 144
 
+    #define PPU_JOURNAL_SIZE       4096 // VRAM/OAM writes remembered before a forced flush
+    #define PPU_MAX_RENDER_THREADS 8
+    #define PPU_LOG_SIZE           (1 << 16) // Entries in the emulation -> PPU worker log
+
 typedef enum 
 {
     PPU_MODE_HBLANK = 0,
@@ -16,7 +19,34 @@ typedef enum
     PPU_MODE_VRAM   = 3
 } PPUMode;
 
-typedef struct 
+typedef enum
+{
+    PPU_RENDER_IMMEDIATE = 0, // Rasterize each line at the end of its VRAM mode
+    PPU_RENDER_DEFERRED  = 1, // Latch line state, rasterize the whole frame at VBlank
+    PPU_RENDER_THREADED  = 2  // Replay a write log on a worker thread, one frame behind
+} PPURenderMode;
+
+typedef struct
+{
+    uint8_t  LCDC;
+    uint8_t  SCY;
+    uint8_t  SCX;
+    uint8_t  BGP;
+    uint8_t  WY;
+    uint8_t  WX;
+} PPULineRegs;
+
+typedef struct
+{
+    uint16_t address;     // VRAM or OAM address written
+    uint8_t  line;        // First scanline that sees the new value
+    uint8_t  oldValue;    // Value before the write, restored when rewinding
+} PPUJournalEntry;
+
+typedef struct PPUDeferred PPUDeferred;
+typedef struct PPUPipeline PPUPipeline;
+
+typedef struct PPU
 {
     uint8_t  LCDC;        // LCD Control Register
     uint8_t  STAT;        // LCD Status Register
@@ -27,23 +57,48 @@ typedef struct
     uint8_t  BGP;         // Background Palette Data
     uint8_t  OBP0;        // Object Palette 0 Data
     uint8_t  OBP1;        // Object Palette 1 Data
+    uint8_t  WY;          // Window Y Position
+    uint8_t  WX;          // Window X Position + 7
 
     int      modeClock;
+    uint32_t frameClock;  // Cycles since the start of the current frame
+    uint64_t frames;      // Frames completed (VBlank entries) since reset
     PPUMode  mode;         // Current PPU mode
 
     //TODO: Add upscaling
     uint32_t frameBuffer[SCREEN_HEIGHT][SCREEN_WIDTH]; // Frame buffer for rendering 
+    uint32_t lineHash[SCREEN_HEIGHT];  // Hash of each scanline as last rendered
+    bool     lineDirty[SCREEN_HEIGHT]; // Scanline changed since the last present
+    bool     frameDirty;               // At least one scanline is dirty
 
-    SDL_Window *window;   // SDL window for rendering
-    SDL_Renderer *renderer; // SDL renderer for drawing
-    SDL_Texture *texture; // SDL texture for the frame buffer
+    PPURenderMode   renderMode;
+    bool            suppressRender;            // Speculative frames: keep timing, skip rasterization
+    PPULineRegs     lineRegs[SCREEN_HEIGHT];   // Registers latched for each scanline
+    int             journalCount;              // Journaled VRAM/OAM writes (deferred mode)
+    uint8_t         linesLatched;              // Scanlines latched so far this frame
+    uint8_t         linesRendered;             // Scanlines already rasterized this frame
+    PPUDeferred    *deferred;                  // Scratch memory and band threads (deferred mode)
+    PPUPipeline    *pipeline;                  // Write log and worker thread (threaded mode)
+    uint64_t        renderTime;                // Nanoseconds rasterizing on the emulation thread
 } PPU;
 
 int initPPU(PPU *ppu);
+void clonePPU(PPU *clone, PPU *ppu, const MMU *mmu);
 void freePPU(PPU *ppu);
 
 void resetPPU(PPU *ppu);
 void ppuStep(PPU *ppu, MMU *mmu, int cycles);
-void ppuRender(PPU *ppu);
+void ppuLockFrame(PPU *ppu);   // Hold while reading frameBuffer, lineHash or lineDirty
+void ppuUnlockFrame(PPU *ppu);
+
+int     ppuSetRenderMode(PPU *ppu, const MMU *mmu, PPURenderMode mode, int threads);
+uint64_t ppuFrameHash   (PPU *ppu);
+uint64_t ppuWorkerTime  (PPU *ppu); // Nanoseconds the threaded mode worker spent busy, 0 otherwise
+void    ppuSync         (PPU *ppu);
+void    ppuResync       (PPU *ppu, const MMU *mmu); // After VRAM/OAM/registers were replaced directly
+void    ppuSuppressRender(PPU *ppu, const MMU *mmu, bool suppress);
+uint8_t ppuReadRegister (PPU *ppu, uint16_t address);
+void    ppuWriteRegister(PPU *ppu, uint16_t address, uint8_t value);
+void    ppuTrackWrite   (PPU *ppu, MMU *mmu, uint16_t address, uint8_t oldValue, uint8_t value);
 
 #endif // !PPU_H
\ No newline at end of file
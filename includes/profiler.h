@@ -0,0 +1,72 @@
+#ifndef PROFILER_H
+    #define PROFILER_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+
+    #define PROFILER_MAX_DEPTH 64 // Deeper calls are charged to the deepest tracked frame
+    #define PROFILER_TOP       40 // Rows per section of the report
+
+typedef struct 
+{
+    uint64_t  count;
+    uint64_t  cycles;
+} ProfileCounter;
+
+// Open addressing map from a 64-bit key to an index into a side array
+typedef struct 
+{
+    uint64_t *keys;     // Key + 1, 0 marks a free slot
+    uint32_t *values;
+    size_t    capacity; // Power of two
+    size_t    count;
+} ProfileMap;
+
+typedef struct 
+{
+    uint32_t  target;   // Code address of the routine, see profilerAddress
+    int32_t   parent;   // -1 for the root
+    uint64_t  calls;
+    uint64_t  cycles;   // Spent in this frame itself
+} ProfileNode;
+
+// Execution profile of one instance. Only fed by GB_PROFILE builds, see gbStep.
+typedef struct 
+{
+    ProfileCounter  opcodes[256];
+
+    ProfileMap      pcMap;      // profilerAddress -> pcs
+    uint32_t       *pcKeys;
+    ProfileCounter *pcs;
+    size_t          pcCapacity;
+
+    ProfileMap      nodeMap;    // (parent, target) -> nodes
+    ProfileNode    *nodes;      // Call tree, nodes[0] is the root
+    size_t          nodeCount;
+    size_t          nodeCapacity;
+
+    int32_t         stack[PROFILER_MAX_DEPTH + 1]; // Node per shadow stack level
+    int             depth;
+    int             overflow;   // Calls past PROFILER_MAX_DEPTH not yet returned from
+
+    uint64_t        instructions;
+    uint64_t        cycles;
+} Profiler;
+
+// ROM bank in bits 16+ for switchable ROM, the plain address everywhere else
+static inline uint32_t profilerAddress(uint16_t bank, uint16_t pc)
+{
+    return (pc >= 0x4000 && pc < 0x8000) ? ((uint32_t)bank << 16 | pc) : pc;
+}
+
+Profiler *profilerCreate (void);
+void      profilerDestroy(Profiler *profiler);
+
+// One executed instruction; the stack pointers tell taken calls and returns apart
+void      profilerRecord (Profiler *profiler, uint8_t opcode, uint32_t address, uint32_t next,
+                          uint16_t spBefore, uint16_t spAfter, int cycles);
+
+int       profilerReport (const Profiler *profiler, const char *path);    // Sorted text report
+int       profilerFolded (const Profiler *profiler, const char *path);    // Collapsed stacks for flamegraph.pl
+
+#endif // !PROFILER_H
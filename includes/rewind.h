@@ -0,0 +1,33 @@
+#ifndef REWIND_H
+    #define REWIND_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include "gameboy.h"
+
+    #define REWIND_KEY_INTERVAL 60      // Frames between keyframes
+    #define REWIND_MAX_ENTRIES  (1 << 16) // Snapshots kept at most, about 18 minutes at 60 fps
+
+typedef struct Rewind Rewind;
+
+typedef struct
+{
+    int      entries;     // Snapshots currently held
+    size_t   bytes;       // Ring bytes in use
+    size_t   capacity;    // Ring size
+    uint64_t pushed;      // Snapshots taken since creation
+    double   seconds;     // Time spent taking snapshots
+} RewindStats;
+
+// Keeps per-frame save states in a fixed-size byte ring. Every REWIND_KEY_INTERVAL
+// frames a keyframe is stored, the frames in between are stored as a zero-run
+// encoded XOR against it. The oldest keyframe group is dropped when the ring is full.
+Rewind *rewindCreate (size_t bytes);
+void    rewindDestroy(Rewind *rewind);
+
+int     rewindPush   (Rewind *rewind, const GameBoy *gb); // Snapshot the current frame
+int     rewindPop    (Rewind *rewind, GameBoy *gb);       // Restore and drop the newest snapshot
+int     rewindStep   (Rewind *rewind, GameBoy *gb);       // Go back one frame and render it again
+void    rewindStats  (const Rewind *rewind, RewindStats *stats);
+
+#endif // !REWIND_H
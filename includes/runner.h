@@ -0,0 +1,24 @@
+#ifndef RUNNER_H
+    #define RUNNER_H
+
+    #include <stdint.h>
+    #include "gameboy.h"
+
+    #define RUNNER_MAX_THREADS 64
+
+typedef struct 
+{
+    uint64_t frames;          // Frames completed across all instances
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t steals;          // Work units taken from another thread's deque
+    double   seconds;         // Wall time of the whole run
+    double   framesPerSecond; // Aggregate throughput
+    int      threads;
+} RunnerStats;
+
+// Runs every instance for the given number of frames, one frame per work unit,
+// spread over a work-stealing pool. threads <= 0 uses every online core.
+int runnerRun(GameBoy **instances, int count, int threads, uint64_t frames, RunnerStats *stats);
+
+#endif // !RUNNER_H
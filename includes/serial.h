@@ -0,0 +1,88 @@
+#ifndef SERIAL_H
+    #define SERIAL_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include "mmu.h"
+
+    #define SERIAL_BYTE_CYCLES  4096 // 8 bits at 8192 Hz on the internal clock
+    #define SERIAL_POLL_CYCLES  512  // One bit time, how often an armed slave checks for its master
+    #define SERIAL_SYNC_MS      100  // Longest a master waits on a stalled peer, in wall time
+    #define SERIAL_MESSAGE_SIZE 11   // Type, value, acknowledged transfers, 64-bit link clock
+    #define SERIAL_QUEUE_SIZE   (64 * SERIAL_MESSAGE_SIZE) // Bytes a stalled socket peer may fall behind
+
+typedef enum 
+{
+    SERIAL_LINK_NONE,   // Nothing plugged in, the master reads 0xFF
+    SERIAL_LINK_LOCAL,  // Another instance in this process
+    SERIAL_LINK_SOCKET  // Another process over a UNIX-domain socket
+} SerialLinkType;
+
+typedef struct SerialChannel SerialChannel;
+
+// Link port. Peers only talk at transfer boundaries: a slave announces when it is
+// armed and with which byte, the master takes that byte when its transfer ends
+// and sends its own back. Every message carries the sender's link clock, and
+// peers also publish it once per frame. A master ending a transfer waits until
+// its peer is armed or has caught up with it in emulated time, so linked
+// instances drift at most a frame apart. Local peers have to run on separate threads.
+typedef struct Serial
+{
+    uint8_t        SB;
+    uint8_t        SC;
+    int32_t        countdown;   // Cycles to the next transfer event, 0 when idle
+
+    SerialLinkType link;
+    bool           offline;     // Speculative frames: no messages, no capture
+    SerialChannel *channel;     // Local link, guards the peer fields on both sides
+    struct Serial *peer;
+    int            socket;      // Socket link
+    uint8_t        partial[SERIAL_MESSAGE_SIZE]; // Message split across reads
+    int            partialLength;
+    uint8_t        unsent[SERIAL_QUEUE_SIZE];    // Bytes the socket did not take yet, sent in order
+    int            unsentLength;
+    const uint64_t *cycles;     // Owning instance's cycle counter
+    uint64_t       clockBase;   // Its value when the link clock started
+    bool           clockStarted;
+
+    // What the peer last told us, written by the peer's thread under the channel lock
+    uint64_t       peerClock;   // Peer's link clock as of its last message, 0 while unknown
+    bool           peerArmed;   // Peer is waiting on an external clock
+    uint8_t        peerData;    // Its SB while armed
+    bool           received;    // A master's byte is waiting for this slave
+    uint8_t        receivedData;
+    uint64_t       receivedClock; // Master's link clock when its transfer ended
+    uint8_t        dataSent;    // Transfers this port ended as master, mod 256
+    uint8_t        dataDone;    // Transfers this port took as slave, mod 256, sent back as acknowledgement
+
+    uint8_t       *capture;     // Bytes sent as master, for test ROM output
+    size_t         captureCapacity;
+    size_t         captureLength;
+    uint64_t       transfers;
+    uint64_t       timeouts;    // Transfers that gave up waiting for the peer
+} Serial;
+
+void    initSerial         (Serial *serial, const uint64_t *cycles);
+void    freeSerial         (Serial *serial); // Disconnects
+void    cloneSerial        (Serial *clone, const Serial *serial, const uint64_t *cycles); // Unplugged copy
+
+int     serialConnectLocal (Serial *a, Serial *b);
+int     serialListen       (Serial *serial, const char *path); // Blocks until the peer connects
+int     serialConnect      (Serial *serial, const char *path);
+void    serialDisconnect   (Serial *serial);
+
+void    serialSetCapture   (Serial *serial, uint8_t *buffer, size_t capacity);
+
+uint8_t serialReadRegister (Serial *serial, uint16_t address);
+void    serialWriteRegister(Serial *serial, uint16_t address, uint8_t value);
+
+void    serialEvent        (Serial *serial, MMU *mmu); // Transfer end or slave poll
+void    serialSync         (Serial *serial);           // Publishes the link clock, once per frame
+
+static inline void serialStep(Serial *serial, MMU *mmu, int cycles)
+{
+    if(serial->countdown > 0 && (serial->countdown -= cycles) <= 0) serialEvent(serial, mmu);
+}
+
+#endif // !SERIAL_H
@@ -0,0 +1,25 @@
+#ifndef STATE_H
+    #define STATE_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include "gameboy.h"
+
+    #define STATE_MAGIC   0x53534247u // "GBSS" little-endian
+    #define STATE_VERSION 1
+
+// A save state is a small header followed by tagged sections:
+//   header  : magic u32, version u16, section count u16, ROM checksum u16, reserved u16
+//   section : tag u32, length u32, payload
+// All integers are little-endian. Loaders skip tags they do not know and read
+// only the fields a section is long enough to hold, so newer versions can
+// append fields without breaking older states. The ROM and SDL are excluded.
+
+size_t stateSize    (const GameBoy *gb);
+size_t stateSave    (const GameBoy *gb, uint8_t *buffer, size_t capacity);
+int    stateLoad    (GameBoy *gb, const uint8_t *buffer, size_t size);
+
+int    stateSaveFile(const GameBoy *gb, const char *filename);
+int    stateLoadFile(GameBoy *gb, const char *filename);
+
+#endif // !STATE_H
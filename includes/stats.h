@@ -0,0 +1,60 @@
+#ifndef STATS_H
+    #define STATS_H
+
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <stdbool.h>
+    #include "gameboy.h"
+
+    #define STATS_WINDOW 1000000000ull // Nanoseconds of wall time averaged per report
+
+// Where host time went. Subsystems keep their own nanosecond counters, sampled at
+// batch boundaries (a rendered line or frame, an APU catch-up, every
+// MMU_TIME_SAMPLE-th slow access, every 64th log message a thread queues);
+// the front end times whole frames, presents and waits.
+typedef enum
+{
+    STATS_CPU = 0, // Emulation not claimed by the buckets below
+    STATS_MMU,     // Banking, IO and tracked VRAM/OAM accesses
+    STATS_PPU,     // Rasterization on the emulation thread
+    STATS_APU,     // Channel generation and resampling
+    STATS_PRESENT, // Texture upload and buffer swap
+    STATS_LOG,     // Queueing log messages, every thread
+    STATS_IDLE,    // Sleeping in the pacer
+    STATS_OTHER,   // Wall time nothing above accounts for
+    STATS_BUCKETS
+} StatsBucket;
+
+typedef struct
+{
+    uint64_t windowStart;
+    uint64_t frames;                 // Frames emulated in the current window
+    uint64_t time[STATS_BUCKETS];    // Nanoseconds in the current window
+    uint64_t workerTime;             // Threaded PPU worker, runs beside everything else
+    uint64_t mmuAccesses;
+
+    // Subsystem counters as last read
+    uint64_t lastMmu, lastMmuAccesses, lastPpu, lastWorker, lastApu, lastLog;
+
+    // Averages over the last completed window
+    double   fps;
+    double   share[STATS_BUCKETS];   // Percent of wall time
+    double   frameMs[STATS_BUCKETS]; // Milliseconds per emulated frame
+    double   workerShare;
+    double   mmuPerFrame;            // Slow path accesses per frame
+    bool     ready;                  // A window has completed
+} Stats;
+
+extern const char *const statsBucketNames[STATS_BUCKETS];
+
+uint64_t statsClock(void); // CLOCK_MONOTONIC, nanoseconds. The clock every timer in the tree reads
+
+void statsInit  (Stats *stats, GameBoy *gb);
+void statsAdd   (Stats *stats, StatsBucket bucket, uint64_t time);
+void statsFrame (Stats *stats, GameBoy *gb, uint64_t time); // After each emulated frame, with its wall time
+bool statsUpdate(Stats *stats, bool force); // Closes the window once it is long enough, true when averages changed
+
+int  statsFormat     (const Stats *stats, char *buffer, size_t size); // One "key=value" line, without a newline
+void statsDrawOverlay(const Stats *stats, PPU *ppu);                  // Caller holds ppuLockFrame
+
+#endif // !STATS_H
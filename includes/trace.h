@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+    #define TRACE_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <stdbool.h>
+
+    #define TRACE_MAGIC          0x52544247u // "GBTR"
+    #define TRACE_VERSION        1
+    #define TRACE_KEY_INTERVAL   4096        // Records between ones stored in full
+    #define TRACE_BUFFER_SIZE    (1 << 20)   // Bytes handed to the writer thread at a time
+    #define TRACE_BUFFERS        4
+    #define TRACE_MAX_ENCODED    24          // Largest encoded record
+
+    // Record header bits: which fields follow. PC advances by one when neither PC bit is set.
+    #define TRACE_PC_NEAR  (1 << 0) // int8 PC delta
+    #define TRACE_PC_FAR   (1 << 1) // Full PC
+    #define TRACE_SP       (1 << 2)
+    #define TRACE_AF       (1 << 3)
+    #define TRACE_BC       (1 << 4)
+    #define TRACE_DE       (1 << 5)
+    #define TRACE_HL       (1 << 6)
+    #define TRACE_EXTENDED (1 << 7) // A second header byte follows
+    #define TRACE_BANK     (1 << 0) // Second byte: ROM bank follows
+    #define TRACE_CYCLES   (1 << 1) // Second byte: full cycle count instead of a one byte delta
+
+// Machine state as an instruction is about to execute
+typedef struct
+{
+    uint64_t cycles;  // GameBoy cycles so far
+    uint16_t pc;
+    uint16_t sp;
+    uint16_t af;
+    uint16_t bc;
+    uint16_t de;
+    uint16_t hl;
+    uint8_t  opcode;
+    uint8_t  bank;    // Switchable ROM bank mapped at 0x4000
+} TraceRecord;
+
+typedef struct TraceWriter TraceWriter;
+typedef struct TraceReader TraceReader;
+
+// File: magic and version (uint32 each, little endian), then one encoded record per
+// instruction. Each record is stored as the fields that differ from the previous one:
+// a header byte (TRACE_*), an optional extended byte, the opcode, then the fields in
+// header bit order, then the cycle delta. Every TRACE_KEY_INTERVAL-th record has every field.
+TraceWriter *traceOpen  (const char *path); // Starts the writer thread
+void         traceRecord(TraceWriter *trace, const TraceRecord *record);
+int          traceClose (TraceWriter *trace); // Flushes and joins, non-zero if anything failed to write
+
+TraceReader *traceReaderOpen (const char *path);
+int          traceRead       (TraceReader *reader, TraceRecord *record); // 1 read, 0 end of trace, -1 corrupt
+void         traceReaderClose(TraceReader *reader);
+
+#endif // !TRACE_H
@@ -0,0 +1,19 @@
+#ifndef WAV_H
+    #define WAV_H
+
+    #include <stdio.h>
+    #include <stdint.h>
+
+typedef struct 
+{
+    FILE    *file;
+    uint32_t rate;
+    uint32_t frames;   // Stereo frames written so far
+} WavWriter;
+
+// 16-bit stereo PCM, the sizes in the header are patched on close
+int  wavOpen (WavWriter *wav, const char *filename, uint32_t rate);
+int  wavWrite(WavWriter *wav, const int16_t (*frames)[2], size_t count);
+int  wavClose(WavWriter *wav);
+
+#endif // !WAV_H
@@ -1,8 +1,112 @@
-#include "../includes/mmu.h"
+#include "../includes/gameboy.h"
+#include "../includes/display.h"
+#include "../includes/audio.h"
+#include "../includes/runner.h"
+#include "../includes/headless.h"
+#include "../includes/state.h"
+#include "../includes/rewind.h"
+#include "../includes/movie.h"
+#include "../includes/wav.h"
+#include "../includes/pacer.h"
+#include "../includes/stats.h"
+#include "../includes/metrics.h"
+#include "../includes/debugger.h"
 #include "../includes/log.h"
-#include "../includes/cpu.h"
-#include "../includes/ppu.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct 
+{
+    PPURenderMode renderMode;
+    int           renderThreads;
+    int           instances;     // > 0 runs headless batch instances instead of the window
+    int           threads;       // Runner threads, 0 = every core
+    uint64_t      frames;        // Frames per instance in batch and headless mode
+    bool          headless;      // Run without a window and exit when done
+    uint64_t      cycles;        // Headless cycle limit
+    const char   *inputScript;   // Headless input script
+    const char   *loadState;     // Save state applied before running
+    const char   *saveState;     // Save state written when a headless run ends
+    size_t        rewindBytes;   // Rewind ring size, 0 disables rewind, R steps back while held
+    int           runAhead;      // Frames emulated ahead of the one presented
+    const char   *record;        // Movie file written when the run ends
+    const char   *replay;        // Movie file replayed instead of live input
+    const char   *wav;           // Headless audio output file
+    bool          mute;          // No audio device in window mode
+    bool          fastForward;   // Start unthrottled, holding the hotkey inverts it
+    const char   *linkListen;    // Serial link socket to wait on
+    const char   *linkConnect;   // Serial link socket to connect to
+    const char   *serialOut;     // File receiving every byte sent over the link port
+    const char   *profile;       // Profile report path, collapsed stacks go next to it (GB_PROFILE builds)
+    bool          overlay;       // Start with the host time overlay shown, F1 toggles it
+    bool          stats;         // Headless host time lines
+    const char   *metrics;       // UNIX socket serving plain text metrics
+    const char   *trace;         // Binary instruction trace output
+    bool          debug;         // Run under the debugger, prompting on stdin
+} Options;
+
+#define SERIAL_CAPTURE_BYTES (1 << 16)
+
+static int runBatch(Rom *rom, const Options *options, Metrics *metrics)
+{
+    GameBoy **instances = calloc(options->instances, sizeof(GameBoy *));
+    if(!instances) return 5; // Memory allocation error
+
+    int created = 0;
+    while(created < options->instances && (instances[created] = gbCreate(rom)))
+    {
+        char label[16];
+        snprintf(label, sizeof(label), "%d", created);
+        instances[created++]->metrics = metricsSlot(metrics, label);
+    }
+
+    int result = 0;
+    RunnerStats stats;
+    if(created < options->instances)
+    {
+        LOG_ERROR(LOG_GENERAL, "Created only %d of %d instances", created, options->instances);
+        result = 5; // Failed to create instances
+    }
+    else if(runnerRun(instances, created, options->threads, options->frames, &stats))
+        result = 6; // Runner failed
+    else
+        printf("instances=%d threads=%d frames=%llu seconds=%.3f fps=%.1f fps_per_thread=%.1f ips=%.0f steals=%llu\n",
+               created, stats.threads, (unsigned long long)stats.frames, stats.seconds, stats.framesPerSecond,
+               stats.framesPerSecond / stats.threads, stats.instructions / stats.seconds,
+               (unsigned long long)stats.steals);
+
+    for(int i = 0; i < created; ++i)
+        gbDestroy(instances[i]);
+    free(instances);
+    return result;
+}
+
+// Sets the --break and --watch points, stopping before the first instruction when there are none
+static int applyDebugOptions(Debugger *debugger, int argc, char *argv[])
+{
+    debugger->pause = true;
+    for(int i = 2; i < argc - 1; ++i)
+    {
+        if(!strcmp(argv[i], "--break"))
+            debuggerBreak(debugger, (uint16_t)strtoul(argv[++i], NULL, 16), true);
+        else if(!strcmp(argv[i], "--watch"))
+        {
+            uint16_t first, last;
+            uint8_t access;
+            if(debuggerParseWatch(argv[++i], &first, &last, &access) || debuggerWatch(debugger, first, last, access) < 0)
+            {
+                LOG_ERROR(LOG_GENERAL, "Invalid watchpoint: %s", argv[i]);
+                return 1; // Bad watchpoint
+            }
+        }
+        else
+            continue;
+        debugger->pause = false;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -12,39 +116,357 @@ int main(int argc, char *argv[])
     if(logInit())
         return 2; // Failed to initialize logging
 
-    MMU mmu;
-    if(initMMU(&mmu, argv[1]))
+    Options options = { PPU_RENDER_IMMEDIATE, 1, 0, 0, 600, false, 0, NULL, NULL, NULL, 0, 0, NULL, NULL, NULL, false, false,
+                         NULL, NULL, NULL, NULL, false, false, NULL, NULL, false };
+    bool framesGiven = false;
+    for(int i = 2; i < argc; ++i)
     {
+        if(!strcmp(argv[i], "--log") && i + 1 < argc)
+        {
+            int level = logParseLevel(argv[++i]);
+            if(level >= 0) logSetLevel(level);
+        }
+        else if(!strcmp(argv[i], "--log-file") && i + 1 < argc)
+            logSetOutput(argv[++i]);
+        else if(!strcmp(argv[i], "--log-binary") && i + 1 < argc)
+            logSetBinaryOutput(argv[++i], 4 << 20);
+        else if(!strcmp(argv[i], "--threaded"))
+            options.renderMode = PPU_RENDER_THREADED;
+        else if(!strcmp(argv[i], "--deferred"))
+        {
+            int threads = (i + 1 < argc) ? atoi(argv[i + 1]) : 0;
+            if(threads > 0) ++i;
+            options.renderMode = PPU_RENDER_DEFERRED;
+            options.renderThreads = threads ? threads : 1;
+        }
+        else if(!strcmp(argv[i], "--instances") && i + 1 < argc)
+            options.instances = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--threads") && i + 1 < argc)
+            options.threads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--frames") && i + 1 < argc)
+        {
+            options.frames = strtoull(argv[++i], NULL, 10);
+            framesGiven = true;
+        }
+        else if(!strcmp(argv[i], "--headless"))
+            options.headless = true;
+        else if(!strcmp(argv[i], "--cycles") && i + 1 < argc)
+            options.cycles = strtoull(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "--input") && i + 1 < argc)
+            options.inputScript = argv[++i];
+        else if(!strcmp(argv[i], "--load-state") && i + 1 < argc)
+            options.loadState = argv[++i];
+        else if(!strcmp(argv[i], "--save-state") && i + 1 < argc)
+            options.saveState = argv[++i];
+        else if(!strcmp(argv[i], "--rewind") && i + 1 < argc)
+            options.rewindBytes = strtoull(argv[++i], NULL, 10) << 20; // Megabytes
+        else if(!strcmp(argv[i], "--run-ahead") && i + 1 < argc)
+            options.runAhead = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--record") && i + 1 < argc)
+            options.record = argv[++i];
+        else if(!strcmp(argv[i], "--replay") && i + 1 < argc)
+            options.replay = argv[++i];
+        else if(!strcmp(argv[i], "--wav") && i + 1 < argc)
+            options.wav = argv[++i];
+        else if(!strcmp(argv[i], "--mute"))
+            options.mute = true;
+        else if(!strcmp(argv[i], "--fast-forward"))
+            options.fastForward = true;
+        else if(!strcmp(argv[i], "--link-listen") && i + 1 < argc)
+            options.linkListen = argv[++i];
+        else if(!strcmp(argv[i], "--link-connect") && i + 1 < argc)
+            options.linkConnect = argv[++i];
+        else if(!strcmp(argv[i], "--serial-out") && i + 1 < argc)
+            options.serialOut = argv[++i];
+        else if(!strcmp(argv[i], "--profile") && i + 1 < argc)
+            options.profile = argv[++i];
+        else if(!strcmp(argv[i], "--overlay"))
+            options.overlay = true;
+        else if(!strcmp(argv[i], "--stats"))
+            options.stats = true;
+        else if(!strcmp(argv[i], "--metrics") && i + 1 < argc)
+            options.metrics = argv[++i];
+        else if(!strcmp(argv[i], "--trace") && i + 1 < argc)
+            options.trace = argv[++i];
+        else if(!strcmp(argv[i], "--debug"))
+            options.debug = true;
+        else if((!strcmp(argv[i], "--break") || !strcmp(argv[i], "--watch")) && i + 1 < argc)
+        {
+            options.debug = true; // Applied once the instance exists
+            ++i;
+        }
+    }
+    if(options.cycles && !framesGiven) options.frames = 0; // Only the cycle limit applies
+
+    Rom *rom = romLoad(argv[1]);
+    if(!rom)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to load ROM file: %s", argv[1]);
         logFree();
-        LOG("Failed to initialize MMU with ROM file: %s", argv[1]);
-        return 3; // Failed to initialize MMU
+        return 3; // Failed to load ROM
     }
 
-    CPU cpu;
-    cpuReset(&cpu);
-    LOG("CPU initialized");
+    if(options.instances > 0)
+    {
+        Metrics *metrics = options.metrics ? metricsStart(options.metrics) : NULL;
+        int result = options.metrics && !metrics ? 16 : runBatch(rom, &options, metrics); // 16: metrics setup failed
+        metricsStop(metrics);
+        romRelease(rom);
+        logFree();
+        return result;
+    }
 
-    PPU ppu;
-    if(initPPU(&ppu))
+    GameBoy *gb = gbCreate(rom);
+    romRelease(rom); // The instance keeps its own reference
+    if(!gb)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to initialize emulator with ROM file: %s", argv[1]);
+        logFree();
+        return 3; // Failed to initialize emulator
+    }
+    if(options.renderMode != PPU_RENDER_IMMEDIATE)
+        ppuSetRenderMode(&gb->ppu, &gb->mmu, options.renderMode, options.renderThreads);
+    if(options.loadState && stateLoadFile(gb, options.loadState))
     {
-        freeMMU(&mmu);
+        gbDestroy(gb);
         logFree();
-        LOG("Failed to initialize PPU");
-        return 4; // Failed to initialize PPU
+        return 8; // Failed to load save state
     }
 
-    LOG("PPU initialized, starting emulation...");
-    while(1)
+    Movie *replay = options.replay ? movieLoad(options.replay) : NULL;
+    if(options.replay && (!replay || movieStart(replay, gb)))
     {
-        int cycles = cpuStep(&cpu, &mmu);
-        ppuStep(&ppu, &mmu, cycles);
+        movieDestroy(replay);
+        gbDestroy(gb);
+        logFree();
+        return 10; // Failed to start movie replay
+    }
+    if(replay && !framesGiven && !options.cycles) options.frames = movieFrames(replay);
 
-        if(ppu.LY == SCREEN_HEIGHT) ppuRender(&ppu);
+    if((options.linkListen && serialListen(&gb->serial, options.linkListen))
+       || (options.linkConnect && serialConnect(&gb->serial, options.linkConnect)))
+    {
+        movieDestroy(replay);
+        gbDestroy(gb);
+        logFree();
+        return 13; // Failed to set up the link cable
+    }
+#ifdef GB_PROFILE
+    if(options.profile && !(gb->profiler = profilerCreate()))
+        LOG_ERROR(LOG_GENERAL, "Running without the profiler");
+#else
+    if(options.profile)
+        LOG_WARN(LOG_GENERAL, "--profile needs a build configured with -DGB_PROFILE=ON");
+#endif
+    uint8_t *serialCapture = options.serialOut ? malloc(SERIAL_CAPTURE_BYTES) : NULL;
+    if(serialCapture) serialSetCapture(&gb->serial, serialCapture, SERIAL_CAPTURE_BYTES);
+
+    Movie  *record = options.record ? movieRecord(gb) : NULL; // Starts from the state replay or load left
+    Rewind *rewind = options.rewindBytes ? rewindCreate(options.rewindBytes) : NULL;
+    LOG("Emulator initialized");
+
+    // Audio goes to a WAV file when headless, to the sound device otherwise
+    AudioRing *ring = NULL;
+    if(options.headless ? options.wav != NULL : !options.mute)
+    {
+        ring = aligned_alloc(_Alignof(AudioRing), sizeof(AudioRing));
+        if(ring)
+        {
+            audioRingInit(ring);
+            apuSetOutput(&gb->apu, ring);
+        }
+        else
+            LOG_ERROR(LOG_GENERAL, "Failed to allocate audio ring, running without sound");
+    }
+
+    Metrics *metrics = options.metrics ? metricsStart(options.metrics) : NULL;
+    gb->metrics = metricsSlot(metrics, "0");
+    TraceWriter *trace = options.trace ? traceOpen(options.trace) : NULL;
+    gb->trace = trace;
+
+    int result = 0;
+    Debugger *debugger = options.debug ? debuggerCreate(gb) : NULL;
+    if(debugger && options.runAhead)
+    {
+        LOG_WARN(LOG_GENERAL, "Run-ahead is disabled while debugging");
+        options.runAhead = 0;
+    }
+
+    if(options.debug && (!debugger || applyDebugOptions(debugger, argc, argv)))
+        result = 18; // Failed to set up the debugger
+    else if(options.metrics && !metrics)
+        result = 16; // Failed to set up metrics
+    else if(options.trace && !trace)
+        result = 17; // Failed to start the trace
+    else if(options.headless)
+    {
+        WavWriter wav = { NULL, 0, 0 };
+        HeadlessOptions headless = { options.frames, options.cycles, options.inputScript, rewind, options.runAhead,
+                                     record, replay, ring ? &wav : NULL, options.stats, debugger };
+        if(ring && wavOpen(&wav, options.wav, APU_OUTPUT_RATE))
+            result = 12; // Failed to open WAV file
+        else
+            result = headlessRun(gb, &headless) ? 7 : 0; // 7: headless run failed
+        if(wavClose(&wav) && !result)
+            result = 12; // Failed to finish WAV file
+        if(!result && options.saveState && stateSaveFile(gb, options.saveState))
+            result = 9; // Failed to write save state
+    }
+    else
+    {
+        Display display;
+        if(initDisplay(&display))
+        {
+            LOG_ERROR(LOG_GENERAL, "Failed to initialize display");
+            result = 4; // Failed to initialize display
+        }
+        else
+        {
+            Audio audio;
+            if(ring && initAudio(&audio, ring))
+            {
+                apuSetOutput(&gb->apu, NULL); // Keep running silently
+                free(ring);
+                ring = NULL;
+            }
+
+            Pacer pacer;
+            pacerInit(&pacer, GB_FRAME_RATE);
+            InputSnapshot input = { 0 };
+            bool fastForward = false;
+            Stats stats;
+            statsInit(&stats, gb);
+            display.overlay = options.overlay ? &stats : NULL;
+            bool overlayHeld = false;
+            bool rewinding = false;
+            // Movies, the debugger and a link peer follow every frame forwards
+            bool rewindable = rewind && !record && !replay && !debugger && gb->serial.link == SERIAL_LINK_NONE;
+
+            LOG("Display initialized, starting emulation...");
+            for(uint64_t frame = 0; ; ++frame)
+            {
+                displayPollInput(&display, &input);
+                unsigned state = inputLatest(&input);
+                if(state & INPUT_QUIT) break;
+
+                // Holding the hotkey inverts the command line setting
+                if(fastForward != (options.fastForward != !!(state & INPUT_FAST_FORWARD)))
+                {
+                    fastForward = !fastForward;
+                    if(ring) apuSetOutput(&gb->apu, fastForward || rewinding ? NULL : ring); // Drop audio while unthrottled
+                    if(!fastForward) pacerReset(&pacer);
+                    LOG_DEBUG(LOG_GENERAL, "Fast forward %s", fastForward ? "on" : "off");
+                }
+                if((state & INPUT_OVERLAY) && !overlayHeld)
+                    display.overlay = display.overlay ? NULL : &stats;
+                overlayHeld = state & INPUT_OVERLAY;
+
+                if(rewinding != (rewindable && (state & INPUT_REWIND)))
+                {
+                    rewinding = !rewinding;
+                    if(ring) apuSetOutput(&gb->apu, fastForward || rewinding ? NULL : ring); // Nothing to hear backwards
+                    LOG_DEBUG(LOG_GENERAL, "Rewind %s", rewinding ? "on" : "off");
+                }
+                if(rewinding)
+                {
+                    rewindStep(rewind, gb); // Stays on the oldest frame once the ring runs out
+                    displayPresent(&display, &gb->ppu);
+                    if(!fastForward) pacerWait(&pacer);
+                    continue;
+                }
+
+                uint8_t buttons = state & INPUT_BUTTONS;
+                if(replay) movieInput(replay, frame, &buttons); // Live input takes over past the end
+                gbSetButtons(gb, buttons);
+                if(record) movieAddFrame(record, gb->mmu.joypad);
+
+                // Slow path sampling only runs while something shows the result
+                gb->mmu.timed = display.overlay
+                                || (LOG_LEVEL_FLOOR <= LOG_LEVEL_DEBUG && logEnabled(LOG_LEVEL_DEBUG, LOG_GENERAL));
+                bool render = pacerShouldRender(&pacer, fastForward);
+                uint64_t instructions = gb->instructions;
+                uint64_t mark = statsClock();
+                int cycles = 0;
+                if(!debugger)
+                    cycles = gbRunFrameAhead(gb, options.runAhead, render);
+                else if(!debuggerFrame(debugger, stdin, stdout, &cycles))
+                    break; // Quit at the prompt
+                statsFrame(&stats, gb, statsClock() - mark);
+                metricsFrame(gb->metrics, cycles, gb->instructions - instructions, !render);
+                if(rewind) rewindPush(rewind, gb);
+                if(render)
+                {
+                    mark = statsClock();
+                    displayPresent(&display, &gb->ppu);
+                    statsAdd(&stats, STATS_PRESENT, statsClock() - mark);
+                }
+
+                double speed;
+                if(pacerSpeed(&pacer, &speed))
+                    displaySetSpeed(&display, speed, fastForward);
+                if(statsUpdate(&stats, false))
+                    LOG_DEBUG(LOG_GENERAL, "Host time: %.1f fps, cpu %.1f%%, mmu %.1f%%, ppu %.1f%%, apu %.1f%%, "
+                              "present %.1f%%, idle %.1f%%",
+                              stats.fps, stats.share[STATS_CPU], stats.share[STATS_MMU], stats.share[STATS_PPU],
+                              stats.share[STATS_APU], stats.share[STATS_PRESENT], stats.share[STATS_IDLE]);
+
+                if(fastForward) continue;
+                if(ring)
+                {
+                    size_t fill = audioRingFill(ring);
+                    apuSetRate(&gb->apu, pacerAudioRate(&pacer, fill, PACER_AUDIO_TARGET));
+                    if(fill < PACER_AUDIO_TARGET / 2)
+                    {
+                        pacerReset(&pacer); // Run ahead of real time until the ring is primed, the schedule starts after
+                        continue;
+                    }
+                }
+                mark = statsClock();
+                pacerWait(&pacer);
+                statsAdd(&stats, STATS_IDLE, statsClock() - mark);
+            }
+            LOG_INFO(LOG_GENERAL, "Paced %llu frames, %llu late, %llu skipped", (unsigned long long)pacer.frames,
+                     (unsigned long long)pacer.late, (unsigned long long)pacer.skipped);
+            if(ring) freeAudio(&audio);
+            freeDisplay(&display);
+        }
+    }
+
+    debuggerDestroy(debugger);
+    gb->trace = NULL;
+    if(traceClose(trace) && !result)
+        result = 17; // Failed to write the trace
+    if(record && movieSave(record, options.record) && !result)
+        result = 11; // Failed to write movie
+#ifdef GB_PROFILE
+    if(gb->profiler)
+    {
+        char folded[4096];
+        snprintf(folded, sizeof(folded), "%s.folded", options.profile);
+        if((profilerReport(gb->profiler, options.profile) || profilerFolded(gb->profiler, folded)) && !result)
+            result = 15; // Failed to write profile
+    }
+#endif
+    if(options.serialOut)
+    {
+        FILE *file = serialCapture ? fopen(options.serialOut, "wb") : NULL;
+        size_t length = gb->serial.captureLength;
+        if(!file || fwrite(serialCapture, 1, length, file) != length)
+        {
+            LOG_ERROR(LOG_GENERAL, "Failed to write serial output: %s", options.serialOut);
+            if(!result) result = 14; // Failed to write serial output
+        }
+        if(file) fclose(file);
     }
 
-    freePPU(&ppu);
     LOG("Emulation finished, freeing resources...");
-    freeMMU(&mmu);
+    metricsStop(metrics);
+    movieDestroy(record);
+    movieDestroy(replay);
+    rewindDestroy(rewind);
+    gbDestroy(gb);
+    free(serialCapture);
+    free(ring);
     logFree();
-    return 0; // Success
-}
\ No newline at end of file
+    return result;
+}
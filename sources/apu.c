@@ -0,0 +1,477 @@
+#define _POSIX_C_SOURCE 200809L // pthread_once
+
+#include "../includes/apu.h"
+#include "../includes/log.h"
+#include "../includes/stats.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#define NR10 0x00
+#define NR30 0x0A
+#define NR43 0x12
+#define NR50 0x14
+#define NR51 0x15
+#define NR52 0x16
+#define WAVE 0x20
+
+#define APU_PI 3.14159265358979323846
+
+#define CH_SQUARE1 0
+#define CH_SQUARE2 1
+#define CH_WAVE    2
+#define CH_NOISE   3
+
+static const uint8_t channelBase[4] = { 0x00, 0x05, 0x0A, 0x0F }; // NRx0, NRx1 is base + 1
+
+// Bits that always read as 1, 0xFF10-0xFF2F
+static const uint8_t readMask[0x20] =
+{
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF,
+    0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const uint8_t dutyTable[4] = { 0x01, 0x81, 0x87, 0x7E }; // Bit n is duty step n
+static const uint8_t noiseDivisor[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+static float firTable[APU_FIR_PHASES][APU_FIR_TAPS];
+static pthread_once_t firOnce = PTHREAD_ONCE_INIT;
+
+// Blackman windowed sinc, one row per fractional offset, each row normalized to unity gain
+static void buildFirTable(void)
+{
+    const double cutoff = 20000.0 / (APU_CLOCK_RATE / APU_SAMPLE_CYCLES); // Cycles per input sample
+    for(int phase = 0; phase < APU_FIR_PHASES; ++phase)
+    {
+        double offset = (double)phase / APU_FIR_PHASES, sum = 0;
+        double row[APU_FIR_TAPS];
+        for(int tap = 0; tap < APU_FIR_TAPS; ++tap)
+        {
+            double x = tap - APU_FIR_TAPS / 2 + 1 - offset;     // Distance from the output instant
+            double u = (x + APU_FIR_TAPS / 2) / APU_FIR_TAPS;   // Window position, 0..1
+            double sinc = x == 0 ? 1.0 : sin(2 * APU_PI * cutoff * x) / (2 * APU_PI * cutoff * x);
+            double window = 0.42 - 0.5 * cos(2 * APU_PI * u) + 0.08 * cos(4 * APU_PI * u);
+            row[tap] = sinc * window;
+            sum += row[tap];
+        }
+        for(int tap = 0; tap < APU_FIR_TAPS; ++tap)
+            firTable[phase][tap] = (float)(row[tap] / sum);
+    }
+}
+
+static uint16_t frequency(const APU *apu, int channel)
+{
+    uint8_t base = channelBase[channel];
+    return (uint16_t)((apu->regs[base + 4] & 0x07) << 8 | apu->regs[base + 3]);
+}
+
+static int32_t period(const APU *apu, int channel)
+{
+    if(channel == CH_NOISE)
+    {
+        uint8_t nr43 = apu->regs[NR43];
+        return (int32_t)noiseDivisor[nr43 & 0x07] << (nr43 >> 4);
+    }
+    return (2048 - frequency(apu, channel)) * (channel == CH_WAVE ? 2 : 4);
+}
+
+static bool dacEnabled(const APU *apu, int channel)
+{
+    if(channel == CH_WAVE) return apu->regs[NR30] & 0x80;
+    return apu->regs[channelBase[channel] + 2] & 0xF8;
+}
+
+static void audioReset(APU *apu)
+{
+    apu->buffered = APU_FIR_TAPS - 1; // Silent history
+    memset(apu->left, 0, sizeof(apu->left));
+    memset(apu->right, 0, sizeof(apu->right));
+    apu->position = (uint64_t)(APU_FIR_TAPS - 1) << 32;
+    apu->highPass[0] = apu->highPass[1] = 0;
+    apu->lastInput[0] = apu->lastInput[1] = 0;
+}
+
+void initAPU(APU *apu)
+{
+    pthread_once(&firOnce, buildFirTable);
+    memset(apu, 0, sizeof(APU));
+
+    // Register values the boot ROM leaves behind
+    static const uint8_t boot[0x17] =
+    {
+        0x80, 0xBF, 0xF3, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, 0xFF, 0xBF, 0x7F, 0xFF,
+        0x9F, 0xFF, 0xBF, 0xFF, 0xFF, 0x00, 0x00, 0xBF, 0x77, 0xF3, 0x80
+    };
+    memcpy(apu->regs, boot, sizeof(boot));
+    for(int channel = 0; channel < 4; ++channel)
+        apu->channels[channel].lfsr = 0x7FFF;
+    apu->sequencerSamples = APU_BLOCK_SAMPLES;
+    apu->rate = 1.0;
+    apuSetRate(apu, 1.0);
+    audioReset(apu);
+    LOG_DEBUG(LOG_IO, "APU reset to default state");
+}
+
+void apuSetOutput(APU *apu, AudioRing *ring)
+{
+    apuCatchUp(apu);
+    apu->ring = ring;
+    audioReset(apu);
+}
+
+void apuSetRate(APU *apu, double rate)
+{
+    apu->rate = rate;
+    double step = (double)(APU_CLOCK_RATE / APU_SAMPLE_CYCLES) / APU_OUTPUT_RATE * rate;
+    apu->step = (uint64_t)(step * 4294967296.0);
+}
+
+// Sweep calculation, disables channel 1 on overflow
+static uint16_t sweepTarget(APU *apu)
+{
+    uint8_t nr10 = apu->regs[NR10];
+    uint16_t delta = apu->sweepShadow >> (nr10 & 0x07);
+    uint16_t target = (nr10 & 0x08) ? apu->sweepShadow - delta : apu->sweepShadow + delta;
+    if(target > 2047) apu->channels[CH_SQUARE1].enabled = false;
+    return target;
+}
+
+static void trigger(APU *apu, int channel)
+{
+    APUChannel *ch = &apu->channels[channel];
+    uint8_t base = channelBase[channel];
+
+    ch->enabled = dacEnabled(apu, channel);
+    if(!ch->length) ch->length = channel == CH_WAVE ? 256 : 64;
+    ch->timer = period(apu, channel);
+    ch->volume = apu->regs[base + 2] >> 4;
+    ch->envelopeTimer = apu->regs[base + 2] & 0x07;
+    if(channel == CH_WAVE)  ch->position = 0;
+    if(channel == CH_NOISE) ch->lfsr = 0x7FFF;
+
+    if(channel == CH_SQUARE1)
+    {
+        uint8_t nr10 = apu->regs[NR10];
+        apu->sweepShadow = frequency(apu, CH_SQUARE1);
+        apu->sweepTimer = (nr10 >> 4) & 0x07 ? (nr10 >> 4) & 0x07 : 8;
+        apu->sweepEnabled = (nr10 & 0x77) != 0;
+        if(nr10 & 0x07) sweepTarget(apu);
+    }
+}
+
+static void sequencerStep(APU *apu)
+{
+    uint8_t step = apu->sequencerStep;
+    apu->sequencerStep = (step + 1) & 0x07;
+
+    if(!(step & 1)) // Length counters at 256 Hz
+        for(int channel = 0; channel < 4; ++channel)
+        {
+            APUChannel *ch = &apu->channels[channel];
+            if((apu->regs[channelBase[channel] + 4] & 0x40) && ch->length && !--ch->length)
+                ch->enabled = false;
+        }
+
+    if((step == 2 || step == 6) && apu->sweepEnabled && --apu->sweepTimer == 0) // Sweep at 128 Hz
+    {
+        uint8_t nr10 = apu->regs[NR10];
+        apu->sweepTimer = (nr10 >> 4) & 0x07 ? (nr10 >> 4) & 0x07 : 8;
+        if((nr10 >> 4) & 0x07)
+        {
+            uint16_t target = sweepTarget(apu);
+            if(target <= 2047 && (nr10 & 0x07))
+            {
+                apu->sweepShadow = target;
+                apu->regs[0x03] = target & 0xFF;
+                apu->regs[0x04] = (apu->regs[0x04] & 0xF8) | (target >> 8);
+                sweepTarget(apu); // Overflow check with the new frequency
+            }
+        }
+    }
+
+    if(step == 7) // Envelopes at 64 Hz
+        for(int channel = 0; channel < 4; ++channel)
+        {
+            if(channel == CH_WAVE) continue;
+            APUChannel *ch = &apu->channels[channel];
+            uint8_t nrx2 = apu->regs[channelBase[channel] + 2];
+            if(!(nrx2 & 0x07) || --ch->envelopeTimer) continue;
+            ch->envelopeTimer = nrx2 & 0x07;
+            if((nrx2 & 0x08) && ch->volume < 15) ch->volume++;
+            else if(!(nrx2 & 0x08) && ch->volume > 0) ch->volume--;
+        }
+}
+
+// Channel generators: parameters are constant for the whole batch, one tight loop per channel
+
+static void generateSquare(APU *apu, int channel, float *out, int count)
+{
+    APUChannel *ch = &apu->channels[channel];
+    if(!dacEnabled(apu, channel)) { memset(out, 0, count * sizeof(float)); return; }
+
+    uint8_t duty = dutyTable[apu->regs[channelBase[channel] + 1] >> 6];
+    int32_t step = period(apu, channel);
+    float high = ch->enabled ? ch->volume / 7.5f - 1.0f : -1.0f;
+    for(int i = 0; i < count; ++i)
+    {
+        for(ch->timer -= APU_SAMPLE_CYCLES; ch->timer <= 0; ch->timer += step)
+            ch->position = (ch->position + 1) & 0x07;
+        out[i] = (duty >> ch->position) & 1 ? high : -1.0f;
+    }
+}
+
+static void generateWave(APU *apu, float *out, int count)
+{
+    APUChannel *ch = &apu->channels[CH_WAVE];
+    if(!dacEnabled(apu, CH_WAVE)) { memset(out, 0, count * sizeof(float)); return; }
+
+    static const uint8_t volumeShift[4] = { 4, 0, 1, 2 };
+    uint8_t shift = volumeShift[(apu->regs[0x0C] >> 5) & 0x03];
+    int32_t step = period(apu, CH_WAVE);
+    for(int i = 0; i < count; ++i)
+    {
+        for(ch->timer -= APU_SAMPLE_CYCLES; ch->timer <= 0; ch->timer += step)
+            ch->position = (ch->position + 1) & 0x1F;
+        uint8_t byte = apu->regs[WAVE + (ch->position >> 1)];
+        uint8_t sample = ch->enabled ? ((ch->position & 1) ? byte & 0x0F : byte >> 4) >> shift : 0;
+        out[i] = sample / 7.5f - 1.0f;
+    }
+}
+
+static void generateNoise(APU *apu, float *out, int count)
+{
+    APUChannel *ch = &apu->channels[CH_NOISE];
+    if(!dacEnabled(apu, CH_NOISE)) { memset(out, 0, count * sizeof(float)); return; }
+
+    bool narrow = apu->regs[NR43] & 0x08;
+    int32_t step = period(apu, CH_NOISE);
+    float high = ch->enabled ? ch->volume / 7.5f - 1.0f : -1.0f;
+    for(int i = 0; i < count; ++i)
+    {
+        for(ch->timer -= APU_SAMPLE_CYCLES; ch->timer <= 0; ch->timer += step)
+        {
+            uint16_t bit = (ch->lfsr ^ (ch->lfsr >> 1)) & 1;
+            ch->lfsr = (ch->lfsr >> 1) | (bit << 14);
+            if(narrow) ch->lfsr = (ch->lfsr & ~0x40) | (bit << 6);
+        }
+        out[i] = (ch->lfsr & 1) ? -1.0f : high;
+    }
+}
+
+// Band-limited 131072 Hz -> 48 kHz conversion of everything buffered. The dot
+// product keeps 8 independent partial sums so the compiler can vectorize it
+// without reassociating floating point additions.
+static void resample(APU *apu)
+{
+    int16_t frames[128][2];
+    size_t count = 0;
+
+    while((apu->position >> 32) < (uint64_t)apu->buffered && count < 128)
+    {
+        int index = (int)(apu->position >> 32);
+        const float *coefficients = firTable[((apu->position & 0xFFFFFFFFu) * APU_FIR_PHASES) >> 32];
+        const float *left = apu->left + index - (APU_FIR_TAPS - 1);
+        const float *right = apu->right + index - (APU_FIR_TAPS - 1);
+
+        float sumLeft[8] = { 0 }, sumRight[8] = { 0 };
+        for(int tap = 0; tap < APU_FIR_TAPS; tap += 8)
+            for(int lane = 0; lane < 8; ++lane)
+            {
+                sumLeft[lane]  += left[tap + lane]  * coefficients[tap + lane];
+                sumRight[lane] += right[tap + lane] * coefficients[tap + lane];
+            }
+
+        float sample[2] = { 0, 0 };
+        for(int lane = 0; lane < 8; ++lane)
+        {
+            sample[0] += sumLeft[lane];
+            sample[1] += sumRight[lane];
+        }
+
+        for(int side = 0; side < 2; ++side)
+        {
+            // DC blocking like the output capacitor, then scale to 16 bits
+            float filtered = sample[side] - apu->lastInput[side] + 0.996f * apu->highPass[side];
+            apu->lastInput[side] = sample[side];
+            apu->highPass[side] = filtered;
+
+            float scaled = filtered * 0.7f * 32767.0f;
+            frames[count][side] = (int16_t)(scaled > 32767.0f ? 32767 : scaled < -32768.0f ? -32768 : scaled);
+        }
+        count++;
+        apu->position += apu->step;
+    }
+
+    size_t written = audioRingWrite(apu->ring, (const int16_t (*)[2])frames, count);
+    apu->ring->dropped += count - written;
+
+    // Keep the filter's history in front of the next block
+    int keep = (int)(apu->position >> 32) - (APU_FIR_TAPS - 1);
+    if(keep > apu->buffered) keep = apu->buffered;
+    memmove(apu->left, apu->left + keep, (apu->buffered - keep) * sizeof(float));
+    memmove(apu->right, apu->right + keep, (apu->buffered - keep) * sizeof(float));
+    apu->buffered -= keep;
+    apu->position -= (uint64_t)keep << 32;
+}
+
+static void generate(APU *apu, int count)
+{
+    if(!apu->ring) return; // Nobody listens, only the frame sequencer matters
+
+    float *left = apu->left + apu->buffered, *right = apu->right + apu->buffered;
+    if(!(apu->regs[NR52] & 0x80))
+    {
+        memset(left, 0, count * sizeof(float));
+        memset(right, 0, count * sizeof(float));
+    }
+    else
+    {
+        float channels[4][APU_BLOCK_SAMPLES];
+        generateSquare(apu, CH_SQUARE1, channels[0], count);
+        generateSquare(apu, CH_SQUARE2, channels[1], count);
+        generateWave(apu, channels[2], count);
+        generateNoise(apu, channels[3], count);
+
+        uint8_t panning = apu->regs[NR51];
+        float volumeLeft  = (((apu->regs[NR50] >> 4) & 0x07) + 1) / 32.0f; // 1/8 per step, 1/4 for 4 channels
+        float volumeRight = ((apu->regs[NR50] & 0x07) + 1) / 32.0f;
+        float panLeft[4], panRight[4];
+        for(int channel = 0; channel < 4; ++channel)
+        {
+            panLeft[channel]  = (panning >> (channel + 4)) & 1 ? volumeLeft : 0.0f;
+            panRight[channel] = (panning >> channel) & 1 ? volumeRight : 0.0f;
+        }
+
+        for(int i = 0; i < count; ++i)
+        {
+            left[i]  = channels[0][i] * panLeft[0]  + channels[1][i] * panLeft[1]
+                     + channels[2][i] * panLeft[2]  + channels[3][i] * panLeft[3];
+            right[i] = channels[0][i] * panRight[0] + channels[1][i] * panRight[1]
+                     + channels[2][i] * panRight[2] + channels[3][i] * panRight[3];
+        }
+    }
+
+    apu->buffered += count;
+    resample(apu);
+}
+
+void apuCatchUp(APU *apu)
+{
+    uint64_t start = statsClock();
+    apu->cycleRemainder += apu->pending;
+    apu->pending = 0;
+
+    uint32_t samples = apu->cycleRemainder / APU_SAMPLE_CYCLES;
+    apu->cycleRemainder %= APU_SAMPLE_CYCLES;
+
+    // Batches end at frame sequencer steps, the other events end them through register writes
+    while(samples)
+    {
+        uint32_t count = samples < apu->sequencerSamples ? samples : apu->sequencerSamples;
+        generate(apu, (int)count);
+        samples -= count;
+        apu->sequencerSamples -= count;
+        if(!apu->sequencerSamples)
+        {
+            if(apu->regs[NR52] & 0x80) sequencerStep(apu);
+            apu->sequencerSamples = APU_BLOCK_SAMPLES;
+        }
+    }
+    apu->catchUpTime += statsClock() - start;
+}
+
+uint8_t apuReadRegister(APU *apu, uint16_t address)
+{
+    uint8_t index = address - 0xFF10;
+    if(index >= WAVE) return apu->regs[index];
+    if(index != NR52) return apu->regs[index] | readMask[index];
+
+    apuCatchUp(apu); // Length counters may have stopped a channel
+    uint8_t status = (apu->regs[NR52] & 0x80) | readMask[NR52];
+    for(int channel = 0; channel < 4; ++channel)
+        if(apu->channels[channel].enabled) status |= 1 << channel;
+    return status;
+}
+
+void apuWriteRegister(APU *apu, uint16_t address, uint8_t value)
+{
+    uint8_t index = address - 0xFF10;
+    apuCatchUp(apu); // Everything before the write is generated with the old settings
+
+    if(index >= WAVE)
+    {
+        apu->regs[index] = value;
+        return;
+    }
+    if(index == NR52)
+    {
+        if(!(value & 0x80))
+        {
+            memset(apu->regs, 0, NR52); // Powering off clears every register
+            for(int channel = 0; channel < 4; ++channel)
+                apu->channels[channel].enabled = false;
+        }
+        else if(!(apu->regs[NR52] & 0x80))
+            apu->sequencerStep = 0;
+        apu->regs[NR52] = value & 0x80;
+        return;
+    }
+    if(!(apu->regs[NR52] & 0x80) || index > NR52) return; // Powered off, or unused
+
+    apu->regs[index] = value;
+    for(int channel = 0; channel < 4; ++channel)
+    {
+        uint8_t base = channelBase[channel];
+        APUChannel *ch = &apu->channels[channel];
+        if(index == base + 1)
+            ch->length = channel == CH_WAVE ? 256 - value : 64 - (value & 0x3F);
+        else if(!dacEnabled(apu, channel) && (index == base + 2 || (channel == CH_WAVE && index == NR30)))
+            ch->enabled = false;
+        else if(index == base + 4 && (value & 0x80))
+            trigger(apu, channel);
+    }
+}
+
+void audioRingInit(AudioRing *ring)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->dropped = 0;
+}
+
+size_t audioRingWrite(AudioRing *ring, const int16_t (*frames)[2], size_t count)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t space = AUDIO_RING_FRAMES - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+    if(count > space) count = space;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        ring->frames[(head + i) & (AUDIO_RING_FRAMES - 1)][0] = frames[i][0];
+        ring->frames[(head + i) & (AUDIO_RING_FRAMES - 1)][1] = frames[i][1];
+    }
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+size_t audioRingRead(AudioRing *ring, int16_t (*frames)[2], size_t count)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t available = atomic_load_explicit(&ring->head, memory_order_acquire) - tail;
+    if(count > available) count = available;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        frames[i][0] = ring->frames[(tail + i) & (AUDIO_RING_FRAMES - 1)][0];
+        frames[i][1] = ring->frames[(tail + i) & (AUDIO_RING_FRAMES - 1)][1];
+    }
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
+}
+
+size_t audioRingFill(AudioRing *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
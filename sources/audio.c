@@ -0,0 +1,62 @@
+#include "../includes/audio.h"
+#include "../includes/log.h"
+
+static void audioCallback(void *userdata, Uint8 *stream, int length)
+{
+    Audio *audio = userdata;
+    int16_t (*frames)[2] = (int16_t (*)[2])stream;
+    size_t count = (size_t)length / sizeof(frames[0]);
+
+    size_t read = audioRingRead(audio->ring, frames, count);
+    if(read) 
+    {
+        audio->last[0] = frames[read - 1][0];
+        audio->last[1] = frames[read - 1][1];
+    }
+    for(size_t i = read; i < count; ++i)
+    {
+        frames[i][0] = audio->last[0];
+        frames[i][1] = audio->last[1];
+    }
+    audio->underruns += count - read;
+}
+
+int initAudio(Audio *audio, AudioRing *ring)
+{
+    audio->ring = ring;
+    audio->last[0] = audio->last[1] = 0;
+    audio->underruns = 0;
+
+    if(SDL_InitSubSystem(SDL_INIT_AUDIO))
+    {
+        LOG_ERROR(LOG_IO, "SDL audio initialization failed: %s", SDL_GetError());
+        return 1; // SDL initialization error
+    }
+
+    SDL_AudioSpec want = { 0 }, have;
+    want.freq = APU_OUTPUT_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = 512; // About 10 ms per callback
+    want.callback = audioCallback;
+    want.userdata = audio;
+
+    audio->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if(!audio->device)
+    {
+        LOG_ERROR(LOG_IO, "Failed to open audio device: %s", SDL_GetError());
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        return 2; // Device error
+    }
+
+    SDL_PauseAudioDevice(audio->device, 0);
+    LOG_INFO(LOG_IO, "Audio initialized at %d Hz, %d frame buffer", have.freq, have.samples);
+    return 0; // Success
+}
+
+void freeAudio(Audio *audio)
+{
+    SDL_CloseAudioDevice(audio->device);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    LOG_INFO(LOG_IO, "Audio resources freed, %llu underrun frames", (unsigned long long)audio->underruns);
+}
@@ -39,9 +39,15 @@ static void pushByte(CPU *cpu, MMU *mmu, uint8_t value)
     mmuWriteByte(mmu, cpu->sp, value);
 }
 
+static void pushWord(CPU *cpu, MMU *mmu, uint16_t value)
+{
+    pushByte(cpu, mmu, value >> 8);   // High byte first
+    pushByte(cpu, mmu, value & 0xFF);
+}
+
 void cpuReset(CPU *cpu)
 {
-    LOG("Resetting CPU...");
+    LOG_DEBUG(LOG_CPU, "Resetting CPU...");
     cpu->af = 0x01B0; // AF register reset
     cpu->bc = 0x0013; // BC register reset
     cpu->de = 0x00D8; // DE register reset
@@ -199,7 +205,7 @@ int cpuStep(CPU *cpu, MMU *mmu)
         }
         case 0x10:
         {
-            LOG("Unimplemented opcode 0x%02X at PC: 0x%04X", opcode, pcBefore);
+            LOG_TRACE(LOG_CPU, "Unimplemented opcode 0x%02X at PC: 0x%04X", opcode, pcBefore);
             cycles = -1; // Indicate unimplemented opcode
             break;
         }
@@ -977,7 +983,7 @@ int cpuStep(CPU *cpu, MMU *mmu)
         }
         case 0x76: // HALT
         {
-            LOG("HALT instruction encountered at PC: 0x%04X", pcBefore);
+            LOG_TRACE(LOG_CPU, "HALT instruction encountered at PC: 0x%04X", pcBefore);
             // HALT instruction does not change PC, just stops CPU execution
             return -1;
         }
@@ -1731,6 +1737,7 @@ int cpuStep(CPU *cpu, MMU *mmu)
                 cycles = 5;
             } else 
                 cycles = 2;
+            break;
         }
         case 0xC1: // POP BC
         {
@@ -1826,16 +1833,17 @@ int cpuStep(CPU *cpu, MMU *mmu)
         }
         case 0xCA: // JP Z, a16
         {
-            uint16_t addr = fetchWord(mmu, cpu->pc);
+            uint16_t addr = fetchWord(cpu, mmu);
             if(cpu->f & FLAG_Z) {
                 cpu->pc = addr;
                 cycles = 4;
             } else
                 cycles = 3;
+            break;
         }
         case 0xCC: // CALL Z, a16
         {
-            uint16_t target = fetchWord(mmu, cpu->pc);
+            uint16_t target = fetchWord(cpu, mmu);
             if(cpu->f & FLAG_Z) 
             {
                 pushByte(cpu, mmu, (cpu->pc >> 8)); // Push high byte of PC
@@ -1848,7 +1856,7 @@ int cpuStep(CPU *cpu, MMU *mmu)
         }
         case 0xCD: // CALL a16
         {
-            uint16_t target = fetchWord(mmu, cpu->pc);
+            uint16_t target = fetchWord(cpu, mmu);
             pushByte(cpu, mmu, (cpu->pc >> 8)); // Push high byte of PC
             pushByte(cpu, mmu, (cpu->pc & 0xFF)); // Push low byte of PC
             cpu->pc = target; // Jump to address
@@ -1857,7 +1865,7 @@ int cpuStep(CPU *cpu, MMU *mmu)
         }
         case 0xCE: // ADC A, d8
         {
-            uint8_t value = fetchByte(mmu, cpu->pc);
+            uint8_t value = fetchByte(cpu, mmu);
             uint8_t carry = (cpu->f & FLAG_C) ? 1 : 0;
 
             uint8_t halfSum = (cpu->a & 0x0F) + (value & 0x0F) + carry;
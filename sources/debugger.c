@@ -0,0 +1,280 @@
+#define _POSIX_C_SOURCE 200809L // strtok_r
+#include "../includes/debugger.h"
+#include "../includes/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_LINE_LENGTH 256
+
+Debugger *debuggerCreate(GameBoy *gb)
+{
+    Debugger *debugger = calloc(1, sizeof(Debugger));
+    if(!debugger)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate debugger");
+        return NULL; // Memory allocation error
+    }
+    debugger->gb = gb;
+    gb->mmu.debugger = debugger;
+    return debugger;
+}
+
+void debuggerDestroy(Debugger *debugger)
+{
+    if(!debugger) return;
+    MMU *mmu = &debugger->gb->mmu;
+    mmu->debugger = NULL;
+    for(int page = 0; page < MMU_PAGE_COUNT; ++page)
+        if(mmu->watchPages[page]) mmuWatchPage(mmu, page, 0);
+    free(debugger);
+}
+
+void debuggerBreak(Debugger *debugger, uint16_t address, bool set)
+{
+    if(set) debugger->breakpoints[address >> 6] |= 1ull << (address & 63);
+    else    debugger->breakpoints[address >> 6] &= ~(1ull << (address & 63));
+}
+
+// Pages are watched for the union of every watchpoint touching them
+static void updatePages(Debugger *debugger)
+{
+    uint8_t watch[MMU_PAGE_COUNT] = { 0 };
+    for(int i = 0; i < debugger->watchCount; ++i)
+    {
+        const Watchpoint *point = &debugger->watches[i];
+        for(int page = point->first >> MMU_PAGE_SHIFT; page <= point->last >> MMU_PAGE_SHIFT; ++page)
+            watch[page] |= point->access;
+    }
+
+    MMU *mmu = &debugger->gb->mmu;
+    for(int page = 0; page < MMU_PAGE_COUNT; ++page)
+        if(watch[page] != mmu->watchPages[page]) mmuWatchPage(mmu, page, watch[page]);
+}
+
+int debuggerWatch(Debugger *debugger, uint16_t first, uint16_t last, uint8_t access)
+{
+    if(debugger->watchCount == DEBUG_MAX_WATCHES) return -1; // Full
+    debugger->watches[debugger->watchCount++] = (Watchpoint){ first, last, access };
+    updatePages(debugger);
+    return debugger->watchCount - 1;
+}
+
+void debuggerUnwatch(Debugger *debugger, int index)
+{
+    if(index < 0 || index >= debugger->watchCount) return;
+    memmove(&debugger->watches[index], &debugger->watches[index + 1],
+            (debugger->watchCount - index - 1) * sizeof(Watchpoint));
+    debugger->watchCount--;
+    updatePages(debugger);
+}
+
+// ADDR, ADDR-END, optionally followed by :r, :w or :rw (writes by default), addresses in hex
+int debuggerParseWatch(const char *text, uint16_t *first, uint16_t *last, uint8_t *access)
+{
+    char *end;
+    unsigned long start = strtoul(text, &end, 16), stop = start;
+    if(end == text || start > 0xFFFF) return 1;
+    if(*end == '-')
+    {
+        const char *from = end + 1;
+        stop = strtoul(from, &end, 16);
+        if(end == from || stop > 0xFFFF || stop < start) return 1;
+    }
+
+    *access = MMU_WATCH_WRITE;
+    if(*end == ':')
+    {
+        if(!strcmp(end + 1, "r"))       *access = MMU_WATCH_READ;
+        else if(!strcmp(end + 1, "w"))  *access = MMU_WATCH_WRITE;
+        else if(!strcmp(end + 1, "rw")) *access = MMU_WATCH_READ | MMU_WATCH_WRITE;
+        else return 1;
+    }
+    else if(*end) return 1;
+
+    *first = (uint16_t)start;
+    *last = (uint16_t)stop;
+    return 0;
+}
+
+void debuggerAccess(Debugger *debugger, uint16_t address, uint8_t value, bool write)
+{
+    if(debugger->hit) return; // The first access of the instruction is reported
+    uint8_t access = write ? MMU_WATCH_WRITE : MMU_WATCH_READ;
+    for(int i = 0; i < debugger->watchCount; ++i)
+    {
+        const Watchpoint *point = &debugger->watches[i];
+        if(!(point->access & access) || address < point->first || address > point->last) continue;
+
+        debugger->hit = true;
+        debugger->hitWatch = i;
+        debugger->hitAddress = address;
+        debugger->hitValue = value;
+        debugger->hitWrite = write;
+        return;
+    }
+}
+
+static inline int step(Debugger *debugger, GameBoy *gb)
+{
+    debugger->pc = gb->cpu.pc;
+    return gb->trace ? gbStepTraced(gb) : gbStep(gb);
+}
+
+// The frame loop of gbRunFrame with the breakpoint test, only ever run while debugging
+DebugStop debuggerRunFrame(Debugger *debugger, int *cycles)
+{
+    GameBoy *gb = debugger->gb;
+    uint64_t frame = gb->ppu.frames;
+    debugger->hit = false;
+
+    while(gb->ppu.frames == frame)
+    {
+        uint16_t pc = gb->cpu.pc;
+        if((debugger->breakpoints[pc >> 6] >> (pc & 63)) & 1 && !debugger->resume)
+        {
+            debugger->resume = true; // Continuing executes it
+            return DEBUG_BREAKPOINT;
+        }
+        debugger->resume = false;
+
+        *cycles += step(debugger, gb);
+        if(debugger->hit) return DEBUG_WATCHPOINT;
+    }
+    return DEBUG_NONE;
+}
+
+DebugStop debuggerStep(Debugger *debugger, int *cycles)
+{
+    debugger->hit = false;
+    debugger->resume = false;
+    *cycles += step(debugger, debugger->gb);
+    return debugger->hit ? DEBUG_WATCHPOINT : DEBUG_STEP;
+}
+
+static void printRegisters(const GameBoy *gb, FILE *out)
+{
+    const CPU *cpu = &gb->cpu;
+    fprintf(out, "pc=%02X:%04X sp=%04X af=%04X bc=%04X de=%04X hl=%04X ime=%d cycles=%llu frame=%llu\n",
+            gb->mmu.currentRomBank, cpu->pc, cpu->sp, cpu->af, cpu->bc, cpu->de, cpu->hl, cpu->ime,
+            (unsigned long long)gb->cycles, (unsigned long long)gb->ppu.frames);
+}
+
+static void printStop(const Debugger *debugger, DebugStop stop, FILE *out)
+{
+    if(stop == DEBUG_BREAKPOINT)
+        fprintf(out, "breakpoint at %04X\n", debugger->gb->cpu.pc);
+    else if(stop == DEBUG_WATCHPOINT)
+        fprintf(out, "watchpoint %d: %s %04X = %02X by the instruction at %04X\n", debugger->hitWatch,
+                debugger->hitWrite ? "write" : "read", debugger->hitAddress, debugger->hitValue, debugger->pc);
+    printRegisters(debugger->gb, out);
+}
+
+static void printPoints(const Debugger *debugger, FILE *out)
+{
+    for(int address = 0; address < 0x10000; ++address)
+        if((debugger->breakpoints[address >> 6] >> (address & 63)) & 1)
+            fprintf(out, "break %04X\n", address);
+    for(int i = 0; i < debugger->watchCount; ++i)
+    {
+        const Watchpoint *point = &debugger->watches[i];
+        fprintf(out, "watch %d: %04X-%04X %s%s\n", i, point->first, point->last,
+                point->access & MMU_WATCH_READ ? "r" : "", point->access & MMU_WATCH_WRITE ? "w" : "");
+    }
+}
+
+// Reads memory the way the CPU sees it without tripping watchpoints. Watched
+// pages are off the read map, their mapped memory is read directly.
+static void dump(Debugger *debugger, uint16_t address, unsigned count, FILE *out)
+{
+    MMU *mmu = &debugger->gb->mmu;
+    mmu->debugger = NULL;
+    for(unsigned i = 0; i < count; ++i)
+    {
+        uint16_t at = (uint16_t)(address + i);
+        const uint8_t *mapped = mmu->mappedRead[at >> MMU_PAGE_SHIFT];
+        if(!(i % 16)) fprintf(out, "%s%04X:", i ? "\n" : "", at);
+        fprintf(out, " %02X", mapped ? mapped[at & (MMU_PAGE_SIZE - 1)] : mmuReadByte(mmu, at));
+    }
+    fprintf(out, "\n");
+    mmu->debugger = debugger;
+}
+
+// Handles commands until one resumes execution. False to quit.
+static bool prompt(Debugger *debugger, FILE *in, FILE *out)
+{
+    char line[DEBUG_LINE_LENGTH];
+    while(1)
+    {
+        fprintf(out, "(gbdb) ");
+        fflush(out);
+        if(!fgets(line, sizeof(line), in))
+        {
+            fprintf(out, "\n");
+            return true; // No more input: run on
+        }
+
+        char *save = NULL;
+        char *command = strtok_r(line, " \t\r\n", &save);
+        char *argument = strtok_r(NULL, " \t\r\n", &save);
+        char *extra = strtok_r(NULL, " \t\r\n", &save);
+        if(!command) continue;
+
+        if(!strcmp(command, "c"))
+            return true;
+        else if(!strcmp(command, "s"))
+        {
+            int count = argument ? atoi(argument) : 1;
+            debugger->stepping = count > 0 ? count : 1;
+            return true;
+        }
+        else if(!strcmp(command, "q"))
+            return false;
+        else if(!strcmp(command, "r"))
+            printRegisters(debugger->gb, out);
+        else if((!strcmp(command, "b") || !strcmp(command, "bd")) && argument)
+            debuggerBreak(debugger, (uint16_t)strtoul(argument, NULL, 16), command[1] != 'd');
+        else if(!strcmp(command, "w") && argument)
+        {
+            uint16_t first, last;
+            uint8_t access;
+            if(debuggerParseWatch(argument, &first, &last, &access))
+                fprintf(out, "bad watch, expected ADDR[-END][:r|w|rw]\n");
+            else if(debuggerWatch(debugger, first, last, access) < 0)
+                fprintf(out, "at most %d watchpoints\n", DEBUG_MAX_WATCHES);
+        }
+        else if(!strcmp(command, "wd") && argument)
+            debuggerUnwatch(debugger, atoi(argument));
+        else if(!strcmp(command, "l"))
+            printPoints(debugger, out);
+        else if(!strcmp(command, "x") && argument)
+            dump(debugger, (uint16_t)strtoul(argument, NULL, 16), extra ? (unsigned)strtoul(extra, NULL, 0) : 16, out);
+        else
+            fprintf(out, "c continue, s [N] step, r registers, b/bd ADDR break, w ADDR[-END][:r|w|rw] watch,\n"
+                         "wd N unwatch, l list, x ADDR [N] examine, q quit\n");
+    }
+}
+
+bool debuggerFrame(Debugger *debugger, FILE *in, FILE *out, int *cycles)
+{
+    GameBoy *gb = debugger->gb;
+    uint64_t frame = gb->ppu.frames;
+    if(debugger->pause)
+    {
+        debugger->pause = false;
+        printRegisters(gb, out);
+        if(!prompt(debugger, in, out)) return false;
+    }
+    while(gb->ppu.frames == frame)
+    {
+        DebugStop stop = debugger->stepping ? debuggerStep(debugger, cycles) : debuggerRunFrame(debugger, cycles);
+        if(stop == DEBUG_NONE) break;
+        if(stop == DEBUG_STEP && --debugger->stepping) continue;
+        debugger->stepping = 0;
+
+        printStop(debugger, stop, out);
+        if(!prompt(debugger, in, out)) return false;
+    }
+    if(gb->serial.link != SERIAL_LINK_NONE) serialSync(&gb->serial);
+    return true;
+}
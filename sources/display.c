@@ -0,0 +1,133 @@
+#include "../includes/display.h"
+#include "../includes/log.h"
+
+#include <stdio.h>
+
+#define DISPLAY_EVENT_BATCH 32
+
+// Keyboard layout of the joypad
+static const struct { SDL_Scancode key; unsigned bit; } keyMap[] =
+{
+    { SDL_SCANCODE_RIGHT,     JOYPAD_RIGHT  },
+    { SDL_SCANCODE_LEFT,      JOYPAD_LEFT   },
+    { SDL_SCANCODE_UP,        JOYPAD_UP     },
+    { SDL_SCANCODE_DOWN,      JOYPAD_DOWN   },
+    { SDL_SCANCODE_X,         JOYPAD_A      },
+    { SDL_SCANCODE_Z,         JOYPAD_B      },
+    { SDL_SCANCODE_BACKSPACE, JOYPAD_SELECT },
+    { SDL_SCANCODE_RETURN,    JOYPAD_START  },
+    { SDL_SCANCODE_TAB,       INPUT_FAST_FORWARD },
+    { SDL_SCANCODE_F1,        INPUT_OVERLAY },
+    { SDL_SCANCODE_R,         INPUT_REWIND },
+};
+
+int initDisplay(Display *display)
+{
+    display->closed = false;
+    display->overlay = NULL;
+    if(SDL_Init(SDL_INIT_VIDEO))
+    {
+        LOG_ERROR(LOG_PPU, "SDL initialization failed: %s", SDL_GetError());
+        return 1; // SDL initialization error
+    }
+
+    display->window = SDL_CreateWindow("Gameboy", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 
+                                        SCREEN_WIDTH * 8, SCREEN_HEIGHT * 8, SDL_WINDOW_SHOWN);
+    if(!display->window)
+    {
+        LOG_ERROR(LOG_PPU, "Failed to create SDL window: %s", SDL_GetError());
+        SDL_Quit();
+        return 2; // Window creation error
+    }
+
+    display->renderer = SDL_CreateRenderer(display->window, -1, SDL_RENDERER_ACCELERATED);
+    if(!display->renderer)
+    {
+        LOG_ERROR(LOG_PPU, "Failed to create SDL renderer: %s", SDL_GetError());
+        SDL_DestroyWindow(display->window);
+        SDL_Quit();
+        return 3; // Renderer creation error
+    }
+
+    display->texture = SDL_CreateTexture(display->renderer, SDL_PIXELFORMAT_ARGB8888, 
+                                          SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    if(!display->texture)
+    {
+        LOG_ERROR(LOG_PPU, "Failed to create SDL texture: %s", SDL_GetError());
+        SDL_DestroyRenderer(display->renderer);
+        SDL_DestroyWindow(display->window);
+        SDL_Quit();
+        return 4; // Texture creation error
+    }
+
+    LOG_INFO(LOG_PPU, "Display initialized successfully");
+    return 0; // Success
+}
+
+void freeDisplay(Display *display)
+{
+    if(display->texture) SDL_DestroyTexture(display->texture);
+    if(display->renderer) SDL_DestroyRenderer(display->renderer);
+    if(display->window) SDL_DestroyWindow(display->window);
+    SDL_Quit();
+    LOG_INFO(LOG_PPU, "Display resources freed");
+}
+
+void displayPresent(Display *display, PPU *ppu) 
+{
+    ppuLockFrame(ppu);
+    if(display->overlay) statsDrawOverlay(display->overlay, ppu);
+    if(!ppu->frameDirty)
+    {
+        ppuUnlockFrame(ppu);
+        return; // Nothing changed since the last present
+    }
+
+    // Upload only the runs of consecutive dirty scanlines
+    int y = 0;
+    while(y < SCREEN_HEIGHT)
+    {
+        if(!ppu->lineDirty[y]) { ++y; continue; }
+
+        int first = y;
+        while(y < SCREEN_HEIGHT && ppu->lineDirty[y])
+            ppu->lineDirty[y++] = false;
+
+        SDL_Rect rows = { 0, first, SCREEN_WIDTH, y - first };
+        SDL_UpdateTexture(display->texture, &rows, ppu->frameBuffer[first], SCREEN_WIDTH * sizeof(uint32_t));
+    }
+    ppu->frameDirty = false;
+    ppuUnlockFrame(ppu);
+
+    SDL_RenderClear(display->renderer);
+    SDL_RenderCopy(display->renderer, display->texture, NULL, NULL);
+    SDL_RenderPresent(display->renderer);
+}
+
+void displaySetSpeed(Display *display, double speed, bool fastForward)
+{
+    char title[64];
+    snprintf(title, sizeof(title), "Gameboy - %.2fx%s", speed, fastForward ? " (fast forward)" : "");
+    SDL_SetWindowTitle(display->window, title);
+}
+
+void displayPollInput(Display *display, InputSnapshot *input)
+{
+    // One pump, then the queue is drained in batches; only quitting needs an event,
+    // everything else is read from the keyboard state SDL keeps from those events
+    SDL_PumpEvents();
+    SDL_Event events[DISPLAY_EVENT_BATCH];
+    int count;
+    while((count = SDL_PeepEvents(events, DISPLAY_EVENT_BATCH, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT)) > 0)
+        for(int i = 0; i < count; ++i)
+            if(events[i].type == SDL_QUIT) display->closed = true;
+
+    const Uint8 *keys = SDL_GetKeyboardState(NULL);
+    unsigned state = 0;
+    for(size_t i = 0; i < sizeof(keyMap) / sizeof(keyMap[0]); ++i)
+        if(keys[keyMap[i].key]) state |= keyMap[i].bit;
+    if(keys[SDL_SCANCODE_ESCAPE]) display->closed = true;
+    if(display->closed) state |= INPUT_QUIT;
+
+    inputPublish(input, state);
+}
@@ -0,0 +1,189 @@
+#include "../includes/gameboy.h"
+#include "../includes/log.h"
+#include "../includes/state.h"
+
+#include <stdlib.h>
+
+GameBoy *gbCreate(Rom *rom)
+{
+    GameBoy *gb = malloc(sizeof(GameBoy));
+    if(!gb)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate emulator instance");
+        return NULL; // Memory allocation error
+    }
+
+    if(initMMU(&gb->mmu, rom))
+    {
+        free(gb);
+        return NULL; // Failed to initialize MMU
+    }
+
+    cpuReset(&gb->cpu);
+    if(initPPU(&gb->ppu))
+    {
+        freeMMU(&gb->mmu);
+        free(gb);
+        return NULL; // Failed to initialize PPU
+    }
+
+    initAPU(&gb->apu);
+    initSerial(&gb->serial, &gb->cycles);
+    gb->mmu.ppu = &gb->ppu;
+    gb->mmu.apu = &gb->apu;
+    gb->mmu.serial = &gb->serial;
+    gb->cycles = 0;
+    gb->instructions = 0;
+    gb->aheadState = NULL;
+    gb->aheadCapacity = 0;
+    gb->metrics = NULL;
+    gb->trace = NULL;
+#ifdef GB_PROFILE
+    gb->profiler = NULL;
+#endif
+    return gb;
+}
+
+GameBoy *gbClone(GameBoy *gb)
+{
+    GameBoy *clone = malloc(sizeof(GameBoy));
+    if(!clone)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate emulator clone");
+        return NULL; // Memory allocation error
+    }
+
+    if(cloneMMU(&clone->mmu, &gb->mmu))
+    {
+        free(clone);
+        return NULL; // Failed to clone MMU
+    }
+
+    clone->cpu = gb->cpu;
+    clonePPU(&clone->ppu, &gb->ppu, &gb->mmu);
+    clone->apu = gb->apu;
+    clone->apu.ring = NULL; // Only the original is heard
+    cloneSerial(&clone->serial, &gb->serial, &clone->cycles);
+    clone->mmu.ppu = &clone->ppu;
+    clone->mmu.apu = &clone->apu;
+    clone->mmu.serial = &clone->serial;
+    clone->cycles = gb->cycles;
+    clone->instructions = gb->instructions;
+    clone->aheadState = NULL;
+    clone->aheadCapacity = 0;
+    clone->metrics = NULL;
+    clone->trace = NULL;
+#ifdef GB_PROFILE
+    clone->profiler = NULL;
+#endif
+    return clone;
+}
+
+void gbDestroy(GameBoy *gb)
+{
+    if(!gb) return;
+    freeSerial(&gb->serial);
+    freePPU(&gb->ppu);
+    freeMMU(&gb->mmu);
+    free(gb->aheadState);
+#ifdef GB_PROFILE
+    profilerDestroy(gb->profiler);
+#endif
+    free(gb);
+}
+
+int gbStep(GameBoy *gb)
+{
+#ifdef GB_PROFILE
+    uint16_t pc = gb->cpu.pc, sp = gb->cpu.sp, bank = gb->mmu.currentRomBank;
+    uint8_t opcode = gb->profiler ? mmuReadByte(&gb->mmu, pc) : 0;
+#endif
+    int cycles = cpuStep(&gb->cpu, &gb->mmu);
+    if(cycles <= 0) cycles = 1; // HALT, STOP and unimplemented opcodes report 0 or -1, count them as one cycle
+#ifdef GB_PROFILE
+    if(gb->profiler)
+        profilerRecord(gb->profiler, opcode, profilerAddress(bank, pc),
+                       profilerAddress(gb->mmu.currentRomBank, gb->cpu.pc), sp, gb->cpu.sp, cycles);
+#endif
+
+    ppuStep(&gb->ppu, &gb->mmu, cycles);
+    apuStep(&gb->apu, cycles);
+    serialStep(&gb->serial, &gb->mmu, cycles);
+    gb->cycles += cycles;
+    gb->instructions++;
+    return cycles;
+}
+
+int gbStepTraced(GameBoy *gb)
+{
+    TraceRecord record = { gb->cycles, gb->cpu.pc, gb->cpu.sp, gb->cpu.af, gb->cpu.bc, gb->cpu.de, gb->cpu.hl,
+                           mmuReadByte(&gb->mmu, gb->cpu.pc), gb->mmu.currentRomBank };
+    traceRecord(gb->trace, &record);
+    return gbStep(gb);
+}
+
+int gbRunFrame(GameBoy *gb)
+{
+    uint64_t frame = gb->ppu.frames;
+    int cycles = 0;
+    if(gb->trace) // Chosen per frame so the untraced loop stays as it is
+        while(gb->ppu.frames == frame)
+            cycles += gbStepTraced(gb);
+    else
+        while(gb->ppu.frames == frame)
+            cycles += gbStep(gb);
+    if(gb->serial.link != SERIAL_LINK_NONE) serialSync(&gb->serial);
+    return cycles;
+}
+
+int gbRunFrameAhead(GameBoy *gb, int frames, bool render)
+{
+    // A frame nobody sees needs neither its picture nor a future to show instead
+    if(!render || frames <= 0)
+    {
+        ppuSuppressRender(&gb->ppu, &gb->mmu, !render);
+        return gbRunFrame(gb);
+    }
+
+    // The real frame: only its state matters, the picture comes from the future
+    ppuSuppressRender(&gb->ppu, &gb->mmu, true);
+    int cycles = gbRunFrame(gb);
+    apuCatchUp(&gb->apu); // Everything up to here is heard, nothing speculative is
+
+    size_t size = stateSize(gb);
+    if(size > gb->aheadCapacity)
+    {
+        uint8_t *state = realloc(gb->aheadState, size);
+        if(!state)
+        {
+            LOG_ERROR(LOG_GENERAL, "Failed to allocate run-ahead state");
+            ppuSuppressRender(&gb->ppu, &gb->mmu, false);
+            return cycles; // Fall back to showing nothing new this frame
+        }
+        gb->aheadState = state;
+        gb->aheadCapacity = size;
+    }
+    stateSave(gb, gb->aheadState, size);
+    AudioRing *ring = gb->apu.ring;
+    gb->apu.ring = NULL;
+    gb->serial.offline = true; // The peer must not see transfers that get rolled back
+    TraceWriter *trace = gb->trace;
+    gb->trace = NULL;          // Nor the trace instructions that never happened
+
+    // Speculate with the current input, rendering only the frame that is shown
+    for(int i = 1; i < frames; ++i)
+        gbRunFrame(gb);
+    ppuSuppressRender(&gb->ppu, &gb->mmu, false);
+    gbRunFrame(gb);
+
+    stateLoad(gb, gb->aheadState, size);
+    gb->apu.ring = ring;
+    gb->serial.offline = false;
+    gb->trace = trace;
+    return cycles;
+}
+
+void gbSetButtons(GameBoy *gb, uint8_t buttons)
+{
+    mmuSetJoypad(&gb->mmu, buttons);
+}
@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L // strtok_r, strcasecmp
+
+#include "../includes/headless.h"
+#include "../includes/log.h"
+#include "../includes/stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef struct 
+{
+    uint64_t frame;   // First frame the buttons apply to
+    uint8_t  buttons; // JOYPAD_* bits held from then on
+} InputEvent;
+
+typedef struct 
+{
+    InputEvent *events;
+    size_t      count;
+} InputScript;
+
+static const struct { const char *name; uint8_t bit; } buttonNames[] =
+{
+    { "RIGHT", JOYPAD_RIGHT }, { "LEFT", JOYPAD_LEFT }, { "UP", JOYPAD_UP },         { "DOWN", JOYPAD_DOWN },
+    { "A",     JOYPAD_A },     { "B",    JOYPAD_B },    { "SELECT", JOYPAD_SELECT }, { "START", JOYPAD_START }
+};
+
+// Accepts "-" for nothing held, a hex mask like 0x90, or names joined by '+' (A+START)
+int inputParseButtons(const char *text, uint8_t *buttons)
+{
+    if(!strcmp(text, "-")) { *buttons = 0; return 0; }
+    if(!strncasecmp(text, "0x", 2))
+    {
+        char *end;
+        unsigned long mask = strtoul(text, &end, 16);
+        if(*end || mask > 0xFF) return 1;
+        *buttons = (uint8_t)mask;
+        return 0;
+    }
+
+    char copy[128];
+    snprintf(copy, sizeof(copy), "%s", text);
+    uint8_t mask = 0;
+    char *save = NULL;
+    for(char *name = strtok_r(copy, "+", &save); name; name = strtok_r(NULL, "+", &save))
+    {
+        size_t i = 0;
+        while(i < sizeof(buttonNames) / sizeof(buttonNames[0]) && strcasecmp(name, buttonNames[i].name)) i++;
+        if(i == sizeof(buttonNames) / sizeof(buttonNames[0])) return 1; // Unknown button
+        mask |= buttonNames[i].bit;
+    }
+    *buttons = mask;
+    return 0;
+}
+
+static int loadInputScript(const char *path, InputScript *script)
+{
+    FILE *file = fopen(path, "r");
+    if(!file)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to open input script: %s", path);
+        return 1;
+    }
+
+    size_t capacity = 0;
+    char line[256];
+    int lineNumber = 0;
+    while(fgets(line, sizeof(line), file))
+    {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if(comment) *comment = '\0';
+
+        unsigned long long frame;
+        char buttons[128];
+        int fields = sscanf(line, "%llu %127s", &frame, buttons);
+        if(fields <= 0) continue; // Blank line
+
+        InputEvent event = { frame, 0 };
+        if(fields != 2 || inputParseButtons(buttons, &event.buttons) ||
+           (script->count && frame < script->events[script->count - 1].frame))
+        {
+            LOG_ERROR(LOG_GENERAL, "Bad input script line %d in %s", lineNumber, path);
+            fclose(file);
+            return 2;
+        }
+
+        if(script->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            InputEvent *grown = realloc(script->events, capacity * sizeof(InputEvent));
+            if(!grown) { fclose(file); return 3; }
+            script->events = grown;
+        }
+        script->events[script->count++] = event;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static int drainAudio(GameBoy *gb, WavWriter *wav)
+{
+    int16_t frames[1024][2];
+    size_t count;
+    while((count = audioRingRead(gb->apu.ring, frames, 1024)))
+        if(wavWrite(wav, (const int16_t (*)[2])frames, count)) return 1;
+    return 0;
+}
+
+int headlessRun(GameBoy *gb, const HeadlessOptions *options)
+{
+    InputScript script = { NULL, 0 };
+    if(options->inputScript && loadInputScript(options->inputScript, &script))
+    {
+        free(script.events);
+        return 1; // Bad input script
+    }
+
+    size_t nextEvent = 0;
+    uint64_t frame = 0;
+    uint64_t startCycles = gb->cycles, startInstructions = gb->instructions;
+    uint64_t start = statsClock();
+    Stats timing;
+    statsInit(&timing, gb);
+    gb->mmu.timed = options->stats;
+    char line[512];
+
+    while(!options->frames || frame < options->frames)
+    {
+        uint8_t buttons;
+        if(options->replay)
+        {
+            if(movieInput(options->replay, frame, &buttons)) break; // Movie finished
+            gbSetButtons(gb, buttons);
+        }
+        while(nextEvent < script.count && script.events[nextEvent].frame <= frame)
+            gbSetButtons(gb, script.events[nextEvent++].buttons);
+        if(options->record && movieAddFrame(options->record, gb->mmu.joypad)) break;
+
+        uint64_t frameCycles = gb->cycles, frameInstructions = gb->instructions;
+        uint64_t frameStart = statsClock();
+        int cycles = 0;
+        if(options->debugger)
+        {
+            if(!debuggerFrame(options->debugger, stdin, stdout, &cycles)) break; // Quit at the prompt
+        }
+        else if(!options->cycles)
+            gbRunFrameAhead(gb, options->runAhead, true);
+        else
+        {
+            // Step by instruction so the cycle limit is honoured mid-frame
+            uint64_t target = gb->ppu.frames + 1;
+            while(gb->ppu.frames < target && gb->cycles - startCycles < options->cycles)
+                gb->trace ? gbStepTraced(gb) : gbStep(gb);
+            if(gb->ppu.frames < target) break;
+        }
+        statsFrame(&timing, gb, statsClock() - frameStart);
+        metricsFrame(gb->metrics, gb->cycles - frameCycles, gb->instructions - frameInstructions, false);
+
+        if(options->rewind) rewindPush(options->rewind, gb);
+        if(options->wav && drainAudio(gb, options->wav)) break;
+
+        ppuSync(&gb->ppu); // Threaded mode renders behind, wait so hashes line up
+        ppuLockFrame(&gb->ppu);
+        uint64_t hash = ppuFrameHash(&gb->ppu);
+        ppuUnlockFrame(&gb->ppu);
+        printf("frame %llu %016llx\n", (unsigned long long)frame, (unsigned long long)hash);
+        frame++;
+
+        if(options->stats && statsUpdate(&timing, false) && !statsFormat(&timing, line, sizeof(line)))
+            printf("stats %s\n", line);
+    }
+    if(options->stats && statsUpdate(&timing, true) && !statsFormat(&timing, line, sizeof(line)))
+        printf("stats %s\n", line); // The partial last window
+
+    if(options->wav)
+    {
+        apuCatchUp(&gb->apu); // The tail of the last frame
+        drainAudio(gb, options->wav);
+    }
+
+    double seconds = (statsClock() - start) / 1e9;
+    uint64_t instructions = gb->instructions - startInstructions;
+    double emulated = frame / GB_FRAME_RATE;
+    printf("frames=%llu cycles=%llu instructions=%llu seconds=%.3f speed=%.2fx ips=%.0f\n",
+           (unsigned long long)frame, (unsigned long long)(gb->cycles - startCycles),
+           (unsigned long long)instructions, seconds,
+           seconds > 0 ? emulated / seconds : 0.0, seconds > 0 ? instructions / seconds : 0.0);
+
+    if(options->rewind)
+    {
+        RewindStats stats;
+        rewindStats(options->rewind, &stats);
+        printf("rewind_frames=%d rewind_bytes=%zu rewind_capacity=%zu rewind_us_per_frame=%.2f rewind_share=%.2f%%\n",
+               stats.entries, stats.bytes, stats.capacity,
+               stats.pushed ? stats.seconds * 1e6 / stats.pushed : 0.0,
+               seconds > 0 ? stats.seconds * 100 / seconds : 0.0);
+    }
+
+    free(script.events);
+    return 0;
+}
@@ -1,65 +1,534 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime, nanosleep, localtime_r, ftruncate
+
 #include "../includes/log.h"
+#include "../includes/stats.h"
 
-#define LOG_BUFFER_SIZE 1024
+#define LOG_BUFFER_SIZE 1024 // Must be a power of two
 #define LOG_MAX_LEN 512
+#define LOG_MAX_ARGS 8
+#define LOG_MAX_STRINGS 96   // Bytes reserved per message for copied %s arguments
+#define LOG_WRITE_BUFFER (64 * 1024)
+#define LOG_BINARY_MAGIC 0x32474F4C42470000ull // "\0\0GBLOG2"
+#define LOG_BINARY_END   0xFFFFFFFFu           // Record length marking the wrap
+#define LOG_TIME_SAMPLE  64 // Messages per timed one on each thread, a power of two
 
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-typedef struct 
+typedef enum
 {
-    char msg[LOG_MAX_LEN];
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_DOUBLE,
+    ARG_POINTER,
+    ARG_STRING,
+    ARG_NONE
+} argClass;
+
+typedef union
+{
+    long long          i;
+    unsigned long long u;
+    double             d;
+    const void        *p;
+    size_t             s;   // Offset into logItem.strings
+} logArg;
+
+typedef struct
+{
+    atomic_size_t sequence;  // Slot turn, see logMessage
+    const char   *format;    // Formatted later by the log thread
+    uint64_t      timestamp; // CLOCK_MONOTONIC, nanoseconds
+    int           argCount;
+    logArg        args[LOG_MAX_ARGS];
+    char          strings[LOG_MAX_STRINGS];
 } logItem;
 
 static logItem queue[LOG_BUFFER_SIZE];
-static int head = 0, tail = 0;
-static int running = 0;
+static atomic_size_t head = 0;  // Next slot claimed by a producer
+static size_t tail = 0;         // Next slot read by the log thread
+static atomic_size_t written = 0; // Copy of tail other threads may read
+static atomic_int running = 0;
+static atomic_ulong dropped = 0;
+static atomic_ullong spent = 0; // Nanoseconds callers spent in logMessage, extrapolated from sampled messages
+static _Thread_local unsigned queuedHere = 0; // Messages this thread queued, picks the ones timed
 
-static pthread_mutex_t  logMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t   queueCond = PTHREAD_COND_INITIALIZER;
 static pthread_t logThread;
 
+// Everything below is owned by the log thread, setters go through outputLock
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE    *output = NULL;        // Text target, NULL when disabled
+static int      outputIsFile = 0;
+static int      outputConfigured = 0; // logSetOutput was called, stdout otherwise
+static char     writeBuffer[LOG_WRITE_BUFFER];
+static size_t   writeUsed = 0;
+
+static uint64_t monoBase;             // Monotonic and wall clocks sampled together at logInit
+static uint64_t wallBase;
+static time_t   cachedSecond = -1;    // Second currently rendered in cachedTime
+static char     cachedTime[24];
+
+// Memory-mapped binary ring: header, then records of
+// { uint64 timestamp, uint32 length, uint32 reserved, char text[length] } padded to 8 bytes.
+// A record with length LOG_BINARY_END, or fewer than 16 bytes left, marks the wrap back to the first record.
+// Reading starts at oldestOffset and follows the records and wraps up to writeOffset.
+typedef struct
+{
+    uint64_t magic;
+    uint64_t size;         // Total mapped size, header included
+    uint64_t writeOffset;  // Where the next record goes
+    uint64_t wraps;        // Times the ring rotated
+    uint64_t monoBase;     // Timestamp origin, matches the text log's offsets
+    uint64_t oldestOffset; // First record still whole
+} logBinaryHeader;
+
+static logBinaryHeader *binary = NULL;
+
+atomic_int  logLevel = LOG_LEVEL_INFO;
+atomic_uint logCategories = LOG_ALL;
+
+// Walks one conversion starting after '%', returning the pointer past it.
+// '*' width/precision count as extra int arguments, reported through stars.
+static const char *parseSpec(const char *spec, argClass *cls, int *isLong, int *stars)
+{
+    *stars = 0;
+    *isLong = 0;
+    while(*spec && strchr("-+ #0", *spec)) spec++;
+    if(*spec == '*') { (*stars)++; spec++; }
+    while(*spec >= '0' && *spec <= '9') spec++;
+    if(*spec == '.')
+    {
+        spec++;
+        if(*spec == '*') { (*stars)++; spec++; }
+        while(*spec >= '0' && *spec <= '9') spec++;
+    }
+
+    // Length: 1 = h, 2 = hh, 3 = l, 4 = ll/j, 5 = z/t, 6 = L
+    if(*spec == 'h')      { *isLong = (spec[1] == 'h') ? 2 : 1; spec += *isLong; }
+    else if(*spec == 'l') { *isLong = (spec[1] == 'l') ? 4 : 3; spec += *isLong - 2; }
+    else if(*spec == 'j') { *isLong = 4; spec++; }
+    else if(*spec == 'z' || *spec == 't') { *isLong = 5; spec++; }
+    else if(*spec == 'L') { *isLong = 6; spec++; }
+
+    switch(*spec)
+    {
+        case 'd': case 'i':                       *cls = ARG_SIGNED;   break;
+        case 'u': case 'o': case 'x': case 'X':   *cls = ARG_UNSIGNED; break;
+        case 'c':                                 *cls = ARG_SIGNED;   break;
+        case 'f': case 'F': case 'e': case 'E':
+        case 'g': case 'G': case 'a': case 'A':   *cls = ARG_DOUBLE;   break;
+        case 'p':                                 *cls = ARG_POINTER;  break;
+        case 's':                                 *cls = ARG_STRING;   break;
+        default:                                  *cls = ARG_NONE;     break;
+    }
+    return *spec ? spec + 1 : spec;
+}
+
+static void captureArgs(logItem *item, const char *format, va_list args)
+{
+    size_t stringsUsed = 0;
+    item->argCount = 0;
+
+    for(const char *p = format; *p; )
+    {
+        if(*p++ != '%') continue;
+        if(*p == '%') { p++; continue; }
+
+        argClass cls;
+        int isLong, stars;
+        p = parseSpec(p, &cls, &isLong, &stars);
+        if(item->argCount + stars + 1 > LOG_MAX_ARGS) break;
+
+        for(int i = 0; i < stars; ++i)
+            item->args[item->argCount++].i = va_arg(args, int);
+
+        logArg *arg = &item->args[item->argCount++];
+        switch(cls)
+        {
+            case ARG_SIGNED:
+                if(isLong == 4)      arg->i = va_arg(args, long long);
+                else if(isLong == 3) arg->i = va_arg(args, long);
+                else if(isLong == 5) arg->i = (long long)va_arg(args, size_t);
+                else                 arg->i = va_arg(args, int);
+                if(isLong == 1) arg->i = (short)arg->i;
+                if(isLong == 2) arg->i = (signed char)arg->i;
+                break;
+            case ARG_UNSIGNED:
+                if(isLong == 4)      arg->u = va_arg(args, unsigned long long);
+                else if(isLong == 3) arg->u = va_arg(args, unsigned long);
+                else if(isLong == 5) arg->u = va_arg(args, size_t);
+                else                 arg->u = va_arg(args, unsigned int);
+                if(isLong == 1) arg->u = (unsigned short)arg->u;
+                if(isLong == 2) arg->u = (unsigned char)arg->u;
+                break;
+            case ARG_DOUBLE:
+                arg->d = (isLong == 6) ? (double)va_arg(args, long double) : va_arg(args, double);
+                break;
+            case ARG_POINTER:
+                arg->p = va_arg(args, void *);
+                break;
+            case ARG_STRING:
+            {
+                // Strings may not outlive the call, so copy what fits
+                const char *str = va_arg(args, const char *);
+                if(!str) str = "(null)";
+                size_t room = LOG_MAX_STRINGS - stringsUsed;
+                size_t len = room ? strnlen(str, room - 1) : 0;
+                arg->s = stringsUsed;
+                if(room)
+                {
+                    memcpy(item->strings + stringsUsed, str, len);
+                    item->strings[stringsUsed + len] = '\0';
+                    stringsUsed += len + 1;
+                }
+                else arg->s = LOG_MAX_STRINGS - 1; // Points at the last terminator
+                break;
+            }
+            case ARG_NONE:
+                item->argCount--;
+                break;
+        }
+    }
+}
+
+// Rebuilds the message on the log thread, one conversion at a time.
+static void formatItem(const logItem *item, char *out, size_t size)
+{
+    size_t used = 0;
+    int argIndex = 0;
+    const char *p = item->format;
+
+    while(*p && used + 1 < size)
+    {
+        if(*p != '%') { out[used++] = *p++; continue; }
+        if(p[1] == '%') { out[used++] = '%'; p += 2; continue; }
+
+        const char *start = p;
+        argClass cls;
+        int isLong, stars;
+        p = parseSpec(p + 1, &cls, &isLong, &stars);
+        if(cls == ARG_NONE || argIndex + stars >= item->argCount) break;
+
+        // Copy the conversion, widening integer lengths to ll
+        char spec[32];
+        size_t specLen = 0;
+        const char *conv = p - 1;
+        for(const char *c = start; c < conv && specLen < sizeof(spec) - 4; ++c)
+            if(!strchr("hljztL", *c)) spec[specLen++] = *c;
+        if(cls == ARG_SIGNED && *conv != 'c')  { spec[specLen++] = 'l'; spec[specLen++] = 'l'; }
+        if(cls == ARG_UNSIGNED)                { spec[specLen++] = 'l'; spec[specLen++] = 'l'; }
+        spec[specLen++] = *conv;
+        spec[specLen] = '\0';
+
+        int star[2] = { 0, 0 };
+        for(int i = 0; i < stars; ++i) star[i] = (int)item->args[argIndex++].i;
+        const logArg *arg = &item->args[argIndex++];
+
+        char *dst = out + used;
+        size_t room = size - used;
+        int n = 0;
+        #define LOG_EMIT(value) \
+            n = (stars == 2) ? snprintf(dst, room, spec, star[0], star[1], value) : \
+                (stars == 1) ? snprintf(dst, room, spec, star[0], value) : snprintf(dst, room, spec, value)
+        switch(cls)
+        {
+            case ARG_SIGNED:   if(*conv == 'c') LOG_EMIT((int)arg->i); else LOG_EMIT(arg->i); break;
+            case ARG_UNSIGNED: LOG_EMIT(arg->u); break;
+            case ARG_DOUBLE:   LOG_EMIT(arg->d); break;
+            case ARG_POINTER:  LOG_EMIT(arg->p); break;
+            case ARG_STRING:   LOG_EMIT(item->strings + arg->s); break;
+            case ARG_NONE:     break;
+        }
+        #undef LOG_EMIT
+
+        if(n < 0) break;
+        used += ((size_t)n < room) ? (size_t)n : room - 1;
+    }
+    out[used] = '\0';
+}
+
+static void flushOutput(void)
+{
+    if(output && writeUsed) fwrite(writeBuffer, 1, writeUsed, output);
+    if(output) fflush(output);
+    writeUsed = 0;
+}
+
+// Offset of the record after the one at offset, following the wrap. Shared with the reader.
+static uint64_t nextRecord(const uint8_t *base, uint64_t size, uint64_t offset)
+{
+    uint32_t length = LOG_BINARY_END;
+    if(offset + 16 <= size) memcpy(&length, base + offset + 8, 4);
+    if(length != LOG_BINARY_END) offset += (16 + (uint64_t)length + 7) & ~(uint64_t)7;
+    if(length == LOG_BINARY_END || offset + 16 > size) return sizeof(logBinaryHeader);
+    return offset;
+}
+
+static void writeBinary(uint64_t timestamp, const char *msg, size_t len)
+{
+    size_t record = (16 + len + 7) & ~(size_t)7;
+    uint8_t *base = (uint8_t *)binary;
+    if(record >= binary->size - sizeof(logBinaryHeader)) return; // Can never fit next to anything
+
+    // Before the first wrap the oldest record stays at the start, after it the writer chases it
+    bool full = binary->wraps > 0;
+    if(binary->writeOffset + record > binary->size)
+    {
+        if(binary->writeOffset + 16 <= binary->size)
+            memcpy(base + binary->writeOffset + 8, &(uint32_t){ LOG_BINARY_END }, 4);
+        if(full && binary->oldestOffset >= binary->writeOffset)
+            binary->oldestOffset = sizeof(logBinaryHeader); // It sat in the tail given up above
+        binary->writeOffset = sizeof(logBinaryHeader);
+        binary->wraps++;
+        full = true;
+    }
+
+    // Move the oldest record past everything this one overwrites
+    while(full && binary->oldestOffset >= binary->writeOffset && binary->oldestOffset < binary->writeOffset + record)
+    {
+        uint64_t next = nextRecord(base, binary->size, binary->oldestOffset);
+        bool wrapped = next < binary->oldestOffset;
+        binary->oldestOffset = next;
+        if(wrapped) break; // Back at the start: newer records, or this one when it is at the start
+    }
+
+    uint8_t *dst = base + binary->writeOffset;
+    uint32_t length = (uint32_t)len;
+    memcpy(dst, &timestamp, 8);
+    memcpy(dst + 8, &length, 4);
+    memset(dst + 12, 0, 4);
+    memcpy(dst + 16, msg, len);
+    binary->writeOffset += record;
+}
+
+static void writeItem(const logItem *item)
+{
+    char msg[LOG_MAX_LEN];
+    formatItem(item, msg, sizeof(msg));
+
+    if(binary) writeBinary(item->timestamp, msg, strlen(msg));
+    if(!output) return;
+
+    // The date only changes once a second, so only then go through localtime/strftime
+    uint64_t offset = item->timestamp - monoBase;
+    time_t second = (time_t)((wallBase + offset) / 1000000000ull);
+    if(second != cachedSecond)
+    {
+        struct tm tm_info;
+        localtime_r(&second, &tm_info);
+        strftime(cachedTime, sizeof(cachedTime), "%Y-%m-%d %H:%M:%S", &tm_info);
+        cachedSecond = second;
+    }
+
+    if(LOG_WRITE_BUFFER - writeUsed < LOG_MAX_LEN + 64) flushOutput();
+    int n = snprintf(writeBuffer + writeUsed, LOG_WRITE_BUFFER - writeUsed, "[%s +%llu.%09llu] %s\n", cachedTime,
+                     (unsigned long long)(offset / 1000000000ull), (unsigned long long)(offset % 1000000000ull), msg);
+    if(n > 0) writeUsed += ((size_t)n < LOG_WRITE_BUFFER - writeUsed) ? (size_t)n : LOG_WRITE_BUFFER - writeUsed - 1;
+}
+
+// Writes every message ready right now in one go, returning how many there were.
+static size_t drainBatch(void)
+{
+    size_t count = 0;
+    pthread_mutex_lock(&outputLock);
+    while(count < LOG_BUFFER_SIZE)
+    {
+        logItem *item = &queue[tail & (LOG_BUFFER_SIZE - 1)];
+        if(atomic_load_explicit(&item->sequence, memory_order_acquire) != tail + 1) break;
+
+        writeItem(item);
+        atomic_store_explicit(&item->sequence, tail + LOG_BUFFER_SIZE, memory_order_release);
+        tail++;
+        count++;
+    }
+    atomic_store_explicit(&written, tail, memory_order_relaxed);
+    if(count) flushOutput();
+    pthread_mutex_unlock(&outputLock);
+    return count;
+}
+
 static void *logThreadFunc(void *arg)
 {
-    (void)arg; 
+    (void)arg;
+    unsigned long reported = 0;
+
     while(1)
     {
-        pthread_mutex_lock(&logMutex);
-        while(head == tail && running)
-            pthread_cond_wait(&queueCond, &logMutex);
+        if(drainBatch()) continue;
+        if(!atomic_load_explicit(&running, memory_order_acquire))
+        {
+            // A producer may have claimed a slot without publishing it yet, wait for it
+            if(atomic_load_explicit(&head, memory_order_acquire) == tail) break; // Stopped and drained
+            sched_yield();
+            continue;
+        }
 
-        if(head == tail && !running)
+        unsigned long lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+        if(lost != reported)
         {
-            pthread_mutex_unlock(&logMutex);
-            break; // Exit thread if not running
+            pthread_mutex_lock(&outputLock);
+            if(output) fprintf(output, "[log] %lu message(s) dropped, queue full\n", lost - reported);
+            pthread_mutex_unlock(&outputLock);
+            reported = lost;
         }
 
-        logItem item = queue[tail];
-        tail = (tail + 1) % LOG_BUFFER_SIZE;
-        pthread_mutex_unlock(&logMutex);
+        nanosleep(&(struct timespec){ 0, 1000000 }, NULL); // Queue empty, the producers never signal
+    }
+
+    return NULL;
+}
 
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timeStr[26];
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", tm_info);
+static void closeOutputs(void)
+{
+    flushOutput();
+    if(output && outputIsFile) fclose(output);
+    output = NULL;
+    outputIsFile = 0;
 
-        printf("[%s] %s\n", timeStr, item.msg);
+    if(binary)
+    {
+        size_t size = binary->size;
+        msync(binary, size, MS_ASYNC);
+        munmap(binary, size);
+        binary = NULL;
     }
+}
 
-    return NULL;
+int logSetOutput(const char *path)
+{
+    FILE *file = stdout;
+    if(!path) file = NULL;
+    else if(strcmp(path, "-") && !(file = fopen(path, "a")))
+    {
+        perror("Failed to open log file");
+        return 1;
+    }
+
+    pthread_mutex_lock(&outputLock);
+    flushOutput();
+    if(output && outputIsFile) fclose(output);
+    output = file;
+    outputIsFile = file && file != stdout;
+    outputConfigured = 1;
+    pthread_mutex_unlock(&outputLock);
+    return 0;
+}
+
+int logSetBinaryOutput(const char *path, size_t size)
+{
+    logBinaryHeader *map = NULL;
+    if(path)
+    {
+        if(size < 4096) size = 4096;
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0 || ftruncate(fd, (off_t)size))
+        {
+            perror("Failed to create binary log");
+            if(fd >= 0) close(fd);
+            return 1;
+        }
+
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED)
+        {
+            perror("Failed to map binary log");
+            return 2;
+        }
+
+        map->magic = LOG_BINARY_MAGIC;
+        map->size = size;
+        map->writeOffset = sizeof(logBinaryHeader);
+        map->wraps = 0;
+        map->monoBase = monoBase;
+        map->oldestOffset = map->writeOffset;
+    }
+
+    pthread_mutex_lock(&outputLock);
+    if(binary) munmap(binary, binary->size);
+    binary = map;
+    pthread_mutex_unlock(&outputLock);
+    return 0;
+}
+
+int logDumpBinary(const char *path, FILE *out)
+{
+    FILE *file = fopen(path, "rb");
+    logBinaryHeader header;
+    if(!file || fread(&header, sizeof(header), 1, file) != 1 || header.magic != LOG_BINARY_MAGIC)
+    {
+        if(file) fclose(file);
+        return 1; // Not a binary log
+    }
+
+    uint8_t *base = malloc(header.size);
+    bool ok = base && !fseek(file, 0, SEEK_SET) && fread(base, 1, header.size, file) == header.size;
+    fclose(file);
+    ok = ok && header.writeOffset <= header.size && header.oldestOffset <= header.size;
+    if(!ok)
+    {
+        free(base);
+        return 2; // Truncated
+    }
+
+    // Follow the records from the oldest one around to the write position, which
+    // is the start when too little was left for a record before the end
+    uint64_t at = header.oldestOffset, steps = 0;
+    uint64_t end = header.writeOffset + 16 > header.size ? sizeof(logBinaryHeader) : header.writeOffset;
+    bool empty = !header.wraps && header.writeOffset == sizeof(logBinaryHeader);
+    while(!empty)
+    {
+        uint32_t length = LOG_BINARY_END;
+        if(at + 16 <= header.size) memcpy(&length, base + at + 8, 4);
+        if(length != LOG_BINARY_END)
+        {
+            uint64_t timestamp;
+            memcpy(&timestamp, base + at, 8);
+            if(at + 16 + length > header.size || ++steps > header.size / 16) break; // Corrupt
+            uint64_t offset = timestamp - header.monoBase;
+            fprintf(out, "+%llu.%09llu %.*s\n", (unsigned long long)(offset / 1000000000ull),
+                    (unsigned long long)(offset % 1000000000ull), (int)length, (const char *)base + at + 16);
+        }
+        at = nextRecord(base, header.size, at);
+        if(at == end) break;
+    }
+    free(base);
+    return at == end || empty ? 0 : 2; // 2: corrupt
 }
 
 int logInit(void)
 {
-    running = 1;
+    for(size_t i = 0; i < LOG_BUFFER_SIZE; ++i)
+        atomic_store_explicit(&queue[i].sequence, i, memory_order_relaxed);
+    atomic_store(&head, 0);
+    tail = 0;
+    atomic_store(&written, 0);
+    atomic_store(&dropped, 0);
+
+    struct timespec wall;
+    monoBase = statsClock();
+    clock_gettime(CLOCK_REALTIME, &wall);
+    wallBase = (uint64_t)wall.tv_sec * 1000000000ull + (uint64_t)wall.tv_nsec;
+    cachedSecond = -1;
+    if(!outputConfigured) output = stdout;
+    if(binary) binary->monoBase = monoBase;
+
+    atomic_store(&running, 1);
     if(pthread_create(&logThread, NULL, logThreadFunc, NULL) != 0)
     {
         perror("Failed to create log thread");
-        running = 0;
+        atomic_store(&running, 0);
         return 1;
     }
 
@@ -68,31 +537,89 @@ int logInit(void)
 
 void logFree(void)
 {
-    pthread_mutex_lock(&logMutex);
-    running = 0;
-
-    pthread_cond_signal(&queueCond);
-    pthread_mutex_unlock(&logMutex);
+    atomic_store_explicit(&running, 0, memory_order_release);
     pthread_join(logThread, NULL);
+
+    pthread_mutex_lock(&outputLock);
+    closeOutputs();
+    pthread_mutex_unlock(&outputLock);
+}
+
+void logSetLevel(int level)
+{
+    atomic_store_explicit(&logLevel, level, memory_order_relaxed);
+}
+
+void logSetCategories(unsigned categories)
+{
+    atomic_store_explicit(&logCategories, categories, memory_order_relaxed);
+}
+
+int logParseLevel(const char *name)
+{
+    static const char *names[] = { "trace", "debug", "info", "warn", "error", "none" };
+    for(int level = LOG_LEVEL_TRACE; level <= LOG_LEVEL_NONE; ++level)
+        if(!strcmp(name, names[level])) return level;
+    return -1;
+}
+
+unsigned long logDroppedCount(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
 }
 
+unsigned long logQueueDepth(void)
+{
+    size_t claimed = atomic_load_explicit(&head, memory_order_relaxed);
+    size_t done = atomic_load_explicit(&written, memory_order_relaxed);
+    return claimed > done ? claimed - done : 0;
+}
+
+unsigned long long logTimeSpent(void)
+{
+    return atomic_load_explicit(&spent, memory_order_relaxed);
+}
+
+// Bounded multi-producer queue: each slot's sequence says whose turn it is.
+// sequence == position -> free for the producer claiming that position,
+// sequence == position + 1 -> filled, ready for the log thread.
 void logMessage(const char *message, ...)
 {
-    char buffer[LOG_MAX_LEN];
+    size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    logItem *item;
+    while(1)
+    {
+        item = &queue[pos & (LOG_BUFFER_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&item->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0)
+        {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return; // Queue full
+        }
+        else
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+    }
+
+    uint64_t start = statsClock();
+    item->timestamp = start;
+    item->format = message;
+
     va_list args;
     va_start(args, message);
-    vsnprintf(buffer, LOG_MAX_LEN, message, args);
+    captureArgs(item, message, args);
     va_end(args);
 
-    pthread_mutex_lock(&logMutex);
-    int next = (head + 1) % LOG_BUFFER_SIZE;
-    if(next != tail)
-    {
-        memcpy(queue[head].msg, buffer, LOG_MAX_LEN);
-        queue[head].msg[LOG_MAX_LEN - 1] = '\0';
-        head = next;
-        pthread_cond_signal(&queueCond);
-    }
+    atomic_store_explicit(&item->sequence, pos + 1, memory_order_release);
 
-    pthread_mutex_unlock(&logMutex);
-}
\ No newline at end of file
+    // Counted per thread, so producers only share the total every LOG_TIME_SAMPLE-th message
+    if(!(++queuedHere & (LOG_TIME_SAMPLE - 1)))
+        atomic_fetch_add_explicit(&spent, (statsClock() - start) * LOG_TIME_SAMPLE, memory_order_relaxed);
+}
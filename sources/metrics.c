@@ -0,0 +1,226 @@
+#define _POSIX_C_SOURCE 200809L // MSG_NOSIGNAL, open_memstream
+#include "../includes/metrics.h"
+#include "../includes/gameboy.h"
+#include "../includes/log.h"
+#include "../includes/stats.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_REQUEST_MS 50 // How long a client gets to send its request line
+
+struct Metrics
+{
+    MetricsSlot slots[METRICS_MAX_SLOTS];
+    atomic_int  slotCount;    // Slots handed out so far
+
+    int         listener;
+    pthread_t   thread;
+    atomic_bool stop;
+    char        path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+    // Server thread only: totals at the previous scrape, rates cover the time in between
+    double      start;
+    double      lastScrape;
+    uint64_t    last[METRIC_COUNT];
+};
+
+static const struct { const char *name; const char *help; } metricNames[METRIC_COUNT] =
+{
+    { "gb_frames_total",         "Frames emulated" },
+    { "gb_frames_skipped_total", "Frames emulated without rasterizing" },
+    { "gb_cycles_total",         "CPU cycles emulated" },
+    { "gb_instructions_total",   "Instructions executed" }
+};
+
+MetricsSlot *metricsSlot(Metrics *metrics, const char *label)
+{
+    if(!metrics) return NULL;
+
+    int index = atomic_fetch_add(&metrics->slotCount, 1);
+    if(index >= METRICS_MAX_SLOTS)
+    {
+        LOG_WARN(LOG_GENERAL, "Metrics slots exhausted, %s is not reported", label);
+        return NULL;
+    }
+
+    MetricsSlot *slot = &metrics->slots[index];
+    snprintf(slot->label, sizeof(slot->label), "%s", label);
+    atomic_store_explicit(&slot->claimed, true, memory_order_release);
+    return slot;
+}
+
+// Sums every slot, the only place the counters are read
+static void writeMetrics(Metrics *metrics, FILE *out)
+{
+    uint64_t totals[METRIC_COUNT] = { 0 };
+    int count = atomic_load(&metrics->slotCount);
+    if(count > METRICS_MAX_SLOTS) count = METRICS_MAX_SLOTS;
+
+    for(int metric = 0; metric < METRIC_COUNT; ++metric)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", metricNames[metric].name, metricNames[metric].help,
+                metricNames[metric].name);
+        for(int i = 0; i < count; ++i)
+        {
+            MetricsSlot *slot = &metrics->slots[i];
+            if(!atomic_load_explicit(&slot->claimed, memory_order_acquire)) continue;
+
+            uint64_t value = atomic_load_explicit(&slot->values[metric], memory_order_relaxed);
+            totals[metric] += value;
+            fprintf(out, "%s{instance=\"%s\"} %llu\n", metricNames[metric].name, slot->label,
+                    (unsigned long long)value);
+        }
+    }
+
+    double now = statsClock() / 1e9, elapsed = now - metrics->lastScrape;
+    double rate[METRIC_COUNT];
+    for(int metric = 0; metric < METRIC_COUNT; ++metric)
+    {
+        uint64_t delta = totals[metric] - metrics->last[metric];
+        rate[metric] = elapsed > 0 ? delta / elapsed : 0.0;
+        metrics->last[metric] = totals[metric];
+    }
+    metrics->lastScrape = now;
+
+    fprintf(out, "# HELP gb_frames_per_second Frames emulated per second since the previous scrape, every instance\n"
+                 "# TYPE gb_frames_per_second gauge\ngb_frames_per_second %.3f\n", rate[METRIC_FRAMES]);
+    fprintf(out, "# HELP gb_speed_ratio Emulated time per wall time since the previous scrape, every instance\n"
+                 "# TYPE gb_speed_ratio gauge\ngb_speed_ratio %.4f\n", rate[METRIC_FRAMES] / GB_FRAME_RATE);
+    fprintf(out, "# HELP gb_instructions_per_second Instructions per second since the previous scrape\n"
+                 "# TYPE gb_instructions_per_second gauge\ngb_instructions_per_second %.0f\n",
+            rate[METRIC_INSTRUCTIONS]);
+    fprintf(out, "# HELP gb_frameskip_ratio Share of frames not rasterized since the previous scrape\n"
+                 "# TYPE gb_frameskip_ratio gauge\ngb_frameskip_ratio %.4f\n",
+            rate[METRIC_FRAMES] > 0 ? rate[METRIC_FRAMES_SKIPPED] / rate[METRIC_FRAMES] : 0.0);
+    fprintf(out, "# HELP gb_log_queue_depth Log messages queued but not yet written\n"
+                 "# TYPE gb_log_queue_depth gauge\ngb_log_queue_depth %lu\n", logQueueDepth());
+    fprintf(out, "# HELP gb_log_dropped_total Log messages lost to a full queue\n"
+                 "# TYPE gb_log_dropped_total counter\ngb_log_dropped_total %lu\n", logDroppedCount());
+    fprintf(out, "# HELP gb_uptime_seconds Time since the metrics server started\n"
+                 "# TYPE gb_uptime_seconds gauge\ngb_uptime_seconds %.3f\n", now - metrics->start);
+}
+
+static void sendAll(int fd, const char *data, size_t length)
+{
+    while(length)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return; // Client went away
+        data += sent;
+        length -= (size_t)sent;
+    }
+}
+
+// Plain text for anything that just connects and reads, an HTTP response for a GET
+static void serveClient(Metrics *metrics, int fd)
+{
+    char request[512];
+    ssize_t received = 0;
+    struct pollfd client = { fd, POLLIN, 0 };
+    if(poll(&client, 1, METRICS_REQUEST_MS) > 0)
+        received = recv(fd, request, sizeof(request), 0);
+    bool http = received >= 4 && !memcmp(request, "GET ", 4);
+
+    char *body = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&body, &length);
+    if(!out)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate metrics response");
+        return;
+    }
+    writeMetrics(metrics, out);
+    fclose(out);
+
+    if(http)
+    {
+        char header[128];
+        int size = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                    "Content-Length: %zu\r\n\r\n", length);
+        sendAll(fd, header, (size_t)size);
+    }
+    sendAll(fd, body, length);
+    free(body);
+}
+
+static void *serverThread(void *arg)
+{
+    Metrics *metrics = arg;
+    struct pollfd listener = { metrics->listener, POLLIN, 0 };
+
+    while(!atomic_load_explicit(&metrics->stop, memory_order_relaxed))
+    {
+        if(poll(&listener, 1, METRICS_POLL_MS) <= 0) continue;
+
+        int fd = accept(metrics->listener, NULL, NULL);
+        if(fd < 0) continue;
+        serveClient(metrics, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+Metrics *metricsStart(const char *path)
+{
+    Metrics *metrics = aligned_alloc(_Alignof(Metrics), sizeof(Metrics));
+    if(!metrics)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate metrics");
+        return NULL; // Memory allocation error
+    }
+    memset(metrics, 0, sizeof(Metrics));
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        LOG_ERROR(LOG_GENERAL, "Metrics socket path too long: %s", path);
+        free(metrics);
+        return NULL; // Bad path
+    }
+    strcpy(address.sun_path, path);
+    strcpy(metrics->path, path);
+
+    metrics->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // Left over from an earlier run
+    if(metrics->listener < 0 || bind(metrics->listener, (struct sockaddr *)&address, sizeof(address))
+       || listen(metrics->listener, 8))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to serve metrics on %s: %s", path, strerror(errno));
+        if(metrics->listener >= 0) close(metrics->listener);
+        free(metrics);
+        return NULL; // Socket setup failed
+    }
+
+    metrics->start = metrics->lastScrape = statsClock() / 1e9;
+    if(pthread_create(&metrics->thread, NULL, serverThread, metrics))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to start the metrics thread");
+        close(metrics->listener);
+        unlink(path);
+        free(metrics);
+        return NULL; // Thread creation failed
+    }
+    LOG_INFO(LOG_GENERAL, "Serving metrics on %s", path);
+    return metrics;
+}
+
+void metricsStop(Metrics *metrics)
+{
+    if(!metrics) return;
+    atomic_store(&metrics->stop, true);
+    pthread_join(metrics->thread, NULL);
+    close(metrics->listener);
+    unlink(metrics->path);
+    free(metrics);
+}
@@ -1,118 +1,428 @@
 #include "../includes/mmu.h"
 #include "../includes/log.h"
+#include "../includes/ppu.h"
+#include "../includes/apu.h"
+#include "../includes/serial.h"
+#include "../includes/stats.h"
+#include "../includes/debugger.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static uint8_t gbRomSize[] = { 2, 4, 8, 32, 64, 128 };
-static uint8_t gbRamSize[] = { 0, 1, 1, 4, 16, 8 };
+static const uint8_t gbRomSize[] = { 2, 4, 8, 32, 64, 128 };
+static const uint8_t gbRamSize[] = { 0, 1, 1, 4, 16, 8 };
 
-int initMMU(MMU *mmu, const char *filename)
+Rom *romCreate(const uint8_t *image, uint32_t imageSize)
 {
-    LOG("Initializing MMU with ROM file: %s", filename);
+    if (imageSize < 0x150)
+    {
+        LOG_ERROR(LOG_MMU, "ROM image too small: %u bytes", imageSize);
+        return NULL; // Truncated header
+    }
+
+    uint8_t romCode = image[HEADER_ROM_SIZE_OFFSET];
+    uint8_t ramCode = image[HEADER_RAM_SIZE_OFFSET];
+    if (romCode >= sizeof(gbRomSize) || ramCode >= sizeof(gbRamSize))
+    {
+        LOG_ERROR(LOG_MMU, "Unsupported ROM/RAM size codes 0x%02X/0x%02X", romCode, ramCode);
+        return NULL; // Unknown cartridge size
+    }
+
+    Rom *rom = malloc(sizeof(Rom));
+    uint32_t size = (uint32_t)gbRomSize[romCode] * 0x4000;
+    if (imageSize > size) size = imageSize;
+    uint8_t *data = rom ? calloc(1, size) : NULL;
+    if (!data)
+    {
+        LOG_ERROR(LOG_MMU, "Failed to allocate memory for ROM data");
+        free(rom);
+        return NULL; // Memory allocation error
+    }
+
+    memcpy(data, image, imageSize);
+    rom->data = data;
+    rom->size = size;
+    rom->romBankCount = gbRomSize[romCode];
+    rom->ramBankCount = gbRamSize[ramCode];
+    atomic_init(&rom->refs, 1);
+    return rom;
+}
+
+Rom *romLoad(const char *filename)
+{
+    LOG_INFO(LOG_MMU, "Loading ROM file: %s", filename);
 
     FILE *file = fopen(filename, "rb");
     if (!file)
     {
-        LOG("Failed to open ROM file: %s", filename);
-        return 1; // Error opening file
+        LOG_ERROR(LOG_MMU, "Failed to open ROM file: %s", filename);
+        return NULL; // Error opening file
     }
 
     fseek(file, 0, SEEK_END);
     long fileSize = ftell(file);
     fseek(file, 0, SEEK_SET);
 
-    mmu->romData = malloc(fileSize);
-    if (!mmu->romData)
+    uint8_t *image = fileSize > 0 ? malloc(fileSize) : NULL;
+    if (!image || fread(image, 1, fileSize, file) != (size_t)fileSize)
     {
-        LOG("Failed to allocate memory for ROM data");
+        LOG_ERROR(LOG_MMU, "Failed to read ROM file: %s", filename);
+        free(image);
         fclose(file);
-        return 1; // Memory allocation error
+        return NULL; // Read error
     }
-
-    fread(mmu->romData, 1, fileSize, file);
     fclose(file);
 
-    uint8_t romCode = mmu->romData[HEADER_ROM_SIZE_OFFSET];
-    uint8_t ramCode = mmu->romData[HEADER_RAM_SIZE_OFFSET];
+    Rom *rom = romCreate(image, (uint32_t)fileSize);
+    free(image);
+    return rom;
+}
+
+void romRetain(Rom *rom)
+{
+    atomic_fetch_add_explicit(&rom->refs, 1, memory_order_relaxed);
+}
+
+void romRelease(Rom *rom)
+{
+    if (!rom || atomic_fetch_sub_explicit(&rom->refs, 1, memory_order_acq_rel) != 1) return;
+    free(rom->data);
+    free(rom);
+}
+
+uint64_t romHash(const Rom *rom)
+{
+    // FNV-1a over the padded image, identifies the exact ROM a movie or state belongs to
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < rom->size; ++i)
+        hash = (hash ^ rom->data[i]) * 1099511628211ull;
+    return hash;
+}
+
+static MemoryPage *pageCreate(size_t size)
+{
+    MemoryPage *page = calloc(1, sizeof(MemoryPage) + size);
+    if (page) atomic_init(&page->refs, 1);
+    return page;
+}
+
+static void pageRelease(MemoryPage *page)
+{
+    if (page && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1)
+        free(page);
+}
+
+static bool pageShared(MemoryPage *page)
+{
+    return atomic_load_explicit(&page->refs, memory_order_acquire) > 1;
+}
+
+// Returns a page only this instance references, copying it if it is shared
+static MemoryPage *pageUnshare(MemoryPage *page, size_t size)
+{
+    if (!pageShared(page)) return page;
+
+    MemoryPage *copy = malloc(sizeof(MemoryPage) + size);
+    if (!copy)
+    {
+        LOG_ERROR(LOG_MMU, "Failed to unshare a %zu byte page", size);
+        abort(); // A write cannot fail and must not reach a page other instances see
+    }
+    atomic_init(&copy->refs, 1);
+    memcpy(copy->data, page->data, size);
+    pageRelease(page); // The data was copied before our reference was dropped
+    return copy;
+}
+
+static void mapRange(MMU *mmu, uint16_t address, size_t size, uint8_t *data, bool writable)
+{
+    for (size_t offset = 0; offset < size; offset += MMU_PAGE_SIZE)
+    {
+        int page = (address + offset) >> MMU_PAGE_SHIFT;
+        mmu->mappedRead[page] = data ? data + offset : NULL;
+        mmu->mappedWrite[page] = writable && data ? data + offset : NULL;
+        mmu->readMap[page] = mmu->watchPages[page] & MMU_WATCH_READ ? NULL : mmu->mappedRead[page];
+        mmu->writeMap[page] = mmu->watchPages[page] & MMU_WATCH_WRITE ? NULL : mmu->mappedWrite[page];
+    }
+}
+
+static void mapRomBank(MMU *mmu)
+{
+    uint32_t offset = 0x4000 * (mmu->currentRomBank & (mmu->romBankCount - 1)); // Bank counts are powers of two
+    mapRange(mmu, 0x4000, 0x4000, (uint8_t *)mmu->romData + offset, false); // Writes go to the MBC
+}
+
+static void mapCartRam(MMU *mmu)
+{
+    uint8_t *data = NULL;
+    if (mmu->ramEnabled && mmu->ramBankCount > 0)
+        data = mmu->ramData + 0x2000 * (mmu->currentRamBank & (mmu->ramBankCount - 1));
+    mapRange(mmu, 0xA000, 0x2000, data, true); // Not mapped reads 0xFF in the slow path
+}
+
+static void mapWramPage(MMU *mmu, int page)
+{
+    MemoryPage *memory = mmu->wramPages[page];
+    bool writable = !pageShared(memory);
+    mapRange(mmu, 0xC000 + page * MMU_PAGE_SIZE, MMU_PAGE_SIZE, memory->data, writable);
+    if (0xE000 + (page + 1) * MMU_PAGE_SIZE <= 0xFE00)
+        mapRange(mmu, 0xE000 + page * MMU_PAGE_SIZE, MMU_PAGE_SIZE, memory->data, writable); // Echo
+}
+
+void mmuRemap(MMU *mmu)
+{
+    memset(mmu->readMap, 0, sizeof(mmu->readMap));
+    memset(mmu->writeMap, 0, sizeof(mmu->writeMap));
+    memset(mmu->mappedRead, 0, sizeof(mmu->mappedRead));
+    memset(mmu->mappedWrite, 0, sizeof(mmu->mappedWrite));
 
-    mmu->romBankCount = gbRomSize[romCode];
-    mmu->ramBankCount = gbRamSize[ramCode];
+    mapRange(mmu, 0x0000, 0x4000, (uint8_t *)mmu->romData, false);
+    mapRomBank(mmu);
+    mapRange(mmu, 0x8000, VRAM_SIZE, mmu->vram, false); // Writes go through PPU tracking
+    mapCartRam(mmu);
+    for (int page = 0; page < MMU_WRAM_PAGES; ++page)
+        mapWramPage(mmu, page);
+}
 
+void mmuWatchPage(MMU *mmu, int page, uint8_t watch)
+{
+    mmu->watchPages[page] = watch;
+    mmu->readMap[page] = watch & MMU_WATCH_READ ? NULL : mmu->mappedRead[page];
+    mmu->writeMap[page] = watch & MMU_WATCH_WRITE ? NULL : mmu->mappedWrite[page];
+}
+
+uint8_t *mmuVramWritable(MMU *mmu)
+{
+    if (pageShared(mmu->vramPage))
+    {
+        mmu->vramPage = pageUnshare(mmu->vramPage, VRAM_SIZE);
+        mmu->vram = mmu->vramPage->data;
+        mapRange(mmu, 0x8000, VRAM_SIZE, mmu->vram, false);
+    }
+    return mmu->vram;
+}
+
+uint8_t *mmuWramWritable(MMU *mmu, int page)
+{
+    if (pageShared(mmu->wramPages[page]))
+    {
+        mmu->wramPages[page] = pageUnshare(mmu->wramPages[page], MMU_PAGE_SIZE);
+        mapWramPage(mmu, page);
+    }
+    else if (!mmu->mappedWrite[(0xC000 >> MMU_PAGE_SHIFT) + page])
+        mapWramPage(mmu, page); // The instances sharing it are gone, take the fast path again
+    return mmu->wramPages[page]->data;
+}
+
+int initMMU(MMU *mmu, Rom *rom)
+{
+    memset(mmu, 0, sizeof(MMU));
+    if (rom->ramBankCount)
+    {
+        mmu->ramData = calloc(rom->ramBankCount, 0x2000);
+        if (!mmu->ramData)
+        {
+            LOG_ERROR(LOG_MMU, "Failed to allocate cartridge RAM");
+            return 1; // Memory allocation error
+        }
+    }
+
+    mmu->vramPage = pageCreate(VRAM_SIZE);
+    bool allocated = mmu->vramPage != NULL;
+    for (int page = 0; page < MMU_WRAM_PAGES; ++page)
+        allocated &= (mmu->wramPages[page] = pageCreate(MMU_PAGE_SIZE)) != NULL;
+    if (!allocated)
+    {
+        LOG_ERROR(LOG_MMU, "Failed to allocate VRAM/WRAM pages");
+        pageRelease(mmu->vramPage);
+        for (int page = 0; page < MMU_WRAM_PAGES; ++page)
+            pageRelease(mmu->wramPages[page]);
+        free(mmu->ramData);
+        return 1; // Memory allocation error
+    }
+    mmu->vram = mmu->vramPage->data;
+
+    romRetain(rom);
+    mmu->rom = rom;
+    mmu->romData = rom->data;
+    mmu->romBankCount = rom->romBankCount;
+    mmu->ramBankCount = rom->ramBankCount;
 
     mmu->ramEnabled = false;
     mmu->bankingMode = false;
     mmu->currentRomBank = 1; // Start with bank 1
     mmu->currentRamBank = 0; // Start with bank 0
-    LOG("MMU initialized with ROM size: %d banks, RAM size: %d banks", mmu->romBankCount, mmu->ramBankCount);
+    LOG_INFO(LOG_MMU, "MMU initialized with ROM size: %d banks, RAM size: %d banks", mmu->romBankCount, mmu->ramBankCount);
 
-    memset(mmu->vram, 0, sizeof(mmu->vram));
-    memset(mmu->wram, 0, sizeof(mmu->wram));
     memset(mmu->hram, 0, sizeof(mmu->hram));
     memset(mmu->oam,  0, sizeof(mmu->oam));
     mmu->ieRegisters = 0;
+    mmu->joypad = 0;
+    mmu->joypadSelect = 0x30;
+    mmu->ppu = NULL;
+    mmu->apu = NULL;
+    mmu->serial = NULL;
+    mmuRemap(mmu);
 
-    LOG("MMU initialization complete");
+    LOG_INFO(LOG_MMU, "MMU initialization complete");
     return 0; // Success
 }
 
+int cloneMMU(MMU *clone, MMU *mmu)
+{
+    *clone = *mmu;
+    clone->ppu = NULL;
+    clone->apu = NULL;
+    clone->serial = NULL;
+    clone->debugger = NULL;
+    clone->timed = false;
+    memset(clone->watchPages, 0, sizeof(clone->watchPages)); // Watchpoints belong to the original
+
+    size_t ramSize = (size_t)mmu->ramBankCount * 0x2000;
+    clone->ramData = ramSize ? malloc(ramSize) : NULL;
+    if (ramSize && !clone->ramData)
+    {
+        LOG_ERROR(LOG_MMU, "Failed to allocate cartridge RAM for clone");
+        return 1; // Memory allocation error
+    }
+    if (ramSize) memcpy(clone->ramData, mmu->ramData, ramSize); // Small and battery backed, copied eagerly
+
+    romRetain(mmu->rom);
+    atomic_fetch_add_explicit(&mmu->vramPage->refs, 1, memory_order_relaxed);
+    for (int page = 0; page < MMU_WRAM_PAGES; ++page)
+        atomic_fetch_add_explicit(&mmu->wramPages[page]->refs, 1, memory_order_relaxed);
+
+    // Both sides lose their direct write pointers until they unshare
+    mmuRemap(mmu);
+    mmuRemap(clone);
+    return 0;
+}
+
 void freeMMU(MMU *mmu)
 {
-    if (mmu->romData) free(mmu->romData);
+    pageRelease(mmu->vramPage);
+    for (int page = 0; page < MMU_WRAM_PAGES; ++page)
+        pageRelease(mmu->wramPages[page]);
+    free(mmu->ramData);
+    romRelease(mmu->rom);
 }
 
-uint8_t mmuReadByte(MMU *mmu, uint16_t adress)
+static uint8_t slowRead(MMU *mmu, uint16_t adress)
 {
-    if (adress < 0x4000)
-        return mmu->romData[adress]; // ROM area
-    else if (adress < 0x8000)
-    {
-        uint32_t offset = 0x4000 * mmu->currentRomBank;
-        return mmu->romData[offset + (adress - 0x4000)]; // ROM banked area
-    }
+    if (adress < 0x8000)
+        return mmu->romData[adress]; // Not reached while mapped
     else if (adress < 0xA000)
         return mmu->vram[adress - 0x8000]; 
     else if (adress < 0xC000)
-    {
-        if(mmu->ramEnabled && mmu->ramBankCount > 0)
-            return mmu->romData[0x2000* (mmu->currentRamBank + mmu->ramBankCount) + (adress - 0xA000)];
         return 0xFF;                        // RAM area, but RAM is disabled or no RAM banks
-    }
-    else if (adress < 0xE000)
-        return mmu->wram[adress - 0xC000];  // WRAM area
     else if (adress < 0xFE00)
-        return mmu->wram[adress - 0xE000];  // WRAM mirror area
+    {
+        uint16_t offset = (adress - 0xC000) & 0x1FFF; // WRAM and its mirror
+        return mmu->wramPages[offset >> MMU_PAGE_SHIFT]->data[offset & (MMU_PAGE_SIZE - 1)];
+    }
     else if (adress < 0xFEA0)
         return mmu->oam[adress - 0xFE00];   // OAM area
     else if (adress < 0xFF00)
         return 0xFF;                        // Useless area i guess
     else if (adress < 0xFF80)
-        return ioReadByte(adress);          // IO registers
+        return ioReadByte(mmu, adress);     // IO registers
     else if (adress < 0xFFFF)
         return mmu->hram[adress - 0xFF80];  // HRAM area
     else 
         return mmu->ieRegisters;            // IE register
 }
 
-uint8_t ioReadByte(uint16_t adress)
+// Slow path while a debugger is attached: watched pages report to it, from
+// their mapped memory when they have some
+static uint8_t watchedRead(MMU *mmu, uint16_t adress)
 {
+    if (!(mmu->watchPages[adress >> MMU_PAGE_SHIFT] & MMU_WATCH_READ))
+        return slowRead(mmu, adress);
+
+    const uint8_t *mapped = mmu->mappedRead[adress >> MMU_PAGE_SHIFT];
+    uint8_t value = mapped ? mapped[adress & (MMU_PAGE_SIZE - 1)] : slowRead(mmu, adress);
+    debuggerAccess(mmu->debugger, adress, value, false);
+    return value;
+}
+
+uint8_t mmuReadByte(MMU *mmu, uint16_t adress)
+{
+    const uint8_t *page = mmu->readMap[adress >> MMU_PAGE_SHIFT];
+    if (page)
+        return page[adress & (MMU_PAGE_SIZE - 1)]; // ROM, VRAM, enabled cart RAM, WRAM
+
+    if (mmu->debugger)
+        return watchedRead(mmu, adress); // Not timed, the debugger's stops would skew it
+
+    // Timing every access would cost more than most of them take
+    if (!mmu->timed || ++mmu->slowAccesses & (MMU_TIME_SAMPLE - 1))
+        return slowRead(mmu, adress);
+    uint64_t start = statsClock();
+    uint8_t value = slowRead(mmu, adress);
+    mmu->slowTime += (statsClock() - start) * MMU_TIME_SAMPLE;
+    return value;
+}
+
+// P1 input lines: a 0 bit selects a button group, pressed buttons read as 0
+static uint8_t joypadLines(const MMU *mmu)
+{
+    uint8_t low = 0x0F;
+    if(!(mmu->joypadSelect & 0x10)) low &= ~(mmu->joypad & 0x0F);
+    if(!(mmu->joypadSelect & 0x20)) low &= ~(mmu->joypad >> 4);
+    return low;
+}
+
+// The joypad interrupt fires when any input line falls, whether from a press or a select change
+static void joypadUpdate(MMU *mmu, uint8_t lines)
+{
+    if(lines & ~joypadLines(mmu))
+    {
+        mmu->interruptFlags |= INT_JOYPAD;
+        LOG_TRACE(LOG_IO, "Joypad interrupt requested");
+    }
+}
+
+void mmuSetJoypad(MMU *mmu, uint8_t buttons)
+{
+    uint8_t lines = joypadLines(mmu);
+    mmu->joypad = buttons;
+    joypadUpdate(mmu, lines);
+}
+
+uint8_t ioReadByte(MMU *mmu, uint16_t adress)
+{
+    if(adress == 0xFF00)
+        return 0xC0 | mmu->joypadSelect | joypadLines(mmu);
+    if(adress == 0xFF0F)
+        return 0xE0 | mmu->interruptFlags;
+    if((adress == 0xFF01 || adress == 0xFF02) && mmu->serial)
+        return serialReadRegister(mmu->serial, adress);
+    if(adress >= 0xFF40 && adress <= 0xFF4B && adress != 0xFF46 && mmu->ppu)
+        return ppuReadRegister(mmu->ppu, adress);
+    if(adress >= 0xFF10 && adress <= 0xFF3F && mmu->apu)
+        return apuReadRegister(mmu->apu, adress);
+
     // Placeholder for IO register read logic
     // This function should be implemented to handle specific IO registers
-    LOG("Reading from IO register at address: 0x%04X", adress);
+    LOG_TRACE(LOG_IO, "Reading from IO register at address: 0x%04X", adress);
     return 0;
 }
 
-void mmuWriteByte(MMU *mmu, uint16_t adress, uint8_t value)
+static void slowWrite(MMU *mmu, uint16_t adress, uint8_t value)
 {
-    if (adress > 0x2000)
+    if (adress < 0x2000)
+    {
         mmu->ramEnabled = ((value & 0x0F) == 0x0A); // Enable RAM if value is 0x0A
+        mapCartRam(mmu);
+    }
     else if (adress < 0x4000)
     {
         uint8_t bank = value & 0x1F;
         if(!bank) bank = 1;
 
         mmu->currentRomBank = (mmu->currentRomBank & 0x60) | bank;
+        mapRomBank(mmu);
     }
     else if (adress < 0x6000)
     {
@@ -121,36 +431,109 @@ void mmuWriteByte(MMU *mmu, uint16_t adress, uint8_t value)
             mmu->currentRomBank = (mmu->currentRomBank & 0x1F) | (v << 5);
         else
             mmu->currentRamBank = v; 
+        mapRomBank(mmu);
+        mapCartRam(mmu);
     }
     else if (adress < 0x8000)
         mmu->bankingMode = value & 0x01; // Set banking mode
     else if (adress < 0xA000)
-        mmu->vram[adress - 0x8000] = value; // VRAM area
-    else if (adress < 0xC000)
     {
-        if(mmu->ramEnabled && mmu->ramBankCount > 0)
-            mmu->romData[0x2000 * (mmu->currentRamBank + mmu->ramBankCount) + (adress - 0xA000)] = value;
+        if(mmu->ppu) ppuTrackWrite(mmu->ppu, mmu, adress, mmu->vram[adress - 0x8000], value);
+        mmuVramWritable(mmu)[adress - 0x8000] = value; // VRAM area
     }
-    else if (adress < 0xE000)
-        mmu->wram[adress - 0xC000] = value;
+    else if (adress < 0xC000)
+        {} // Cart RAM disabled or absent
     else if (adress < 0xFE00)
-        mmu->wram[adress - 0xE000] = value;
+    {
+        uint16_t offset = (adress - 0xC000) & 0x1FFF; // WRAM and its mirror
+        mmuWramWritable(mmu, offset >> MMU_PAGE_SHIFT)[offset & (MMU_PAGE_SIZE - 1)] = value;
+    }
     else if (adress < 0xFEA0)
+    {
+        if(mmu->ppu) ppuTrackWrite(mmu->ppu, mmu, adress, mmu->oam[adress - 0xFE00], value);
         mmu->oam[adress - 0xFE00] = value;
+    }
     else if (adress < 0xFF00) 
         {}
     else if (adress < 0xFF80)
-        ioWriteByte(adress, value); // IO registers
+        ioWriteByte(mmu, adress, value); // IO registers
     else if (adress < 0xFFFF)
         mmu->hram[adress - 0xFF80] = value; // HRAM area
     else
         mmu->ieRegisters = value; // IE register
 }
 
-void ioWriteByte(uint16_t adress, uint8_t value)
+static void watchedWrite(MMU *mmu, uint16_t adress, uint8_t value)
+{
+    if (!(mmu->watchPages[adress >> MMU_PAGE_SHIFT] & MMU_WATCH_WRITE))
+    {
+        slowWrite(mmu, adress, value);
+        return;
+    }
+
+    uint8_t *mapped = mmu->mappedWrite[adress >> MMU_PAGE_SHIFT];
+    if (mapped) mapped[adress & (MMU_PAGE_SIZE - 1)] = value;
+    else slowWrite(mmu, adress, value);
+    debuggerAccess(mmu->debugger, adress, value, true);
+}
+
+void mmuWriteByte(MMU *mmu, uint16_t adress, uint8_t value)
+{
+    uint8_t *page = mmu->writeMap[adress >> MMU_PAGE_SHIFT];
+    if (page)
+    {
+        page[adress & (MMU_PAGE_SIZE - 1)] = value; // Owned WRAM, enabled cart RAM
+        return;
+    }
+
+    if (mmu->debugger)
+    {
+        watchedWrite(mmu, adress, value); // Not timed, like reads
+        return;
+    }
+
+    if (!mmu->timed || ++mmu->slowAccesses & (MMU_TIME_SAMPLE - 1))
+    {
+        slowWrite(mmu, adress, value);
+        return;
+    }
+    uint64_t start = statsClock();
+    slowWrite(mmu, adress, value);
+    mmu->slowTime += (statsClock() - start) * MMU_TIME_SAMPLE;
+}
+
+void ioWriteByte(MMU *mmu, uint16_t adress, uint8_t value)
 {
+    if(adress == 0xFF00)
+    {
+        uint8_t lines = joypadLines(mmu);
+        mmu->joypadSelect = value & 0x30;
+        joypadUpdate(mmu, lines);
+        return;
+    }
+    if(adress == 0xFF0F)
+    {
+        mmu->interruptFlags = value & 0x1F;
+        return;
+    }
+    if((adress == 0xFF01 || adress == 0xFF02) && mmu->serial)
+    {
+        serialWriteRegister(mmu->serial, adress, value);
+        return;
+    }
+    if(adress >= 0xFF40 && adress <= 0xFF4B && adress != 0xFF46 && mmu->ppu)
+    {
+        ppuWriteRegister(mmu->ppu, adress, value);
+        return;
+    }
+    if(adress >= 0xFF10 && adress <= 0xFF3F && mmu->apu)
+    {
+        apuWriteRegister(mmu->apu, adress, value);
+        return;
+    }
+
     // Placeholder for IO register write logic
     // This function should be implemented to handle specific IO registers
-    LOG("Writing to IO register at address: 0x%04X, value: 0x%02X", adress, value);
+    LOG_TRACE(LOG_IO, "Writing to IO register at address: 0x%04X, value: 0x%02X", adress, value);
     // Implement specific IO register handling here
 }
\ No newline at end of file
@@ -0,0 +1,258 @@
+#include "../includes/movie.h"
+#include "../includes/state.h"
+#include "../includes/log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVIE_HEADER_SIZE 32
+
+typedef struct
+{
+    uint32_t count;   // Consecutive frames
+    uint8_t  buttons; // JOYPAD_* bits held on all of them
+} MovieRun;
+
+struct Movie
+{
+    uint64_t  romHash;
+    uint8_t  *state;       // Save state the movie starts from
+    size_t    stateSize;
+
+    MovieRun *runs;
+    size_t    runCount;
+    size_t    runCapacity;
+    uint64_t  frames;
+
+    size_t    cursor;      // Replay position: run index and the first frame it covers
+    uint64_t  cursorFrame;
+};
+
+static uint8_t *put32(uint8_t *out, uint32_t value)
+{
+    for(int i = 0; i < 4; ++i) *out++ = (uint8_t)(value >> (i * 8));
+    return out;
+}
+
+static uint8_t *put64(uint8_t *out, uint64_t value)
+{
+    return put32(put32(out, (uint32_t)value), (uint32_t)(value >> 32));
+}
+
+static uint32_t get32(const uint8_t *in)
+{
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static uint64_t get64(const uint8_t *in)
+{
+    return get32(in) | (uint64_t)get32(in + 4) << 32;
+}
+
+static Movie *createMovie(void)
+{
+    Movie *movie = calloc(1, sizeof(Movie));
+    if(!movie) LOG_ERROR(LOG_GENERAL, "Failed to allocate movie");
+    return movie;
+}
+
+static int addRun(Movie *movie, uint32_t count, uint8_t buttons)
+{
+    if(movie->runCount == movie->runCapacity)
+    {
+        size_t capacity = movie->runCapacity ? movie->runCapacity * 2 : 256;
+        MovieRun *runs = realloc(movie->runs, capacity * sizeof(MovieRun));
+        if(!runs)
+        {
+            LOG_ERROR(LOG_GENERAL, "Failed to grow movie input");
+            return 1; // Memory allocation error
+        }
+        movie->runs = runs;
+        movie->runCapacity = capacity;
+    }
+    movie->runs[movie->runCount++] = (MovieRun){ count, buttons };
+    movie->frames += count;
+    return 0;
+}
+
+Movie *movieRecord(const GameBoy *gb)
+{
+    Movie *movie = createMovie();
+    if(!movie) return NULL;
+
+    movie->romHash = romHash(gb->mmu.rom);
+    movie->stateSize = stateSize(gb);
+    movie->state = malloc(movie->stateSize);
+    if(!movie->state)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate movie start state");
+        movieDestroy(movie);
+        return NULL; // Memory allocation error
+    }
+    stateSave(gb, movie->state, movie->stateSize);
+    return movie;
+}
+
+int movieAddFrame(Movie *movie, uint8_t buttons)
+{
+    MovieRun *last = movie->runCount ? &movie->runs[movie->runCount - 1] : NULL;
+    if(!last || last->buttons != buttons || last->count == UINT32_MAX)
+        return addRun(movie, 1, buttons);
+
+    last->count++;
+    movie->frames++;
+    return 0;
+}
+
+int movieSave(const Movie *movie, const char *filename)
+{
+    // Every run takes at most a 5 byte varint and the buttons
+    size_t capacity = MOVIE_HEADER_SIZE + movie->stateSize + movie->runCount * 6;
+    uint8_t *buffer = malloc(capacity);
+    if(!buffer)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate movie buffer");
+        return 1; // Memory allocation error
+    }
+
+    uint8_t *out = put32(buffer, MOVIE_MAGIC);
+    *out++ = MOVIE_VERSION & 0xFF; *out++ = MOVIE_VERSION >> 8;
+    *out++ = 0; *out++ = 0;
+    out = put64(out, movie->romHash);
+    out = put64(out, movie->frames);
+    out = put32(out, (uint32_t)movie->stateSize);
+    out = put32(out, (uint32_t)movie->runCount);
+    memcpy(out, movie->state, movie->stateSize);
+    out += movie->stateSize;
+
+    for(size_t i = 0; i < movie->runCount; ++i)
+    {
+        uint32_t count = movie->runs[i].count;
+        while(count >= 0x80)
+        {
+            *out++ = (uint8_t)count | 0x80;
+            count >>= 7;
+        }
+        *out++ = (uint8_t)count;
+        *out++ = movie->runs[i].buttons;
+    }
+
+    FILE *file = fopen(filename, "wb");
+    size_t size = (size_t)(out - buffer);
+    int result = 0;
+    if(!file || fwrite(buffer, 1, size, file) != size)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to write movie: %s", filename);
+        result = 2; // Write error
+    }
+    if(file) fclose(file);
+    free(buffer);
+    if(!result) LOG_INFO(LOG_GENERAL, "Recorded %llu frames to %s", (unsigned long long)movie->frames, filename);
+    return result;
+}
+
+static int parseMovie(Movie *movie, const uint8_t *data, size_t size)
+{
+    if(size < MOVIE_HEADER_SIZE || get32(data) != MOVIE_MAGIC) return 1; // Not a movie
+    if((data[4] | data[5] << 8) > MOVIE_VERSION) return 2;                // Newer version
+
+    movie->romHash = get64(data + 8);
+    uint64_t frames = get64(data + 16);
+    movie->stateSize = get32(data + 24);
+    uint32_t runs = get32(data + 28);
+
+    const uint8_t *in = data + MOVIE_HEADER_SIZE, *end = data + size;
+    if((size_t)(end - in) < movie->stateSize) return 3; // Truncated
+    movie->state = malloc(movie->stateSize);
+    if(!movie->state) return 4;
+    memcpy(movie->state, in, movie->stateSize);
+    in += movie->stateSize;
+
+    for(uint32_t i = 0; i < runs; ++i)
+    {
+        uint32_t count = 0;
+        int shift = 0;
+        do
+        {
+            if(in == end || shift > 28) return 3; // Truncated or corrupt varint
+            count |= (uint32_t)(*in & 0x7F) << shift;
+            shift += 7;
+        } while(*in++ & 0x80);
+
+        if(in == end) return 3;
+        if(addRun(movie, count, *in++)) return 4;
+    }
+    return movie->frames == frames ? 0 : 5; // Frame count disagrees with the runs
+}
+
+Movie *movieLoad(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if(!file)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to open movie: %s", filename);
+        return NULL; // Error opening file
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    bool read = data && fread(data, 1, size, file) == (size_t)size;
+    fclose(file);
+
+    Movie *movie = read ? createMovie() : NULL;
+    int result = movie ? parseMovie(movie, data, size) : -1;
+    free(data);
+    if(result)
+    {
+        LOG_ERROR(LOG_GENERAL, "Invalid movie file %s (error %d)", filename, result);
+        movieDestroy(movie);
+        return NULL; // Read or format error
+    }
+    return movie;
+}
+
+int movieStart(Movie *movie, GameBoy *gb)
+{
+    if(movie->romHash != romHash(gb->mmu.rom))
+    {
+        LOG_ERROR(LOG_GENERAL, "Movie was recorded with a different ROM");
+        return 1; // ROM mismatch
+    }
+    movie->cursor = 0;
+    movie->cursorFrame = 0;
+    return stateLoad(gb, movie->state, movie->stateSize) ? 2 : 0; // 2: bad initial state
+}
+
+int movieInput(Movie *movie, uint64_t frame, uint8_t *buttons)
+{
+    if(frame >= movie->frames) return 1; // Past the end
+
+    // Replay walks forward, so resume from the last run instead of searching
+    if(frame < movie->cursorFrame)
+    {
+        movie->cursor = 0;
+        movie->cursorFrame = 0;
+    }
+    while(frame >= movie->cursorFrame + movie->runs[movie->cursor].count)
+        movie->cursorFrame += movie->runs[movie->cursor++].count;
+
+    *buttons = movie->runs[movie->cursor].buttons;
+    return 0;
+}
+
+uint64_t movieFrames(const Movie *movie)
+{
+    return movie->frames;
+}
+
+void movieDestroy(Movie *movie)
+{
+    if(!movie) return;
+    free(movie->state);
+    free(movie->runs);
+    free(movie);
+}
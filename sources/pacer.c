@@ -0,0 +1,109 @@
+#define _POSIX_C_SOURCE 200809L // clock_nanosleep
+#include "../includes/pacer.h"
+#include "../includes/log.h"
+#include "../includes/stats.h"
+
+#include <time.h>
+#include <errno.h>
+
+void pacerInit(Pacer *pacer, double frameRate)
+{
+    pacer->period = (uint64_t)(1e9 / frameRate);
+    pacer->margin = PACER_SPIN_MAX / 2;
+    pacer->fill = 0;
+    pacer->rate = 1.0;
+    pacer->speedStart = statsClock();
+    pacer->speedFrames = 0;
+    pacer->frames = 0;
+    pacer->late = 0;
+    pacer->skipped = 0;
+    pacerReset(pacer);
+    LOG_DEBUG(LOG_GENERAL, "Pacer initialized at %.4f Hz, %llu ns per frame", frameRate, (unsigned long long)pacer->period);
+}
+
+void pacerReset(Pacer *pacer)
+{
+    pacer->deadline = statsClock() + pacer->period;
+    pacer->skipping = 0;
+}
+
+void pacerWait(Pacer *pacer)
+{
+    pacer->frames++;
+    uint64_t time = statsClock();
+
+    // Too far behind to catch up without a burst of frames, start over from here
+    if(time > pacer->deadline + pacer->period)
+    {
+        pacer->late++;
+        pacer->deadline = time + pacer->period;
+        LOG_TRACE(LOG_GENERAL, "Frame %llu missed its deadline", (unsigned long long)pacer->frames);
+        return;
+    }
+
+    if(time + pacer->margin < pacer->deadline)
+    {
+        uint64_t wake = pacer->deadline - pacer->margin;
+        struct timespec ts = { .tv_sec = wake / 1000000000ull, .tv_nsec = wake % 1000000000ull };
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+        // Learn how late the scheduler wakes us, spin that plus a little
+        uint64_t overshoot = statsClock() - wake + PACER_SPIN_MIN;
+        pacer->margin = (pacer->margin * 7 + overshoot) / 8;
+        if(pacer->margin < PACER_SPIN_MIN) pacer->margin = PACER_SPIN_MIN;
+        if(pacer->margin > PACER_SPIN_MAX) pacer->margin = PACER_SPIN_MAX;
+    }
+
+    while(statsClock() < pacer->deadline);
+    pacer->deadline += pacer->period;
+}
+
+double pacerAudioRate(Pacer *pacer, size_t fill, size_t target)
+{
+    // Fill is sampled once per frame while the callback drains in device sized
+    // chunks, smoothing keeps that sawtooth out of the ratio
+    pacer->fill += ((double)fill - pacer->fill) * 0.05;
+
+    // Above target produce fewer frames, below target more
+    double skew = PACER_MAX_SKEW * (pacer->fill - (double)target) / (double)target;
+    if(skew > PACER_MAX_SKEW) skew = PACER_MAX_SKEW;
+    if(skew < -PACER_MAX_SKEW) skew = -PACER_MAX_SKEW;
+    pacer->rate = 1.0 + skew;
+    return pacer->rate;
+}
+
+bool pacerShouldRender(Pacer *pacer, bool unthrottled)
+{
+    uint64_t time = statsClock();
+    bool render;
+    if(unthrottled)
+    {
+        // The deadline only spaces out presented frames here, nothing waits on it
+        render = time >= pacer->deadline;
+        if(render) pacer->deadline = time + pacer->period;
+    }
+    else
+        render = time <= pacer->deadline || pacer->skipping >= PACER_MAX_SKIP;
+
+    if(render)
+        pacer->skipping = 0;
+    else
+    {
+        pacer->skipping++;
+        pacer->skipped++;
+    }
+    return render;
+}
+
+bool pacerSpeed(Pacer *pacer, double *speed)
+{
+    pacer->speedFrames++;
+    uint64_t time = statsClock();
+    uint64_t elapsed = time - pacer->speedStart;
+    if(elapsed < PACER_SPEED_WINDOW) return false;
+
+    *speed = (double)pacer->speedFrames * pacer->period / elapsed;
+    pacer->speedStart = time;
+    pacer->speedFrames = 0;
+    return true;
+}
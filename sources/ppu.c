@@ -1,9 +1,16 @@
+#define _POSIX_C_SOURCE 200809L // nanosleep
+
 #include "../includes/ppu.h"
 #include "../includes/log.h"
+#include "../includes/stats.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-static uint32_t palette[4] = 
+static const uint32_t palette[4] = 
 {
     0x000000FF, // Black
     0x555555FF, // Dark Gray
@@ -11,55 +18,126 @@ static uint32_t palette[4] =
     0xFFFFFFFF  // White
 };
 
-int initPPU(PPU *ppu)
+typedef struct
 {
-    if(SDL_Init(SDL_INIT_VIDEO))
-    {
-        LOG("SDL initialization failed: %s", SDL_GetError());
-        return 1; // SDL initialization error
-    }
+    uint8_t vram[8192];
+    uint8_t oam [160];
+} PPUScratch;
 
-    ppu->window = SDL_CreateWindow("Gameboy", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 
-                                    SCREEN_WIDTH * 8, SCREEN_HEIGHT * 8, SDL_WINDOW_SHOWN);
-    if(!ppu->window)
-    {
-        LOG("Failed to create SDL window: %s", SDL_GetError());
-        SDL_Quit();
-        return 2; // Window creation error
-    }
+typedef struct
+{
+    PPUDeferred *owner;
+    int          index;
+    pthread_t    thread;
+    PPUScratch   scratch;   // Private copy of video memory rewound per band
+} PPUBandWorker;
 
-    ppu->renderer = SDL_CreateRenderer(ppu->window, -1, SDL_RENDERER_ACCELERATED);
-    if(!ppu->renderer)
-    {
-        LOG("Failed to create SDL renderer: %s", SDL_GetError());
-        SDL_DestroyWindow(ppu->window);
-        SDL_Quit();
-        return 3; // Renderer creation error
-    }
+struct PPUDeferred
+{
+    PPUJournalEntry journal[PPU_JOURNAL_SIZE]; // VRAM/OAM writes since the oldest unrendered line
 
-    ppu->texture = SDL_CreateTexture(ppu->renderer, SDL_PIXELFORMAT_ARGB8888, 
-                                      SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
-    if(!ppu->texture)
-    {
-        LOG("Failed to create SDL texture: %s", SDL_GetError());
-        SDL_DestroyRenderer(ppu->renderer);
-        SDL_DestroyWindow(ppu->window);
-        SDL_Quit();
-        return 4; // Texture creation error
-    }
+    int             threadCount;
+    PPUBandWorker   workers[PPU_MAX_RENDER_THREADS]; // workers[0] is the emulation thread
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+    unsigned        generation; // Bumped for every frame handed to the band threads
+    int             pending;    // Band threads still rendering the current job
+    bool            stop;
+    bool            dirty;      // Any band changed a scanline
+
+    PPU            *ppu;        // Current job
+    const MMU      *mmu;
+    int             first, last;
+};
+
+typedef enum
+{
+    PPU_LOG_WRITE = 0, // VRAM, OAM or LCD register write
+    PPU_LOG_LINE  = 1, // Scanline latched, render it with the state so far
+    PPU_LOG_FRAME = 2  // Frame complete, publish it
+} PPULogKind;
+
+typedef struct
+{
+    uint32_t stamp;     // Cycles since the start of the frame
+    uint16_t address;   // Written address, or scanline for PPU_LOG_LINE
+    uint8_t  value;
+    uint8_t  kind;      // PPULogKind
+} PPULogEntry;
+
+#ifdef PPU_VERIFY_PIPELINE
+    #define PPU_VERIFY_FRAMES 8
+#endif
+
+struct PPUPipeline
+{
+    // Written by the emulation thread only
+    _Alignas(64) atomic_size_t head;
+    // Written by the worker only
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_bool   stop;
+
+    PPULogEntry     log[PPU_LOG_SIZE];
+    pthread_t       thread;
+
+    // Worker-side copy of everything the renderer reads
+    PPULineRegs     regs;
+    uint8_t         vram[8192];
+    uint8_t         oam [160];
+    uint32_t        frame[SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint32_t        lineHash[SCREEN_HEIGHT];
+    atomic_ullong   busyTime;    // Nanoseconds spent replaying, read by the stats
+
+    pthread_mutex_t publishLock; // Guards the PPU frame buffer, line hashes and dirty flags
+    PPU            *ppu;
 
+#ifdef PPU_VERIFY_PIPELINE
+    uint32_t        verifyFrame[SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint32_t        verifyHash[SCREEN_HEIGHT];
+    uint64_t        verifyPending;               // Inline hash of the frame being finished
+    atomic_ullong   expected[PPU_VERIFY_FRAMES]; // Inline frame hashes, by frame number
+    atomic_uint     framesQueued;                // Written by the emulation thread only
+    atomic_uint     framesPublished;             // Written by the worker only
+#endif
+};
+
+static void flushLines(PPU *ppu, const MMU *mmu);
+
+int initPPU(PPU *ppu)
+{
+    ppu->renderMode = PPU_RENDER_IMMEDIATE;
+    ppu->suppressRender = false;
+    ppu->deferred = NULL;
+    ppu->pipeline = NULL;
+    ppu->renderTime = 0;
     resetPPU(ppu);
-    LOG("PPU initialized successfully");
+    LOG_INFO(LOG_PPU, "PPU initialized successfully");
     return 0; // Success
 }
 
+void clonePPU(PPU *clone, PPU *ppu, const MMU *mmu)
+{
+    flushLines(ppu, mmu); // Deferred lines would otherwise need the journal we do not copy
+    ppuSync(ppu);
+
+    ppuLockFrame(ppu);
+    memcpy(clone, ppu, sizeof(PPU));
+    ppuUnlockFrame(ppu);
+
+    // Registers, timing and picture carry over, the clone renders inline
+    clone->renderMode = PPU_RENDER_IMMEDIATE;
+    clone->deferred = NULL;
+    clone->pipeline = NULL;
+    clone->journalCount = 0;
+    clone->linesRendered = clone->linesLatched;
+}
+
 void freePPU(PPU *ppu)
 {
-    if(ppu->texture) SDL_DestroyTexture(ppu->texture);
-    if(ppu->renderer) SDL_DestroyRenderer(ppu->renderer);
-    if(ppu->window) SDL_DestroyWindow(ppu->window);
-    SDL_Quit();
-    LOG("PPU resources freed");
+    ppuSetRenderMode(ppu, NULL, PPU_RENDER_IMMEDIATE, 1);
+    LOG_INFO(LOG_PPU, "PPU resources freed");
 } 
 
 void resetPPU(PPU *ppu)
@@ -71,45 +149,367 @@ void resetPPU(PPU *ppu)
     ppu->LY = ppu->LYC = 0;
     ppu->BGP = 0xFC; // Default background palette
     ppu->OBP0 = ppu->OBP1 = 0xFF; // Default object palettes
+    ppu->WY = ppu->WX = 0;
     ppu->modeClock = 0;
+    ppu->frameClock = 0;
+    ppu->frames = 0;
     ppu->mode = PPU_MODE_OAM; // Start in OAM mode
     memset(ppu->frameBuffer, 0, sizeof(ppu->frameBuffer));
-    LOG("PPU reset to default state");
+    memset(ppu->lineHash, 0, sizeof(ppu->lineHash));
+    memset(ppu->lineDirty, true, sizeof(ppu->lineDirty)); // First present uploads everything
+    ppu->frameDirty = true;
+    ppu->journalCount = 0;
+    ppu->linesLatched = ppu->linesRendered = 0;
+    LOG_DEBUG(LOG_PPU, "PPU reset to default state");
+}
+
+static void rewindWrite(PPUScratch *scratch, const PPUJournalEntry *entry)
+{
+    if(entry->address < 0xA000)
+        scratch->vram[entry->address - 0x8000] = entry->oldValue;
+    else
+        scratch->oam[entry->address - 0xFE00] = entry->oldValue;
+}
+
+static uint32_t renderLine(const PPULineRegs *regs, const uint8_t *vram, uint8_t y, uint32_t *out)
+{
+    uint32_t hash = 2166136261u; // FNV-1a over the line's pixels
+    for (int x = 0; x < SCREEN_WIDTH; ++x)
+    {
+        uint16_t map_base = 0x9800;
+        uint8_t scy = regs->SCY;
+        uint8_t scx = regs->SCX;
+        uint8_t tile_y = ((y + scy) / 8) & 0x1F;
+        uint8_t tile_x = ((x + scx) / 8) & 0x1F;
+        int16_t tile_index = vram[map_base - 0x8000 + tile_y * 32 + tile_x];
+        uint32_t tile_adress = tile_index * 16;
+        uint8_t line = (y + scy) % 8;
+        uint8_t b1 = vram[tile_adress + line * 2];
+        uint8_t b2 = vram[tile_adress + line * 2 + 1];
+        int bit = 7 - ((x + scx) % 8);
+        uint8_t color_index = ((b2 >> bit)&1) << 1 | ((b1 >> bit) & 1);
+        uint32_t color = palette[(regs->BGP >> (color_index * 2)) & 0x03];
+        out[x] = color;
+        hash = (hash ^ color) * 16777619u;
+    }
+    return hash;
+}
+
+// Renders lines [first, last] bottom-up, rewinding journaled writes as it goes
+// so each line sees video memory as it was when the line was latched.
+static bool renderBand(PPU *ppu, const MMU *mmu, int first, int last, PPUScratch *scratch)
+{
+    const uint8_t *vram = mmu->vram;
+    int undo = ppu->journalCount;
+    if(undo)
+    {
+        memcpy(scratch->vram, mmu->vram, sizeof(scratch->vram));
+        memcpy(scratch->oam,  mmu->oam,  sizeof(scratch->oam));
+        vram = scratch->vram;
+    }
+
+    bool dirty = false;
+    for(int y = last; y >= first; --y)
+    {
+        while(undo && ppu->deferred->journal[undo - 1].line > y)
+            rewindWrite(scratch, &ppu->deferred->journal[--undo]);
+
+        uint32_t hash = renderLine(&ppu->lineRegs[y], vram, y, ppu->frameBuffer[y]);
+        if(hash != ppu->lineHash[y])
+        {
+            ppu->lineHash[y] = hash;
+            ppu->lineDirty[y] = true;
+            dirty = true;
+        }
+    }
+    return dirty;
+}
+
+static void bandBounds(const PPUDeferred *deferred, int index, int *first, int *last)
+{
+    int lines = deferred->last - deferred->first + 1;
+    *first = deferred->first + lines * index / deferred->threadCount;
+    *last  = deferred->first + lines * (index + 1) / deferred->threadCount - 1;
+}
+
+static void *bandThread(void *arg)
+{
+    PPUBandWorker *worker = arg;
+    PPUDeferred *deferred = worker->owner;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&deferred->lock);
+    while(1)
+    {
+        while(deferred->generation == seen && !deferred->stop)
+            pthread_cond_wait(&deferred->start, &deferred->lock);
+        if(deferred->stop) break;
+        seen = deferred->generation;
+        pthread_mutex_unlock(&deferred->lock);
+
+        int first, last;
+        bandBounds(deferred, worker->index, &first, &last);
+        bool dirty = first <= last && renderBand(deferred->ppu, deferred->mmu, first, last, &worker->scratch);
+
+        pthread_mutex_lock(&deferred->lock);
+        deferred->dirty |= dirty;
+        if(--deferred->pending == 0)
+            pthread_cond_signal(&deferred->done);
+    }
+    pthread_mutex_unlock(&deferred->lock);
+    return NULL;
+}
+
+static void pipelinePush(PPU *ppu, PPULogKind kind, uint16_t address, uint8_t value)
+{
+    PPUPipeline *pipeline = ppu->pipeline;
+    size_t head = atomic_load_explicit(&pipeline->head, memory_order_relaxed);
+
+    // Never drop: the worker has to see exactly what the emulation did
+    while(head - atomic_load_explicit(&pipeline->tail, memory_order_acquire) == PPU_LOG_SIZE)
+        sched_yield();
+
+    PPULogEntry *entry = &pipeline->log[head & (PPU_LOG_SIZE - 1)];
+    entry->stamp = ppu->frameClock;
+    entry->address = address;
+    entry->value = value;
+    entry->kind = kind;
+    atomic_store_explicit(&pipeline->head, head + 1, memory_order_release);
+}
+
+static void replayWrite(PPUPipeline *pipeline, uint16_t address, uint8_t value)
+{
+    if(address >= 0x8000 && address < 0xA000)
+        pipeline->vram[address - 0x8000] = value;
+    else if(address >= 0xFE00 && address < 0xFEA0)
+        pipeline->oam[address - 0xFE00] = value;
+    else switch(address)
+    {
+        case 0xFF40: pipeline->regs.LCDC = value; break;
+        case 0xFF42: pipeline->regs.SCY  = value; break;
+        case 0xFF43: pipeline->regs.SCX  = value; break;
+        case 0xFF47: pipeline->regs.BGP  = value; break;
+        case 0xFF4A: pipeline->regs.WY   = value; break;
+        case 0xFF4B: pipeline->regs.WX   = value; break;
+        default: break;
+    }
 }
 
+static void publishFrame(PPUPipeline *pipeline)
+{
+    PPU *ppu = pipeline->ppu;
+
+    pthread_mutex_lock(&pipeline->publishLock);
+    for(int y = 0; y < SCREEN_HEIGHT; ++y)
+    {
+        if(pipeline->lineHash[y] == ppu->lineHash[y]) continue;
+        memcpy(ppu->frameBuffer[y], pipeline->frame[y], sizeof(ppu->frameBuffer[y]));
+        ppu->lineHash[y] = pipeline->lineHash[y];
+        ppu->lineDirty[y] = true;
+        ppu->frameDirty = true;
+    }
+#ifdef PPU_VERIFY_PIPELINE
+    uint64_t hash = ppuFrameHash(ppu);
+    uint32_t frame = atomic_load_explicit(&pipeline->framesPublished, memory_order_relaxed);
+    uint64_t expected = atomic_load_explicit(&pipeline->expected[frame % PPU_VERIFY_FRAMES], memory_order_relaxed);
+    atomic_store_explicit(&pipeline->framesPublished, frame + 1, memory_order_release); // The slot can be reused
+    if(hash != expected)
+        LOG_ERROR(LOG_PPU, "PPU pipeline mismatch on frame %u: %016llx != %016llx", frame,
+            (unsigned long long)hash, (unsigned long long)expected);
+#endif
+    pthread_mutex_unlock(&pipeline->publishLock);
+}
+
+static void *pipelineThread(void *arg)
+{
+    PPUPipeline *pipeline = arg;
+    size_t tail = atomic_load_explicit(&pipeline->tail, memory_order_relaxed);
+    int idle = 0;
+
+    while(!atomic_load_explicit(&pipeline->stop, memory_order_relaxed))
+    {
+        size_t head = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+        if(head == tail)
+        {
+            // Spin briefly, then back off so an idle PPU does not burn a core
+            if(++idle < 256) sched_yield();
+            else nanosleep(&(struct timespec){ 0, 50000 }, NULL);
+            continue;
+        }
+        idle = 0;
+
+        uint64_t start = statsClock();
+        for(; tail != head; ++tail)
+        {
+            const PPULogEntry *entry = &pipeline->log[tail & (PPU_LOG_SIZE - 1)];
+            if(entry->kind == PPU_LOG_WRITE)
+                replayWrite(pipeline, entry->address, entry->value);
+            else if(entry->kind == PPU_LOG_LINE)
+            {
+                uint8_t y = entry->address;
+                pipeline->lineHash[y] = renderLine(&pipeline->regs, pipeline->vram, y, pipeline->frame[y]);
+            }
+            else
+                publishFrame(pipeline);
+        }
+        atomic_store_explicit(&pipeline->tail, tail, memory_order_release);
+        atomic_fetch_add_explicit(&pipeline->busyTime, statsClock() - start, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void stopPipeline(PPU *ppu)
+{
+    PPUPipeline *pipeline = ppu->pipeline;
+    if(!pipeline) return;
+
+    atomic_store(&pipeline->stop, true);
+    pthread_join(pipeline->thread, NULL);
+    pthread_mutex_destroy(&pipeline->publishLock);
+    free(pipeline);
+    ppu->pipeline = NULL;
+}
+
+static int startPipeline(PPU *ppu, const MMU *mmu)
+{
+    PPUPipeline *pipeline = calloc(1, sizeof(PPUPipeline));
+    if(!pipeline)
+    {
+        LOG_ERROR(LOG_PPU, "Failed to allocate PPU pipeline");
+        return 1; // Memory allocation error
+    }
+
+    pipeline->ppu = ppu;
+    pipeline->regs = (PPULineRegs){ ppu->LCDC, ppu->SCY, ppu->SCX, ppu->BGP, ppu->WY, ppu->WX };
+    memcpy(pipeline->vram, mmu->vram, sizeof(pipeline->vram));
+    memcpy(pipeline->oam,  mmu->oam,  sizeof(pipeline->oam));
+    memcpy(pipeline->lineHash, ppu->lineHash, sizeof(pipeline->lineHash));
+    memcpy(pipeline->frame, ppu->frameBuffer, sizeof(pipeline->frame));
+    pthread_mutex_init(&pipeline->publishLock, NULL);
+
+    if(pthread_create(&pipeline->thread, NULL, pipelineThread, pipeline) != 0)
+    {
+        LOG_ERROR(LOG_PPU, "Failed to create PPU worker thread");
+        pthread_mutex_destroy(&pipeline->publishLock);
+        free(pipeline);
+        return 2; // Thread creation error
+    }
+
+    ppu->pipeline = pipeline;
+    return 0;
+}
+
+static void latchLine(PPU *ppu)
+{
+    PPULineRegs *regs = &ppu->lineRegs[ppu->LY];
+    regs->LCDC = ppu->LCDC;
+    regs->SCY  = ppu->SCY;
+    regs->SCX  = ppu->SCX;
+    regs->BGP  = ppu->BGP;
+    regs->WY   = ppu->WY;
+    regs->WX   = ppu->WX;
+    ppu->linesLatched = ppu->LY + 1;
+
+    if(ppu->renderMode != PPU_RENDER_THREADED) return;
+    pipelinePush(ppu, PPU_LOG_LINE, ppu->LY, 0);
+    ppu->linesRendered = ppu->linesLatched;
+}
+
+// Rasterizes every latched but not yet rendered line, then drops the journal.
+static void flushLines(PPU *ppu, const MMU *mmu)
+{
+    int first = ppu->linesRendered, last = ppu->linesLatched - 1;
+    if(last < first) return;
+
+    uint64_t start = statsClock();
+    PPUDeferred *deferred = ppu->deferred;
+    bool dirty;
+    if(!deferred || deferred->threadCount == 1 || last - first + 1 < deferred->threadCount)
+        dirty = renderBand(ppu, mmu, first, last, deferred ? &deferred->workers[0].scratch : NULL);
+    else
+    {
+        pthread_mutex_lock(&deferred->lock);
+        deferred->ppu = ppu;
+        deferred->mmu = mmu;
+        deferred->first = first;
+        deferred->last = last;
+        deferred->dirty = false;
+        deferred->pending = deferred->threadCount - 1;
+        deferred->generation++;
+        pthread_cond_broadcast(&deferred->start);
+        pthread_mutex_unlock(&deferred->lock);
+
+        int bandFirst, bandLast;
+        bandBounds(deferred, 0, &bandFirst, &bandLast);
+        dirty = renderBand(ppu, mmu, bandFirst, bandLast, &deferred->workers[0].scratch);
+
+        pthread_mutex_lock(&deferred->lock);
+        while(deferred->pending)
+            pthread_cond_wait(&deferred->done, &deferred->lock);
+        dirty |= deferred->dirty;
+        pthread_mutex_unlock(&deferred->lock);
+    }
+
+    if(dirty) ppu->frameDirty = true;
+    ppu->linesRendered = ppu->linesLatched;
+    ppu->journalCount = 0;
+    ppu->renderTime += statsClock() - start;
+}
+
+#ifdef PPU_VERIFY_PIPELINE
+// Renders the frame inline from the real memory so the worker's result can be checked
+static void verifyLine(PPU *ppu, const MMU *mmu)
+{
+    PPUPipeline *pipeline = ppu->pipeline;
+    uint8_t y = ppu->LY;
+    pipeline->verifyHash[y] = renderLine(&ppu->lineRegs[y], mmu->vram, y, pipeline->verifyFrame[y]);
+    if(y != SCREEN_HEIGHT - 1) return;
+
+    uint64_t hash = 14695981039346656037ull;
+    for(int i = 0; i < SCREEN_HEIGHT; ++i)
+        hash = (hash ^ pipeline->verifyHash[i]) * 1099511628211ull;
+    pipeline->verifyPending = hash;
+}
+
+// Queues the expected hash along with the frame, waiting while the worker is PPU_VERIFY_FRAMES behind
+static void queueExpected(PPU *ppu)
+{
+    PPUPipeline *pipeline = ppu->pipeline;
+    uint32_t frame = atomic_load_explicit(&pipeline->framesQueued, memory_order_relaxed);
+    while(frame - atomic_load_explicit(&pipeline->framesPublished, memory_order_acquire) >= PPU_VERIFY_FRAMES)
+        sched_yield(); // Every earlier frame is already in the log
+    atomic_store_explicit(&pipeline->expected[frame % PPU_VERIFY_FRAMES], pipeline->verifyPending, memory_order_relaxed);
+    atomic_store_explicit(&pipeline->framesQueued, frame + 1, memory_order_relaxed);
+}
+#endif
+
 void ppuStep(PPU *ppu, MMU *mmu, int cycles)
 {
     ppu->modeClock += cycles;
+    ppu->frameClock += cycles;
 
     switch(ppu->mode)
     {
         case PPU_MODE_OAM:
         {
             if(ppu->modeClock < 80) break;
-            ppu->modeClock = -80;
+            ppu->modeClock -= 80;
             ppu->mode = PPU_MODE_VRAM;
             break;
         }
         case PPU_MODE_VRAM:
         {
             if(ppu->modeClock < 172) break;
-            uint8_t y = ppu->LY;
-            for (int x = 0; x < SCREEN_WIDTH; ++x)
+            ppu->modeClock -= 172;
+            if(!ppu->suppressRender)
             {
-                uint16_t map_base = 0x9800;
-                uint8_t scy = ppu->SCY;
-                uint8_t scx = ppu->SCX;
-                uint8_t tile_y = ((y + scy) / 8) & 0x1F;
-                uint8_t tile_x = ((x + scx) / 8) & 0x1F;
-                int16_t tile_index = mmuReadByte(mmu, map_base + tile_y * 32 + tile_x);
-                uint32_t tile_adress = 0x8000 + (tile_index * 16);
-                uint8_t line = (y + scy) % 8;
-                uint8_t b1 = mmuReadByte(mmu, tile_adress + line * 2);
-                uint8_t b2 = mmuReadByte(mmu, tile_adress + line * 2 + 1);
-                int bit = 7 - ((x + scx) % 8);
-                uint8_t color_index = ((b2 >> bit)&1) << 1 | ((b1 >> bit) & 1);
-                uint32_t color = palette[(ppu->BGP >> (color_index * 2)) & 0x03];
-                ppu->frameBuffer[y][x] = color;
+                latchLine(ppu);
+                if(ppu->renderMode == PPU_RENDER_IMMEDIATE)
+                    flushLines(ppu, mmu);
+#ifdef PPU_VERIFY_PIPELINE
+                else if(ppu->renderMode == PPU_RENDER_THREADED)
+                    verifyLine(ppu, mmu);
+#endif
             }
             ppu->mode = PPU_MODE_HBLANK;
             break;
@@ -117,10 +517,22 @@ void ppuStep(PPU *ppu, MMU *mmu, int cycles)
         case PPU_MODE_HBLANK:
         {
             if(ppu->modeClock < 204) break;
-            ppu->modeClock = -204;
+            ppu->modeClock -= 204;
             ppu->LY++;
             if(ppu->LY >= SCREEN_HEIGHT)
+            {
+                flushLines(ppu, mmu); // Whole frame in deferred mode, no-op otherwise
+                if(ppu->renderMode == PPU_RENDER_THREADED && !ppu->suppressRender)
+                {
+#ifdef PPU_VERIFY_PIPELINE
+                    queueExpected(ppu); // Published by the release on the log head
+#endif
+                    pipelinePush(ppu, PPU_LOG_FRAME, 0, 0);
+                }
+                ppu->linesLatched = ppu->linesRendered = 0;
+                ppu->frames++;
                 ppu->mode = PPU_MODE_VBLANK;
+            }
             else
                 ppu->mode = PPU_MODE_OAM;
             break;
@@ -128,11 +540,12 @@ void ppuStep(PPU *ppu, MMU *mmu, int cycles)
         case PPU_MODE_VBLANK:
         {
             if(ppu->modeClock < 456) break;
-            ppu->modeClock = -456;
+            ppu->modeClock -= 456;
             ppu->LY++;
-            if(ppu->LY >= 153)
+            if(ppu->LY > 153)
             {
                 ppu->LY = 0;
+                ppu->frameClock = 0;
                 ppu->mode = PPU_MODE_OAM;
             }
             break;
@@ -144,10 +557,201 @@ void ppuStep(PPU *ppu, MMU *mmu, int cycles)
 }
 
 
-void ppuRender(PPU *ppu) 
+void ppuLockFrame(PPU *ppu)
 {
-    SDL_UpdateTexture(ppu->texture, NULL, ppu->frameBuffer, SCREEN_WIDTH * sizeof(uint32_t));
-    SDL_RenderClear(ppu->renderer);
-    SDL_RenderCopy(ppu->renderer, ppu->texture, NULL, NULL);
-    SDL_RenderPresent(ppu->renderer);
-}
\ No newline at end of file
+    // The PPU worker publishes frames concurrently in threaded mode
+    if(ppu->pipeline) pthread_mutex_lock(&ppu->pipeline->publishLock);
+}
+
+void ppuUnlockFrame(PPU *ppu)
+{
+    if(ppu->pipeline) pthread_mutex_unlock(&ppu->pipeline->publishLock);
+}
+
+int ppuSetRenderMode(PPU *ppu, const MMU *mmu, PPURenderMode mode, int threads)
+{
+    stopPipeline(ppu);
+
+    PPUDeferred *deferred = ppu->deferred;
+    if(deferred)
+    {
+        pthread_mutex_lock(&deferred->lock);
+        deferred->stop = true;
+        pthread_cond_broadcast(&deferred->start);
+        pthread_mutex_unlock(&deferred->lock);
+
+        for(int i = 1; i < deferred->threadCount; ++i)
+            pthread_join(deferred->workers[i].thread, NULL);
+
+        pthread_mutex_destroy(&deferred->lock);
+        pthread_cond_destroy(&deferred->start);
+        pthread_cond_destroy(&deferred->done);
+        free(deferred);
+        ppu->deferred = NULL;
+    }
+
+    // Lines latched under the old mode keep last frame's pixels
+    ppu->journalCount = 0;
+    ppu->linesRendered = ppu->linesLatched;
+    ppu->renderMode = PPU_RENDER_IMMEDIATE;
+    if(mode == PPU_RENDER_IMMEDIATE) return 0;
+
+    if(mode == PPU_RENDER_THREADED)
+    {
+        if(startPipeline(ppu, mmu)) return 1;
+        ppu->renderMode = mode;
+        LOG_INFO(LOG_PPU, "Threaded rendering enabled");
+        return 0;
+    }
+
+    if(threads < 1) threads = 1;
+    if(threads > PPU_MAX_RENDER_THREADS) threads = PPU_MAX_RENDER_THREADS;
+
+    deferred = calloc(1, sizeof(PPUDeferred));
+    if(!deferred)
+    {
+        LOG_ERROR(LOG_PPU, "Failed to allocate deferred renderer");
+        return 1; // Memory allocation error
+    }
+
+    pthread_mutex_init(&deferred->lock, NULL);
+    pthread_cond_init(&deferred->start, NULL);
+    pthread_cond_init(&deferred->done, NULL);
+    deferred->threadCount = 1;
+    deferred->workers[0].owner = deferred;
+
+    for(int i = 1; i < threads; ++i)
+    {
+        PPUBandWorker *worker = &deferred->workers[i];
+        worker->owner = deferred;
+        worker->index = i;
+        if(pthread_create(&worker->thread, NULL, bandThread, worker) != 0)
+        {
+            LOG_ERROR(LOG_PPU, "Failed to create band thread %d, rendering with %d", i, deferred->threadCount);
+            break;
+        }
+        deferred->threadCount++;
+    }
+
+    ppu->deferred = deferred;
+    ppu->renderMode = mode;
+    LOG_INFO(LOG_PPU, "Deferred rendering enabled with %d band thread(s)", deferred->threadCount);
+    return 0;
+}
+
+uint8_t ppuReadRegister(PPU *ppu, uint16_t address)
+{
+    switch(address)
+    {
+        case 0xFF40: return ppu->LCDC;
+        case 0xFF41: return ppu->STAT | 0x80;
+        case 0xFF42: return ppu->SCY;
+        case 0xFF43: return ppu->SCX;
+        case 0xFF44: return ppu->LY;
+        case 0xFF45: return ppu->LYC;
+        case 0xFF47: return ppu->BGP;
+        case 0xFF48: return ppu->OBP0;
+        case 0xFF49: return ppu->OBP1;
+        case 0xFF4A: return ppu->WY;
+        case 0xFF4B: return ppu->WX;
+        default:     return 0xFF;
+    }
+}
+
+void ppuWriteRegister(PPU *ppu, uint16_t address, uint8_t value)
+{
+    if(ppu->renderMode == PPU_RENDER_THREADED)
+        pipelinePush(ppu, PPU_LOG_WRITE, address, value);
+
+    switch(address)
+    {
+        case 0xFF40: ppu->LCDC = value; break;
+        case 0xFF41: ppu->STAT = (ppu->STAT & 0x07) | (value & 0x78); break; // Mode and coincidence bits are read-only
+        case 0xFF42: ppu->SCY  = value; break;
+        case 0xFF43: ppu->SCX  = value; break;
+        case 0xFF45: ppu->LYC  = value; break;
+        case 0xFF47: ppu->BGP  = value; break;
+        case 0xFF48: ppu->OBP0 = value; break;
+        case 0xFF49: ppu->OBP1 = value; break;
+        case 0xFF4A: ppu->WY   = value; break;
+        case 0xFF4B: ppu->WX   = value; break;
+        default: break; // LY is read-only
+    }
+}
+
+uint64_t ppuFrameHash(PPU *ppu)
+{
+    // Folding the per-line FNV-1a hashes is enough to tell frames apart
+    uint64_t hash = 14695981039346656037ull;
+    for(int y = 0; y < SCREEN_HEIGHT; ++y)
+        hash = (hash ^ ppu->lineHash[y]) * 1099511628211ull;
+    return hash;
+}
+
+uint64_t ppuWorkerTime(PPU *ppu)
+{
+    return ppu->pipeline ? atomic_load_explicit(&ppu->pipeline->busyTime, memory_order_relaxed) : 0;
+}
+
+void ppuSync(PPU *ppu)
+{
+    // Wait for the worker to replay everything logged so far
+    PPUPipeline *pipeline = ppu->pipeline;
+    if(!pipeline) return;
+
+    size_t head = atomic_load_explicit(&pipeline->head, memory_order_relaxed);
+    while(atomic_load_explicit(&pipeline->tail, memory_order_acquire) != head)
+        sched_yield();
+}
+
+void ppuResync(PPU *ppu, const MMU *mmu)
+{
+    // Memory was replaced wholesale: the journal no longer describes it, and lines
+    // latched before the swap keep the pixels they already have
+    ppu->journalCount = 0;
+    ppu->linesRendered = ppu->linesLatched;
+
+    PPUPipeline *pipeline = ppu->pipeline;
+    if(!pipeline) return;
+
+    // The worker is idle once synced and reads its copies only after the next push
+    ppuSync(ppu);
+    pipeline->regs = (PPULineRegs){ ppu->LCDC, ppu->SCY, ppu->SCX, ppu->BGP, ppu->WY, ppu->WX };
+    memcpy(pipeline->vram, mmu->vram, sizeof(pipeline->vram));
+    memcpy(pipeline->oam,  mmu->oam,  sizeof(pipeline->oam));
+}
+
+void ppuSuppressRender(PPU *ppu, const MMU *mmu, bool suppress)
+{
+    if(ppu->suppressRender == suppress) return;
+    if(suppress)
+        flushLines(ppu, mmu); // Lines latched so far still need the memory they saw
+    ppu->suppressRender = suppress;
+
+    // The worker's memory copy missed every write made while suppressed
+    if(!suppress) ppuResync(ppu, mmu);
+}
+
+void ppuTrackWrite(PPU *ppu, MMU *mmu, uint16_t address, uint8_t oldValue, uint8_t value)
+{
+    if(ppu->suppressRender) return; // Nothing is latched, nothing to journal or replay
+
+    if(ppu->renderMode == PPU_RENDER_THREADED)
+    {
+        pipelinePush(ppu, PPU_LOG_WRITE, address, value);
+        return;
+    }
+
+    // Lines that are not latched yet will see the write anyway
+    if(ppu->linesLatched == ppu->linesRendered) return;
+
+    if(ppu->journalCount == PPU_JOURNAL_SIZE)
+        flushLines(ppu, mmu);
+    else
+    {
+        PPUJournalEntry *entry = &ppu->deferred->journal[ppu->journalCount++];
+        entry->address = address;
+        entry->line = ppu->linesLatched;
+        entry->oldValue = oldValue;
+    }
+}
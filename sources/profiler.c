@@ -0,0 +1,348 @@
+#include "../includes/profiler.h"
+#include "../includes/log.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct 
+{
+    uint32_t key;
+    uint64_t count;     // Executions or calls
+    uint64_t cycles;    // Self cycles
+    uint64_t inclusive; // Call targets only
+} ProfileRow;
+
+static size_t mapIndex(const ProfileMap *map, uint64_t key)
+{
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash ^ (hash >> 32)) & (map->capacity - 1);
+}
+
+static int mapGrow(ProfileMap *map)
+{
+    size_t capacity = map->capacity ? map->capacity * 2 : 1024;
+    uint64_t *keys = calloc(capacity, sizeof(uint64_t));
+    uint32_t *values = malloc(capacity * sizeof(uint32_t));
+    if(!keys || !values)
+    {
+        free(keys);
+        free(values);
+        return 1; // Memory allocation error
+    }
+
+    ProfileMap grown = { keys, values, capacity, map->count };
+    for(size_t i = 0; i < map->capacity; ++i)
+    {
+        if(!map->keys[i]) continue;
+        size_t slot = mapIndex(&grown, map->keys[i] - 1);
+        while(grown.keys[slot]) slot = (slot + 1) & (capacity - 1);
+        grown.keys[slot] = map->keys[i];
+        grown.values[slot] = map->values[i];
+    }
+    free(map->keys);
+    free(map->values);
+    *map = grown;
+    return 0;
+}
+
+// Finds key, or inserts it with value. 1 when inserted, 0 when found, -1 on allocation failure.
+static int mapGet(ProfileMap *map, uint64_t key, uint32_t value, uint32_t *out)
+{
+    if((map->count + 1) * 2 > map->capacity && mapGrow(map)) return -1;
+
+    size_t slot = mapIndex(map, key);
+    while(map->keys[slot])
+    {
+        if(map->keys[slot] == key + 1)
+        {
+            *out = map->values[slot];
+            return 0;
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    map->keys[slot] = key + 1;
+    map->values[slot] = *out = value;
+    map->count++;
+    return 1;
+}
+
+static void mapFree(ProfileMap *map)
+{
+    free(map->keys);
+    free(map->values);
+}
+
+static int32_t nodeFor(Profiler *profiler, int32_t parent, uint32_t target)
+{
+    // Room first, so the map never points past the array
+    if(profiler->nodeCount == profiler->nodeCapacity)
+    {
+        size_t capacity = profiler->nodeCapacity * 2;
+        ProfileNode *nodes = realloc(profiler->nodes, capacity * sizeof(ProfileNode));
+        if(!nodes) return -1;
+        profiler->nodes = nodes;
+        profiler->nodeCapacity = capacity;
+    }
+
+    uint32_t index;
+    int inserted = mapGet(&profiler->nodeMap, (uint64_t)(uint32_t)parent << 32 | target,
+                          (uint32_t)profiler->nodeCount, &index);
+    if(inserted <= 0) return inserted < 0 ? -1 : (int32_t)index;
+
+    profiler->nodes[index] = (ProfileNode){ target, parent, 0, 0 };
+    profiler->nodeCount++;
+    return (int32_t)index;
+}
+
+static int growPcs(Profiler *profiler)
+{
+    size_t capacity = profiler->pcCapacity ? profiler->pcCapacity * 2 : 1024;
+    uint32_t *keys = realloc(profiler->pcKeys, capacity * sizeof(uint32_t));
+    if(!keys) return 1; // Memory allocation error
+    profiler->pcKeys = keys;
+    ProfileCounter *pcs = realloc(profiler->pcs, capacity * sizeof(ProfileCounter));
+    if(!pcs) return 1; // Memory allocation error
+    profiler->pcs = pcs;
+    profiler->pcCapacity = capacity;
+    return 0;
+}
+
+Profiler *profilerCreate(void)
+{
+    Profiler *profiler = calloc(1, sizeof(Profiler));
+    if(!profiler)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate profiler");
+        return NULL; // Memory allocation error
+    }
+
+    profiler->nodeCapacity = 256;
+    profiler->nodes = malloc(profiler->nodeCapacity * sizeof(ProfileNode));
+    if(!profiler->nodes)
+    {
+        free(profiler);
+        return NULL; // Memory allocation error
+    }
+    profiler->nodes[0] = (ProfileNode){ 0, -1, 1, 0 };
+    profiler->nodeCount = 1;
+    return profiler;
+}
+
+void profilerDestroy(Profiler *profiler)
+{
+    if(!profiler) return;
+    mapFree(&profiler->pcMap);
+    mapFree(&profiler->nodeMap);
+    free(profiler->pcKeys);
+    free(profiler->pcs);
+    free(profiler->nodes);
+    free(profiler);
+}
+
+static bool isCall(uint8_t opcode)
+{
+    switch(opcode)
+    {
+        case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC:                       // CALL
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isReturn(uint8_t opcode)
+{
+    return opcode == 0xC0 || opcode == 0xC8 || opcode == 0xC9 || opcode == 0xD0 || opcode == 0xD8 || opcode == 0xD9;
+}
+
+void profilerRecord(Profiler *profiler, uint8_t opcode, uint32_t address, uint32_t next,
+                    uint16_t spBefore, uint16_t spAfter, int cycles)
+{
+    profiler->instructions++;
+    profiler->cycles += cycles;
+    profiler->opcodes[opcode].count++;
+    profiler->opcodes[opcode].cycles += cycles;
+
+    uint32_t index;
+    int inserted = (profiler->pcMap.count == profiler->pcCapacity && growPcs(profiler)) ? -1
+                 : mapGet(&profiler->pcMap, address, (uint32_t)profiler->pcMap.count, &index);
+    if(inserted > 0)
+    {
+        profiler->pcKeys[index] = address;
+        profiler->pcs[index] = (ProfileCounter){ 0, 0 };
+    }
+    if(inserted >= 0)
+    {
+        profiler->pcs[index].count++;
+        profiler->pcs[index].cycles += cycles;
+    }
+
+    // The instruction belongs to the frame it ran in, a call starts a new one after it
+    profiler->nodes[profiler->stack[profiler->depth]].cycles += cycles;
+
+    if(isCall(opcode) && spAfter == (uint16_t)(spBefore - 2))
+    {
+        int32_t node = profiler->depth < PROFILER_MAX_DEPTH ? nodeFor(profiler, profiler->stack[profiler->depth], next) : -1;
+        if(node < 0)
+            profiler->overflow++;
+        else
+        {
+            profiler->nodes[node].calls++;
+            profiler->stack[++profiler->depth] = node;
+        }
+    }
+    else if(isReturn(opcode) && spAfter == (uint16_t)(spBefore + 2))
+    {
+        if(profiler->overflow) profiler->overflow--;
+        else if(profiler->depth) profiler->depth--; // Unmatched returns stay at the root
+    }
+}
+
+static int byCycles(const void *a, const void *b)
+{
+    const ProfileRow *x = a, *y = b;
+    uint64_t cx = x->inclusive ? x->inclusive : x->cycles, cy = y->inclusive ? y->inclusive : y->cycles;
+    return cx < cy ? 1 : cx > cy ? -1 : (x->key > y->key) - (x->key < y->key);
+}
+
+static double share(uint64_t part, uint64_t total)
+{
+    return total ? part * 100.0 / total : 0.0;
+}
+
+// Call targets with calls, self and inclusive cycles; recursion is only counted once
+static ProfileRow *targetRows(const Profiler *profiler, size_t *count)
+{
+    uint64_t *total = calloc(profiler->nodeCount, sizeof(uint64_t));
+    ProfileRow *rows = calloc(profiler->nodeCount, sizeof(ProfileRow));
+    ProfileMap map = { NULL, NULL, 0, 0 };
+    if(!total || !rows)
+    {
+        free(total);
+        free(rows);
+        return NULL;
+    }
+
+    // Children are always created after their parent
+    for(size_t i = profiler->nodeCount; i-- > 0; )
+    {
+        total[i] += profiler->nodes[i].cycles;
+        if(profiler->nodes[i].parent >= 0) total[profiler->nodes[i].parent] += total[i];
+    }
+
+    *count = 0;
+    for(size_t i = 1; i < profiler->nodeCount; ++i)
+    {
+        const ProfileNode *node = &profiler->nodes[i];
+        uint32_t row;
+        int inserted = mapGet(&map, node->target, (uint32_t)*count, &row);
+        if(inserted < 0) break;
+        if(inserted) rows[(*count)++].key = node->target;
+
+        rows[row].count += node->calls;
+        rows[row].cycles += node->cycles;
+
+        bool nested = false;
+        for(int32_t up = node->parent; up > 0 && !nested; up = profiler->nodes[up].parent)
+            nested = profiler->nodes[up].target == node->target;
+        if(!nested) rows[row].inclusive += total[i];
+    }
+
+    mapFree(&map);
+    free(total);
+    return rows;
+}
+
+int profilerReport(const Profiler *profiler, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if(!file)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to open profile report: %s", path);
+        return 1; // Error opening file
+    }
+
+    fprintf(file, "instructions=%llu cycles=%llu addresses=%zu call_sites=%zu\n",
+            (unsigned long long)profiler->instructions, (unsigned long long)profiler->cycles,
+            profiler->pcMap.count, profiler->nodeCount - 1);
+
+    ProfileRow rows[256];
+    size_t count = 0;
+    for(int op = 0; op < 256; ++op)
+        if(profiler->opcodes[op].count)
+            rows[count++] = (ProfileRow){ (uint32_t)op, profiler->opcodes[op].count, profiler->opcodes[op].cycles, 0 };
+    qsort(rows, count, sizeof(ProfileRow), byCycles);
+    fprintf(file, "\nopcode       count        cycles  share\n");
+    for(size_t i = 0; i < count; ++i)
+        fprintf(file, "  %02X  %12llu  %12llu  %5.2f%%\n", rows[i].key, (unsigned long long)rows[i].count,
+                (unsigned long long)rows[i].cycles, share(rows[i].cycles, profiler->cycles));
+
+    ProfileRow *pcs = malloc((profiler->pcMap.count + 1) * sizeof(ProfileRow));
+    if(pcs)
+    {
+        for(size_t i = 0; i < profiler->pcMap.count; ++i)
+            pcs[i] = (ProfileRow){ profiler->pcKeys[i], profiler->pcs[i].count, profiler->pcs[i].cycles, 0 };
+        qsort(pcs, profiler->pcMap.count, sizeof(ProfileRow), byCycles);
+        fprintf(file, "\naddress        count        cycles  share\n");
+        for(size_t i = 0; i < profiler->pcMap.count && i < PROFILER_TOP; ++i)
+            fprintf(file, "%02X:%04X  %12llu  %12llu  %5.2f%%\n", pcs[i].key >> 16, pcs[i].key & 0xFFFF,
+                    (unsigned long long)pcs[i].count, (unsigned long long)pcs[i].cycles,
+                    share(pcs[i].cycles, profiler->cycles));
+        free(pcs);
+    }
+
+    size_t targets = 0;
+    ProfileRow *calls = targetRows(profiler, &targets);
+    if(calls)
+    {
+        qsort(calls, targets, sizeof(ProfileRow), byCycles);
+        fprintf(file, "\ntarget         calls     inclusive          self  share\n");
+        for(size_t i = 0; i < targets && i < PROFILER_TOP; ++i)
+            fprintf(file, "%02X:%04X  %12llu  %12llu  %12llu  %5.2f%%\n", calls[i].key >> 16, calls[i].key & 0xFFFF,
+                    (unsigned long long)calls[i].count, (unsigned long long)calls[i].inclusive,
+                    (unsigned long long)calls[i].cycles, share(calls[i].inclusive, profiler->cycles));
+        free(calls);
+    }
+
+    int result = ferror(file) ? 2 : 0; // 2: write error
+    if(fclose(file)) result = 2;
+    if(!result) LOG_INFO(LOG_GENERAL, "Profile report written to %s", path);
+    return result;
+}
+
+int profilerFolded(const Profiler *profiler, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if(!file)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to open collapsed stack file: %s", path);
+        return 1; // Error opening file
+    }
+
+    // One line per call path: "entry;00:0150;01:4000 <cycles>"
+    int32_t frames[PROFILER_MAX_DEPTH + 1];
+    for(size_t i = 0; i < profiler->nodeCount; ++i)
+    {
+        if(!profiler->nodes[i].cycles) continue;
+
+        int depth = 0;
+        for(int32_t node = (int32_t)i; node > 0; node = profiler->nodes[node].parent)
+            frames[depth++] = node;
+
+        fputs("entry", file);
+        while(depth--)
+        {
+            uint32_t target = profiler->nodes[frames[depth]].target;
+            fprintf(file, ";%02X:%04X", target >> 16, target & 0xFFFF);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)profiler->nodes[i].cycles);
+    }
+
+    int result = ferror(file) ? 2 : 0; // 2: write error
+    if(fclose(file)) result = 2;
+    if(!result) LOG_INFO(LOG_GENERAL, "Collapsed stacks written to %s", path);
+    return result;
+}
@@ -0,0 +1,334 @@
+#include "../includes/rewind.h"
+#include "../includes/state.h"
+#include "../includes/log.h"
+#include "../includes/stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    size_t   offset;    // Start in the ring
+    uint32_t length;    // Encoded bytes
+    uint32_t size;      // Decoded state bytes
+    uint64_t key;       // Sequence number of the keyframe this entry is relative to
+} RewindEntry;
+
+struct Rewind
+{
+    uint8_t     *ring;
+    size_t       capacity;
+    size_t       head;         // Next write offset
+    size_t       used;         // Bytes held by live entries
+
+    RewindEntry *entries;      // Indexed by sequence number modulo REWIND_MAX_ENTRIES
+    uint64_t     first;        // Sequence number of the oldest live entry
+    uint64_t     next;         // Sequence number of the next entry
+    uint64_t     key;          // Newest keyframe, entries after it are deltas against it
+    int          sinceKey;     // Deltas stored since that keyframe
+
+    uint8_t     *state;        // Current save state
+    uint8_t     *keyState;     // Decoded keyframe, valid for keyCached
+    uint64_t     keyCached;
+    uint8_t     *encoded;      // Encoder output before it is copied into the ring
+    size_t       stateCapacity;
+
+    uint64_t     pushed;
+    double       seconds;
+};
+
+static uint8_t *putVarint(uint8_t *out, size_t value)
+{
+    while(value >= 0x80)
+    {
+        *out++ = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static const uint8_t *getVarint(const uint8_t *in, size_t *value)
+{
+    size_t result = 0;
+    int shift = 0;
+    do
+    {
+        result |= (size_t)(*in & 0x7F) << shift;
+        shift += 7;
+    } while(*in++ & 0x80);
+    *value = result;
+    return in;
+}
+
+// Encodes state XOR reference (reference NULL for a keyframe) as
+// <zero run varint> <literal count varint> <literal bytes> pairs.
+// Zero runs are found a word at a time, most of a frame's delta is zero.
+static size_t encode(const uint8_t *state, const uint8_t *reference, size_t size, uint8_t *out)
+{
+    uint8_t *start = out;
+    size_t i = 0;
+    while(i < size)
+    {
+        size_t run = i;
+        while(run + 8 <= size)
+        {
+            uint64_t a, b = 0;
+            memcpy(&a, state + run, 8);
+            if(reference) memcpy(&b, reference + run, 8);
+            if(a != b) break;
+            run += 8;
+        }
+        while(run < size && state[run] == (reference ? reference[run] : 0))
+            run++;
+
+        // Literals end at the first zero pair, a single matching byte is cheaper inline
+        size_t literal = run;
+        while(literal < size)
+        {
+            uint8_t x = state[literal] ^ (reference ? reference[literal] : 0);
+            if(!x && literal + 1 < size && !(state[literal + 1] ^ (reference ? reference[literal + 1] : 0)))
+                break;
+            literal++;
+        }
+
+        out = putVarint(out, run - i);
+        out = putVarint(out, literal - run);
+        if(reference)
+            for(size_t j = run; j < literal; ++j)
+                *out++ = state[j] ^ reference[j];
+        else
+        {
+            memcpy(out, state + run, literal - run);
+            out += literal - run;
+        }
+        i = literal;
+    }
+    return (size_t)(out - start);
+}
+
+static void decode(const uint8_t *in, size_t length, const uint8_t *reference, uint8_t *state, size_t size)
+{
+    const uint8_t *end = in + length;
+    size_t i = 0;
+    while(in < end && i < size)
+    {
+        size_t run, literal;
+        in = getVarint(in, &run);
+        in = getVarint(in, &literal);
+
+        if(reference) memcpy(state + i, reference + i, run);
+        else          memset(state + i, 0, run);
+        i += run;
+
+        for(size_t j = 0; j < literal; ++j, ++i)
+            state[i] = in[j] ^ (reference ? reference[i] : 0);
+        in += literal;
+    }
+}
+
+Rewind *rewindCreate(size_t bytes)
+{
+    Rewind *rewind = calloc(1, sizeof(Rewind));
+    if(!rewind)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate rewind buffer");
+        return NULL; // Memory allocation error
+    }
+
+    rewind->capacity = bytes;
+    rewind->ring = malloc(bytes);
+    rewind->entries = malloc(REWIND_MAX_ENTRIES * sizeof(RewindEntry));
+    rewind->keyCached = UINT64_MAX;
+    if(!rewind->ring || !rewind->entries)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate %zu byte rewind ring", bytes);
+        rewindDestroy(rewind);
+        return NULL; // Memory allocation error
+    }
+
+    LOG_INFO(LOG_GENERAL, "Rewind enabled with a %zu KB ring", bytes >> 10);
+    return rewind;
+}
+
+void rewindDestroy(Rewind *rewind)
+{
+    if(!rewind) return;
+    free(rewind->ring);
+    free(rewind->entries);
+    free(rewind->state);
+    free(rewind->keyState);
+    free(rewind->encoded);
+    free(rewind);
+}
+
+static int reserveStates(Rewind *rewind, size_t size)
+{
+    if(size <= rewind->stateCapacity) return 0;
+
+    // Worst case encoding is every byte literal plus a varint pair per 2 bytes
+    uint8_t *state = realloc(rewind->state, size);
+    if(state) rewind->state = state;
+    uint8_t *keyState = realloc(rewind->keyState, size);
+    if(keyState) rewind->keyState = keyState;
+    uint8_t *encoded = realloc(rewind->encoded, size * 3 + 16);
+    if(encoded) rewind->encoded = encoded;
+    if(!state || !keyState || !encoded) return 1;
+
+    rewind->stateCapacity = size;
+    rewind->keyCached = UINT64_MAX;
+    return 0;
+}
+
+static RewindEntry *entryAt(const Rewind *rewind, uint64_t sequence)
+{
+    return &rewind->entries[sequence % REWIND_MAX_ENTRIES];
+}
+
+static void dropOldest(Rewind *rewind)
+{
+    // A keyframe takes its deltas with it
+    do
+    {
+        rewind->used -= entryAt(rewind, rewind->first)->length;
+        rewind->first++;
+    } while(rewind->first < rewind->next && entryAt(rewind, rewind->first)->key != rewind->first);
+}
+
+static bool overlaps(const RewindEntry *entry, size_t offset, size_t length)
+{
+    return entry->offset < offset + length && offset < entry->offset + entry->length;
+}
+
+// Finds room for length bytes at the head of the ring, evicting the oldest groups
+static size_t allocate(Rewind *rewind, size_t length)
+{
+    size_t offset = rewind->head;
+    if(offset + length > rewind->capacity)
+    {
+        // Everything between the head and the end of the ring is older than what sits at 0
+        while(rewind->first < rewind->next && entryAt(rewind, rewind->first)->offset >= rewind->head)
+            dropOldest(rewind);
+        offset = 0;
+    }
+
+    while(rewind->first < rewind->next &&
+          (overlaps(entryAt(rewind, rewind->first), offset, length) || rewind->next - rewind->first >= REWIND_MAX_ENTRIES))
+        dropOldest(rewind);
+
+    rewind->head = offset + length;
+    return offset;
+}
+
+// The decoded keyframe for sequence key, decoding it from the ring when it is not cached
+static const uint8_t *keyframe(Rewind *rewind, uint64_t key)
+{
+    if(rewind->keyCached != key)
+    {
+        const RewindEntry *entry = entryAt(rewind, key);
+        decode(rewind->ring + entry->offset, entry->length, NULL, rewind->keyState, entry->size);
+        rewind->keyCached = key;
+    }
+    return rewind->keyState;
+}
+
+int rewindPush(Rewind *rewind, const GameBoy *gb)
+{
+    uint64_t start = statsClock();
+    size_t size = stateSize(gb);
+    if(reserveStates(rewind, size))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate rewind state buffers");
+        return 1; // Memory allocation error
+    }
+    stateSave(gb, rewind->state, size);
+
+    // Deltas need a live keyframe of the same size
+    bool keyLive = rewind->key >= rewind->first && rewind->key < rewind->next;
+    bool isKey = !keyLive || rewind->sinceKey + 1 >= REWIND_KEY_INTERVAL || entryAt(rewind, rewind->key)->size != size;
+    const uint8_t *reference = isKey ? NULL : keyframe(rewind, rewind->key);
+    size_t length = encode(rewind->state, reference, size, rewind->encoded);
+
+    if(length > rewind->capacity / 2)
+    {
+        LOG_WARN(LOG_GENERAL, "Rewind ring too small for a %zu byte snapshot", length);
+        return 2; // Ring too small
+    }
+
+    size_t offset = allocate(rewind, length);
+    if(!isKey && rewind->key < rewind->first)
+    {
+        // Eviction took our keyframe: store this frame as one instead
+        rewind->head = offset;
+        isKey = true;
+        length = encode(rewind->state, NULL, size, rewind->encoded);
+        offset = allocate(rewind, length);
+    }
+    memcpy(rewind->ring + offset, rewind->encoded, length);
+
+    uint64_t sequence = rewind->next++;
+    RewindEntry *entry = entryAt(rewind, sequence);
+    entry->offset = offset;
+    entry->length = (uint32_t)length;
+    entry->size = (uint32_t)size;
+    if(isKey)
+    {
+        rewind->key = sequence;
+        rewind->sinceKey = 0;
+        memcpy(rewind->keyState, rewind->state, size); // Next deltas are against this frame
+        rewind->keyCached = sequence;
+    }
+    else
+        rewind->sinceKey++;
+    entry->key = rewind->key;
+
+    rewind->used += length;
+    rewind->pushed++;
+    rewind->seconds += (statsClock() - start) / 1e9;
+    return 0;
+}
+
+int rewindPop(Rewind *rewind, GameBoy *gb)
+{
+    if(rewind->first == rewind->next) return 1; // Nothing left
+
+    uint64_t sequence = rewind->next - 1;
+    const RewindEntry *entry = entryAt(rewind, sequence);
+    if(entry->key == sequence)
+        decode(rewind->ring + entry->offset, entry->length, NULL, rewind->state, entry->size);
+    else
+        decode(rewind->ring + entry->offset, entry->length, keyframe(rewind, entry->key), rewind->state, entry->size);
+
+    int result = stateLoad(gb, rewind->state, entry->size) ? 2 : 0; // 2: stored state rejected
+
+    // The next push continues the group this entry belonged to
+    rewind->next = sequence;
+    rewind->head = entry->offset;
+    rewind->used -= entry->length;
+    rewind->key = entry->key;
+    rewind->sinceKey = (int)(sequence - entry->key) - 1;
+    if(rewind->keyCached == sequence) rewind->keyCached = UINT64_MAX;
+    return result;
+}
+
+int rewindStep(Rewind *rewind, GameBoy *gb)
+{
+    // The newest entry is the frame on screen, pictures are not saved. The
+    // previous frame is shown by running it again from the entry before it.
+    if(rewind->next - rewind->first < 3) return 1; // Nothing left to step back to
+    for(int i = 0; i < 3; ++i)
+        if(rewindPop(rewind, gb)) return 2; // Stored state rejected
+    if(rewindPush(rewind, gb)) return 3; // Entry could not be put back
+
+    gbRunFrameAhead(gb, 0, true);
+    return rewindPush(rewind, gb) ? 3 : 0;
+}
+
+void rewindStats(const Rewind *rewind, RewindStats *stats)
+{
+    stats->entries = (int)(rewind->next - rewind->first);
+    stats->bytes = rewind->used;
+    stats->capacity = rewind->capacity;
+    stats->pushed = rewind->pushed;
+    stats->seconds = rewind->seconds;
+}
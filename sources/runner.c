@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L // sysconf
+
+#include "../includes/runner.h"
+#include "../includes/log.h"
+#include "../includes/stats.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TASK_EMPTY -1
+#define TASK_ABORT -2
+
+// Chase-Lev deque of instance indices. The owner pushes and takes at the
+// bottom, thieves steal from the top. Every instance has at most one frame
+// in flight, so a capacity of count rounded up to a power of two never fills.
+typedef struct
+{
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    atomic_int *tasks;
+    long        mask;
+} Deque;
+
+typedef struct Runner Runner;
+
+typedef struct
+{
+    Runner   *runner;
+    int       index;
+    pthread_t thread;
+    Deque     deque;
+    unsigned  seed;         // For picking steal victims
+
+    uint64_t  frames;       // Per-worker totals, summed once at the end
+    uint64_t  cycles;
+    uint64_t  instructions;
+    uint64_t  steals;
+} Worker;
+
+struct Runner
+{
+    GameBoy   **instances;
+    uint64_t   *framesLeft;  // Per instance, only touched by whoever holds its task
+    int         workerCount;
+    Worker      workers[RUNNER_MAX_THREADS];
+    _Alignas(64) atomic_int active; // Instances with frames left
+};
+
+static void dequePush(Deque *deque, int task)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    atomic_store_explicit(&deque->tasks[b & deque->mask], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+static int dequeTake(Deque *deque)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if(t > b)
+    {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return TASK_EMPTY;
+    }
+
+    int task = atomic_load_explicit(&deque->tasks[b & deque->mask], memory_order_relaxed);
+    if(t == b)
+    {
+        // Last task: race the thieves for it
+        if(!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                    memory_order_seq_cst, memory_order_relaxed))
+            task = TASK_EMPTY;
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static int dequeSteal(Deque *deque)
+{
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if(t >= b) return TASK_EMPTY;
+
+    int task = atomic_load_explicit(&deque->tasks[t & deque->mask], memory_order_relaxed);
+    if(!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                memory_order_seq_cst, memory_order_relaxed))
+        return TASK_ABORT;
+    return task;
+}
+
+static int findWork(Worker *worker)
+{
+    int task = dequeTake(&worker->deque);
+    if(task >= 0) return task;
+
+    Runner *runner = worker->runner;
+    int start = rand_r(&worker->seed) % runner->workerCount;
+    for(int i = 0; i < runner->workerCount; ++i)
+    {
+        Worker *victim = &runner->workers[(start + i) % runner->workerCount];
+        if(victim == worker) continue;
+
+        task = dequeSteal(&victim->deque);
+        if(task >= 0)
+        {
+            worker->steals++;
+            return task;
+        }
+    }
+    return TASK_EMPTY;
+}
+
+static void *workerThread(void *arg)
+{
+    Worker *worker = arg;
+    Runner *runner = worker->runner;
+
+    while(atomic_load_explicit(&runner->active, memory_order_acquire) > 0)
+    {
+        int task = findWork(worker);
+        if(task < 0)
+        {
+            sched_yield();
+            continue;
+        }
+
+        GameBoy *gb = runner->instances[task];
+        uint64_t instructions = gb->instructions;
+        int cycles = gbRunFrame(gb);
+        worker->cycles += cycles;
+        worker->instructions += gb->instructions - instructions;
+        worker->frames++;
+        metricsFrame(gb->metrics, cycles, gb->instructions - instructions, false);
+
+        // Keep the instance on this worker while its state is hot in cache
+        if(--runner->framesLeft[task])
+            dequePush(&worker->deque, task);
+        else
+            atomic_fetch_sub_explicit(&runner->active, 1, memory_order_release);
+    }
+    return NULL;
+}
+
+int runnerRun(GameBoy **instances, int count, int threads, uint64_t frames, RunnerStats *stats)
+{
+    if(threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads < 1) threads = 1;
+    if(threads > RUNNER_MAX_THREADS) threads = RUNNER_MAX_THREADS;
+
+    Runner *runner = calloc(1, sizeof(Runner));
+    long capacity = 1;
+    while(capacity < count) capacity <<= 1;
+
+    if(!runner || !(runner->framesLeft = calloc(count, sizeof(uint64_t))))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate runner");
+        free(runner);
+        return 1; // Memory allocation error
+    }
+
+    runner->instances = instances;
+    runner->workerCount = threads;
+    atomic_init(&runner->active, frames ? count : 0);
+
+    for(int i = 0; i < threads; ++i)
+    {
+        Worker *worker = &runner->workers[i];
+        worker->runner = runner;
+        worker->index = i;
+        worker->seed = 0x9E3779B9u * (i + 1);
+        worker->deque.mask = capacity - 1;
+        worker->deque.tasks = calloc(capacity, sizeof(atomic_int));
+        if(!worker->deque.tasks)
+        {
+            LOG_ERROR(LOG_GENERAL, "Failed to allocate runner deque");
+            for(int j = 0; j < i; ++j) free(runner->workers[j].deque.tasks);
+            free(runner->framesLeft);
+            free(runner);
+            return 1; // Memory allocation error
+        }
+    }
+
+    // Deal the instances out round-robin, stealing evens out the rest
+    for(int i = 0; i < count && frames; ++i)
+    {
+        runner->framesLeft[i] = frames;
+        dequePush(&runner->workers[i % threads].deque, i);
+    }
+
+    uint64_t start = statsClock();
+    int started = 1;
+    for(int i = 1; i < threads; ++i, ++started)
+        if(pthread_create(&runner->workers[i].thread, NULL, workerThread, &runner->workers[i]) != 0)
+        {
+            LOG_WARN(LOG_GENERAL, "Failed to create runner thread %d", i);
+            break;
+        }
+
+    workerThread(&runner->workers[0]); // The calling thread works too
+    for(int i = 1; i < started; ++i)
+        pthread_join(runner->workers[i].thread, NULL);
+    double elapsed = (statsClock() - start) / 1e9;
+
+    RunnerStats total = { 0 };
+    for(int i = 0; i < threads; ++i)
+    {
+        Worker *worker = &runner->workers[i];
+        total.frames       += worker->frames;
+        total.cycles       += worker->cycles;
+        total.instructions += worker->instructions;
+        total.steals       += worker->steals;
+        free(worker->deque.tasks);
+    }
+    total.seconds = elapsed;
+    total.framesPerSecond = elapsed > 0 ? total.frames / elapsed : 0;
+    total.threads = started;
+    if(stats) *stats = total;
+
+    free(runner->framesLeft);
+    free(runner);
+    return 0;
+}
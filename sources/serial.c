@@ -0,0 +1,522 @@
+#define _POSIX_C_SOURCE 200809L // MSG_NOSIGNAL, clock_gettime
+#include "../includes/serial.h"
+#include "../includes/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERIAL_MSG_ARM    1 // Slave armed, value is its SB
+#define SERIAL_MSG_DISARM 2
+#define SERIAL_MSG_DATA   3 // Master's byte at the end of a transfer
+#define SERIAL_MSG_CLOCK  4 // Only the clock
+
+struct SerialChannel
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  changed; // A message was delivered
+    int             refs;    // Ports still attached, under lock
+};
+
+void initSerial(Serial *serial, const uint64_t *cycles)
+{
+    memset(serial, 0, sizeof(Serial));
+    serial->link = SERIAL_LINK_NONE;
+    serial->socket = -1;
+    serial->cycles = cycles;
+}
+
+void freeSerial(Serial *serial)
+{
+    serialDisconnect(serial);
+}
+
+void cloneSerial(Serial *clone, const Serial *serial, const uint64_t *cycles)
+{
+    // Registers and the transfer in flight carry over, the cable does not
+    *clone = *serial;
+    clone->link = SERIAL_LINK_NONE;
+    clone->channel = NULL;
+    clone->peer = NULL;
+    clone->socket = -1;
+    clone->partialLength = 0;
+    clone->unsentLength = 0;
+    clone->cycles = cycles;
+    clone->clockStarted = false;
+    clone->peerArmed = false;
+    clone->received = false;
+    clone->capture = NULL;
+    clone->captureCapacity = clone->captureLength = 0;
+}
+
+// Cycles since the link started, so peers with different histories still agree on time
+static uint64_t linkClock(Serial *serial)
+{
+    if(!serial->clockStarted)
+    {
+        serial->clockBase = *serial->cycles;
+        serial->clockStarted = true;
+    }
+    return *serial->cycles - serial->clockBase;
+}
+
+static void lockChannel(Serial *serial)
+{
+    if(serial->channel) pthread_mutex_lock(&serial->channel->lock);
+}
+
+static void unlockChannel(Serial *serial)
+{
+    if(serial->channel) pthread_mutex_unlock(&serial->channel->lock);
+}
+
+static void resetLink(Serial *serial)
+{
+    serial->link = SERIAL_LINK_NONE;
+    serial->channel = NULL;
+    serial->peer = NULL;
+    serial->socket = -1;
+    serial->partialLength = 0;
+    serial->unsentLength = 0;
+    serial->clockStarted = false;
+    serial->peerClock = 0;
+    serial->peerArmed = false;
+    serial->received = false;
+    serial->dataSent = serial->dataDone = 0;
+}
+
+void serialDisconnect(Serial *serial)
+{
+    if(serial->link == SERIAL_LINK_LOCAL)
+    {
+        SerialChannel *channel = serial->channel;
+        pthread_mutex_lock(&channel->lock);
+        if(serial->peer)
+        {
+            serial->peer->peer = NULL;
+            serial->peer->peerArmed = false;
+            pthread_cond_broadcast(&channel->changed); // A waiting peer has nothing left to wait for
+        }
+        int refs = --channel->refs;
+        pthread_mutex_unlock(&channel->lock);
+        if(!refs)
+        {
+            pthread_cond_destroy(&channel->changed);
+            pthread_mutex_destroy(&channel->lock);
+            free(channel);
+        }
+    }
+    else if(serial->link == SERIAL_LINK_SOCKET)
+        close(serial->socket);
+
+    resetLink(serial);
+}
+
+int serialConnectLocal(Serial *a, Serial *b)
+{
+    SerialChannel *channel = malloc(sizeof(SerialChannel));
+    if(!channel)
+    {
+        LOG_ERROR(LOG_IO, "Failed to allocate serial channel");
+        return 1; // Memory allocation error
+    }
+
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    int failed = pthread_mutex_init(&channel->lock, NULL);
+    if(!failed && (failed = pthread_cond_init(&channel->changed, &attributes)))
+        pthread_mutex_destroy(&channel->lock);
+    pthread_condattr_destroy(&attributes);
+    if(failed)
+    {
+        free(channel);
+        return 2; // Failed to create lock
+    }
+
+    serialDisconnect(a);
+    serialDisconnect(b);
+    channel->refs = 2;
+    a->link = b->link = SERIAL_LINK_LOCAL;
+    a->channel = b->channel = channel;
+    a->peer = b;
+    b->peer = a;
+    LOG_DEBUG(LOG_IO, "Serial ports linked in process");
+    return 0;
+}
+
+static int attachSocket(Serial *serial, int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        LOG_ERROR(LOG_IO, "Failed to make link socket non-blocking");
+        close(fd);
+        return 2; // Socket setup failed
+    }
+
+    serialDisconnect(serial);
+    serial->link = SERIAL_LINK_SOCKET;
+    serial->socket = fd;
+    return 0;
+}
+
+static int socketAddress(struct sockaddr_un *address, const char *path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address->sun_path))
+    {
+        LOG_ERROR(LOG_IO, "Link socket path too long: %s", path);
+        return 1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int serialListen(Serial *serial, const char *path)
+{
+    struct sockaddr_un address;
+    if(socketAddress(&address, path)) return 1; // Bad path
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0)
+    {
+        LOG_ERROR(LOG_IO, "Failed to create link socket: %s", strerror(errno));
+        return 2; // Socket setup failed
+    }
+
+    unlink(path); // Left over from an earlier run
+    if(bind(server, (struct sockaddr *)&address, sizeof(address)) || listen(server, 1))
+    {
+        LOG_ERROR(LOG_IO, "Failed to listen on %s: %s", path, strerror(errno));
+        close(server);
+        return 2; // Socket setup failed
+    }
+
+    LOG_INFO(LOG_IO, "Waiting for the link peer on %s", path);
+    int fd = accept(server, NULL, NULL);
+    close(server);
+    unlink(path);
+    if(fd < 0)
+    {
+        LOG_ERROR(LOG_IO, "Failed to accept the link peer: %s", strerror(errno));
+        return 2; // Socket setup failed
+    }
+    LOG_INFO(LOG_IO, "Link peer connected");
+    return attachSocket(serial, fd);
+}
+
+int serialConnect(Serial *serial, const char *path)
+{
+    struct sockaddr_un address;
+    if(socketAddress(&address, path)) return 1; // Bad path
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)))
+    {
+        LOG_ERROR(LOG_IO, "Failed to connect to %s: %s", path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return 2; // Socket setup failed
+    }
+    LOG_INFO(LOG_IO, "Connected to the link peer on %s", path);
+    return attachSocket(serial, fd);
+}
+
+void serialSetCapture(Serial *serial, uint8_t *buffer, size_t capacity)
+{
+    serial->capture = buffer;
+    serial->captureCapacity = capacity;
+    serial->captureLength = 0;
+}
+
+// Applies a message from the peer, under the channel lock for local links
+static void deliver(Serial *serial, const uint8_t message[SERIAL_MESSAGE_SIZE])
+{
+    uint64_t clock = 0;
+    for(int i = SERIAL_MESSAGE_SIZE - 1; i >= 3; --i)
+        clock = clock << 8 | message[i];
+
+    if(message[0] == SERIAL_MSG_DATA)
+    {
+        serial->received = true;
+        serial->receivedData = message[1];
+        serial->receivedClock = clock;
+        return;
+    }
+
+    // Sent before the peer took our last byte, it describes a transfer that is over
+    if(message[2] != serial->dataSent) return;
+
+    serial->peerClock = clock;
+    switch(message[0])
+    {
+        case SERIAL_MSG_ARM:    serial->peerArmed = true; serial->peerData = message[1]; break;
+        case SERIAL_MSG_DISARM: serial->peerArmed = false; break;
+        case SERIAL_MSG_CLOCK:  break;
+        default: LOG_WARN(LOG_IO, "Unknown serial message %u", message[0]); break;
+    }
+}
+
+// Hands queued bytes to the socket until it would block. False once the link is gone.
+static bool flushSocket(Serial *serial)
+{
+    int sent = 0;
+    while(sent < serial->unsentLength)
+    {
+        ssize_t count = send(serial->socket, serial->unsent + sent, serial->unsentLength - sent, MSG_NOSIGNAL);
+        if(count > 0)
+            sent += (int)count;
+        else if(count < 0 && errno == EINTR)
+            continue;
+        else if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break; // Peer busy, the rest goes out on the next message or sync
+        else
+        {
+            LOG_WARN(LOG_IO, "Link peer went away");
+            serialDisconnect(serial);
+            return false;
+        }
+    }
+    memmove(serial->unsent, serial->unsent + sent, serial->unsentLength - sent);
+    serial->unsentLength -= sent;
+    return true;
+}
+
+// Queues a message behind whatever the socket has not taken. When a stalled peer
+// let the queue fill up, clock updates are skipped, the next one supersedes them,
+// and transfer messages wait up to SERIAL_SYNC_MS for room.
+static void sendSocket(Serial *serial, const uint8_t message[SERIAL_MESSAGE_SIZE])
+{
+    if(!flushSocket(serial)) return;
+    if(serial->unsentLength + SERIAL_MESSAGE_SIZE > SERIAL_QUEUE_SIZE)
+    {
+        if(message[0] == SERIAL_MSG_CLOCK) return;
+        struct pollfd writable = { serial->socket, POLLOUT, 0 };
+        if(poll(&writable, 1, SERIAL_SYNC_MS) <= 0 || !flushSocket(serial)
+           || serial->unsentLength + SERIAL_MESSAGE_SIZE > SERIAL_QUEUE_SIZE)
+        {
+            if(serial->link != SERIAL_LINK_SOCKET) return; // Already gone
+            LOG_WARN(LOG_IO, "Link peer stopped reading");
+            serialDisconnect(serial);
+            return;
+        }
+    }
+
+    memcpy(serial->unsent + serial->unsentLength, message, SERIAL_MESSAGE_SIZE);
+    serial->unsentLength += SERIAL_MESSAGE_SIZE;
+    flushSocket(serial);
+}
+
+static void sendMessage(Serial *serial, uint8_t type, uint8_t value)
+{
+    if(serial->offline || serial->link == SERIAL_LINK_NONE) return;
+
+    uint8_t message[SERIAL_MESSAGE_SIZE] = { type, value, serial->dataDone };
+    uint64_t clock = linkClock(serial);
+    for(int i = 3; i < SERIAL_MESSAGE_SIZE; ++i, clock >>= 8)
+        message[i] = (uint8_t)clock;
+
+    if(serial->link == SERIAL_LINK_LOCAL)
+    {
+        pthread_mutex_lock(&serial->channel->lock);
+        if(serial->peer)
+        {
+            deliver(serial->peer, message);
+            pthread_cond_broadcast(&serial->channel->changed);
+        }
+        pthread_mutex_unlock(&serial->channel->lock);
+    }
+    else
+        sendSocket(serial, message);
+}
+
+static void receiveMessages(Serial *serial)
+{
+    if(serial->link != SERIAL_LINK_SOCKET || serial->offline) return;
+
+    uint8_t buffer[16 * SERIAL_MESSAGE_SIZE];
+    ssize_t count;
+    while((count = recv(serial->socket, buffer, sizeof(buffer), 0)) > 0)
+    {
+        for(ssize_t i = 0; i < count; ++i)
+        {
+            serial->partial[serial->partialLength++] = buffer[i];
+            if(serial->partialLength == SERIAL_MESSAGE_SIZE)
+            {
+                deliver(serial, serial->partial);
+                serial->partialLength = 0;
+            }
+        }
+    }
+    if(count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        LOG_WARN(LOG_IO, "Link peer went away");
+        serialDisconnect(serial);
+    }
+}
+
+// Master side at the end of a transfer: the answer is only known once the peer
+// is armed or has run as far as we have. Returns with the channel locked.
+static void waitForPeer(Serial *serial)
+{
+    lockChannel(serial);
+    if(serial->offline || serial->link == SERIAL_LINK_NONE) return;
+
+    uint64_t now = linkClock(serial);
+    if(serial->peerArmed || serial->peerClock >= now) return;
+
+    // A peer waiting on us as master must see that we got this far
+    unlockChannel(serial);
+    sendMessage(serial, SERIAL_MSG_CLOCK, 0);
+    lockChannel(serial);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += SERIAL_SYNC_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    if(serial->link == SERIAL_LINK_LOCAL)
+    {
+        while(!serial->peerArmed && serial->peerClock < now && serial->peer)
+            if(pthread_cond_timedwait(&serial->channel->changed, &serial->channel->lock, &deadline)) break;
+    }
+    else
+    {
+        // No channel lock for sockets, messages arrive on this thread
+        struct pollfd readable = { serial->socket, POLLIN, 0 };
+        while(!serial->peerArmed && serial->peerClock < now && serial->link == SERIAL_LINK_SOCKET)
+        {
+            struct timespec time;
+            clock_gettime(CLOCK_MONOTONIC, &time);
+            long remaining = (deadline.tv_sec - time.tv_sec) * 1000 + (deadline.tv_nsec - time.tv_nsec) / 1000000;
+            if(remaining <= 0 || poll(&readable, 1, (int)remaining) <= 0) break;
+            receiveMessages(serial);
+        }
+    }
+
+    if(!serial->peerArmed && serial->peerClock < now && serial->link != SERIAL_LINK_NONE)
+    {
+        serial->timeouts++;
+        LOG_DEBUG(LOG_IO, "Serial peer stalled, transfer ends unanswered");
+    }
+}
+
+static void complete(Serial *serial, MMU *mmu, uint8_t value)
+{
+    serial->SB = value;
+    serial->SC &= 0x7F;
+    mmu->interruptFlags |= INT_SERIAL;
+    serial->transfers++;
+    LOG_TRACE(LOG_IO, "Serial transfer complete, received 0x%02X", value);
+}
+
+uint8_t serialReadRegister(Serial *serial, uint16_t address)
+{
+    return address == 0xFF01 ? serial->SB : (serial->SC | 0x7E);
+}
+
+void serialWriteRegister(Serial *serial, uint16_t address, uint8_t value)
+{
+    if(address == 0xFF01)
+    {
+        serial->SB = value;
+        if(serial->SC == 0x80) sendMessage(serial, SERIAL_MSG_ARM, value); // The master takes the new byte
+        return;
+    }
+
+    bool armed = serial->SC == 0x80;
+    serial->SC = value & 0x81;
+    if(serial->SC == 0x81)
+    {
+        // Internal clock: the byte is out after 8 bit times whether anyone listens or not
+        if(serial->capture && !serial->offline && serial->captureLength < serial->captureCapacity)
+            serial->capture[serial->captureLength++] = serial->SB;
+        serial->countdown = SERIAL_BYTE_CYCLES;
+    }
+    else if(serial->SC == 0x80)
+    {
+        // External clock: wait for a master, which never comes without a cable
+        sendMessage(serial, SERIAL_MSG_ARM, serial->SB);
+        serial->countdown = serial->link != SERIAL_LINK_NONE ? SERIAL_POLL_CYCLES : 0;
+    }
+    else
+    {
+        if(armed) sendMessage(serial, SERIAL_MSG_DISARM, 0);
+        serial->countdown = 0;
+    }
+}
+
+void serialEvent(Serial *serial, MMU *mmu)
+{
+    serial->countdown = 0;
+    receiveMessages(serial);
+
+    // Speculative frames see what the peer offers without taking it
+    bool consume = !serial->offline;
+    if(serial->SC == 0x81)
+    {
+        waitForPeer(serial);
+        bool armed = serial->link != SERIAL_LINK_NONE && serial->peerArmed;
+        uint8_t value = armed ? serial->peerData : 0xFF;
+        if(armed && consume)
+        {
+            // Nothing the peer says counts until it has seen our byte
+            serial->peerArmed = false;
+            serial->peerClock = 0;
+            serial->dataSent++;
+        }
+        unlockChannel(serial);
+
+        if(armed) sendMessage(serial, SERIAL_MSG_DATA, serial->SB);
+        complete(serial, mmu, value);
+    }
+    else if(serial->SC == 0x80)
+    {
+        lockChannel(serial);
+        bool received = serial->received;
+        uint8_t value = serial->receivedData;
+        uint64_t at = serial->receivedClock;
+        unlockChannel(serial);
+
+        uint64_t now = linkClock(serial);
+        if(received && at > now)
+            serial->countdown = (at - now < SERIAL_BYTE_CYCLES) ? (int32_t)(at - now) : SERIAL_BYTE_CYCLES; // Behind the master, end with it
+        else if(received)
+        {
+            if(consume)
+            {
+                lockChannel(serial);
+                serial->received = false;
+                unlockChannel(serial);
+                serial->dataDone++;
+            }
+            complete(serial, mmu, value);
+        }
+        else if(serial->link != SERIAL_LINK_NONE)
+            serial->countdown = SERIAL_POLL_CYCLES;
+    }
+}
+
+void serialSync(Serial *serial)
+{
+    receiveMessages(serial); // Keeps the socket drained while nothing is transferring
+    if(serial->offline) return;
+
+    // A byte that arrived while not armed goes nowhere, but the master waits for it to be taken
+    lockChannel(serial);
+    bool dropped = serial->received && serial->SC != 0x80;
+    if(dropped) serial->received = false;
+    unlockChannel(serial);
+    if(dropped) serial->dataDone++;
+
+    sendMessage(serial, SERIAL_MSG_CLOCK, 0);
+}
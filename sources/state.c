@@ -0,0 +1,415 @@
+#include "../includes/state.h"
+#include "../includes/log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+#define TAG_CPU  TAG('C', 'P', 'U', ' ')
+#define TAG_MBC  TAG('M', 'B', 'C', ' ')
+#define TAG_IO   TAG('I', 'O', ' ', ' ')
+#define TAG_PPU  TAG('P', 'P', 'U', ' ')
+#define TAG_CLK  TAG('C', 'L', 'K', ' ')
+#define TAG_APU  TAG('A', 'P', 'U', ' ')
+#define TAG_VRAM TAG('V', 'R', 'A', 'M')
+#define TAG_WRAM TAG('W', 'R', 'A', 'M')
+#define TAG_HRAM TAG('H', 'R', 'A', 'M')
+#define TAG_OAM  TAG('O', 'A', 'M', ' ')
+#define TAG_CRAM TAG('C', 'R', 'A', 'M')
+
+#define STATE_HEADER_SIZE  12
+#define STATE_SECTION_SIZE 8
+#define STATE_SECTIONS     11
+
+// Fixed part of each field section, version 1
+#define CPU_FIELDS_SIZE 13 // af bc de hl sp pc, ime
+#define MBC_FIELDS_SIZE 4  // rom bank, ram bank, ram enabled, banking mode
+#define IO_FIELDS_SIZE  10 // ie, joypad, joypad select, if, sb, sc, serial countdown
+#define PPU_FIELDS_SIZE 29 // 11 registers, mode, modeClock, frameClock, frames, linesLatched
+#define CLK_FIELDS_SIZE 16 // cycles, instructions
+#define APU_FIELDS_SIZE 111 // registers and wave RAM, 4 channels, sweep, sequencer, pending cycles
+
+typedef struct
+{
+    uint8_t *at;
+} Writer;
+
+typedef struct
+{
+    const uint8_t *at;
+    const uint8_t *end;
+} Reader;
+
+static void put8 (Writer *w, uint8_t value)  { *w->at++ = value; }
+static void put16(Writer *w, uint16_t value) { put8(w, value); put8(w, value >> 8); }
+static void put32(Writer *w, uint32_t value) { put16(w, value); put16(w, value >> 16); }
+static void put64(Writer *w, uint64_t value) { put32(w, value); put32(w, value >> 32); }
+static void putBytes(Writer *w, const void *data, size_t size) { memcpy(w->at, data, size); w->at += size; }
+
+// Fields past the end of a section read as zero, so shorter (older) sections still load
+static uint8_t  get8 (Reader *r) { return r->at < r->end ? *r->at++ : 0; }
+static uint16_t get16(Reader *r) { uint16_t low = get8(r); return low | (uint16_t)get8(r) << 8; }
+static uint32_t get32(Reader *r) { uint32_t low = get16(r); return low | (uint32_t)get16(r) << 16; }
+static uint64_t get64(Reader *r) { uint64_t low = get32(r); return low | (uint64_t)get32(r) << 32; }
+static bool     has  (const Reader *r, size_t size) { return (size_t)(r->end - r->at) >= size; }
+
+static uint8_t *beginSection(Writer *w, uint32_t tag)
+{
+    put32(w, tag);
+    uint8_t *length = w->at;
+    w->at += 4;
+    return length;
+}
+
+static void endSection(Writer *w, uint8_t *length)
+{
+    Writer patch = { length };
+    put32(&patch, (uint32_t)(w->at - length - 4));
+}
+
+static void putArray(Writer *w, uint32_t tag, const void *data, size_t size)
+{
+    put32(w, tag);
+    put32(w, (uint32_t)size);
+    putBytes(w, data, size);
+}
+
+static uint16_t romChecksum(const Rom *rom)
+{
+    return (uint16_t)(rom->data[0x14E] << 8 | rom->data[0x14F]); // Global checksum from the header
+}
+
+static size_t cartRamSize(const MMU *mmu)
+{
+    return mmu->ramData ? (size_t)mmu->ramBankCount * 0x2000 : 0;
+}
+
+size_t stateSize(const GameBoy *gb)
+{
+    size_t sections = CPU_FIELDS_SIZE + MBC_FIELDS_SIZE + IO_FIELDS_SIZE + CLK_FIELDS_SIZE + APU_FIELDS_SIZE
+                    + PPU_FIELDS_SIZE + gb->ppu.linesLatched * sizeof(PPULineRegs)
+                    + VRAM_SIZE + WRAM_SIZE + sizeof(gb->mmu.hram)
+                    + sizeof(gb->mmu.oam) + cartRamSize(&gb->mmu);
+    return STATE_HEADER_SIZE + STATE_SECTIONS * STATE_SECTION_SIZE + sections;
+}
+
+size_t stateSave(const GameBoy *gb, uint8_t *buffer, size_t capacity)
+{
+    size_t size = stateSize(gb);
+    if(capacity < size)
+    {
+        LOG_ERROR(LOG_GENERAL, "Save state buffer too small: %zu < %zu bytes", capacity, size);
+        return 0; // Buffer too small
+    }
+
+    const CPU *cpu = &gb->cpu;
+    const MMU *mmu = &gb->mmu;
+    const PPU *ppu = &gb->ppu;
+    Writer w = { buffer };
+
+    put32(&w, STATE_MAGIC);
+    put16(&w, STATE_VERSION);
+    put16(&w, STATE_SECTIONS);
+    put16(&w, romChecksum(mmu->rom));
+    put16(&w, 0);
+
+    uint8_t *length = beginSection(&w, TAG_CPU);
+    put16(&w, cpu->af); put16(&w, cpu->bc); put16(&w, cpu->de);
+    put16(&w, cpu->hl); put16(&w, cpu->sp); put16(&w, cpu->pc);
+    put8(&w, (uint8_t)cpu->ime);
+    endSection(&w, length);
+
+    length = beginSection(&w, TAG_MBC);
+    put8(&w, mmu->currentRomBank);
+    put8(&w, mmu->currentRamBank);
+    put8(&w, mmu->ramEnabled);
+    put8(&w, mmu->bankingMode);
+    endSection(&w, length);
+
+    length = beginSection(&w, TAG_IO);
+    put8(&w, mmu->ieRegisters);
+    put8(&w, mmu->joypad);
+    put8(&w, mmu->joypadSelect);
+    put8(&w, mmu->interruptFlags);
+    put8(&w, gb->serial.SB);
+    put8(&w, gb->serial.SC);
+    put32(&w, gb->serial.countdown);
+    endSection(&w, length);
+
+    length = beginSection(&w, TAG_PPU);
+    put8(&w, ppu->LCDC); put8(&w, ppu->STAT); put8(&w, ppu->SCY);  put8(&w, ppu->SCX);
+    put8(&w, ppu->LY);   put8(&w, ppu->LYC);  put8(&w, ppu->BGP);  put8(&w, ppu->OBP0);
+    put8(&w, ppu->OBP1); put8(&w, ppu->WY);   put8(&w, ppu->WX);
+    put8(&w, ppu->mode);
+    put32(&w, (uint32_t)ppu->modeClock);
+    put32(&w, ppu->frameClock);
+    put64(&w, ppu->frames);
+    put8(&w, ppu->linesLatched);
+    putBytes(&w, ppu->lineRegs, ppu->linesLatched * sizeof(PPULineRegs)); // Lines already latched this frame
+    endSection(&w, length);
+
+    length = beginSection(&w, TAG_CLK);
+    put64(&w, gb->cycles);
+    put64(&w, gb->instructions);
+    endSection(&w, length);
+
+    const APU *apu = &gb->apu;
+    length = beginSection(&w, TAG_APU);
+    putBytes(&w, apu->regs, sizeof(apu->regs));
+    for(int channel = 0; channel < 4; ++channel)
+    {
+        const APUChannel *ch = &apu->channels[channel];
+        put8(&w, ch->enabled);
+        put16(&w, ch->length);
+        put8(&w, ch->volume);
+        put8(&w, ch->envelopeTimer);
+        put32(&w, (uint32_t)ch->timer);
+        put8(&w, ch->position);
+        put16(&w, ch->lfsr);
+    }
+    put16(&w, apu->sweepShadow);
+    put8(&w, apu->sweepTimer);
+    put8(&w, apu->sweepEnabled);
+    put8(&w, apu->sequencerStep);
+    put16(&w, apu->sequencerSamples);
+    put32(&w, apu->cycleRemainder);
+    put32(&w, apu->pending);
+    endSection(&w, length);
+
+    putArray(&w, TAG_VRAM, mmu->vram, VRAM_SIZE);
+
+    length = beginSection(&w, TAG_WRAM);
+    for(int page = 0; page < MMU_WRAM_PAGES; ++page)
+        putBytes(&w, mmu->wramPages[page]->data, MMU_PAGE_SIZE);
+    endSection(&w, length);
+    putArray(&w, TAG_HRAM, mmu->hram, sizeof(mmu->hram));
+    putArray(&w, TAG_OAM,  mmu->oam,  sizeof(mmu->oam));
+    putArray(&w, TAG_CRAM, mmu->ramData, cartRamSize(mmu));
+
+    return (size_t)(w.at - buffer);
+}
+
+// Checks every section header before anything is applied, so a bad state leaves the machine untouched
+static int validate(const GameBoy *gb, const uint8_t *buffer, size_t size)
+{
+    Reader r = { buffer, buffer + size };
+    if(!has(&r, STATE_HEADER_SIZE) || get32(&r) != STATE_MAGIC)
+    {
+        LOG_ERROR(LOG_GENERAL, "Not a save state");
+        return 1; // Bad magic
+    }
+
+    uint16_t version = get16(&r);
+    uint16_t sections = get16(&r);
+    uint16_t checksum = get16(&r);
+    get16(&r);
+    if(version > STATE_VERSION)
+    {
+        LOG_ERROR(LOG_GENERAL, "Save state version %u is newer than supported version %u", version, STATE_VERSION);
+        return 2; // Unsupported version
+    }
+    if(checksum != romChecksum(gb->mmu.rom))
+        LOG_WARN(LOG_GENERAL, "Save state was made with a different ROM (checksum %04X)", checksum);
+
+    for(uint16_t i = 0; i < sections; ++i)
+    {
+        if(!has(&r, STATE_SECTION_SIZE)) return 3; // Truncated
+        uint32_t tag = get32(&r);
+        uint32_t length = get32(&r);
+        if(!has(&r, length))
+        {
+            LOG_ERROR(LOG_GENERAL, "Save state section %08X truncated", tag);
+            return 3; // Truncated
+        }
+
+        size_t expected = SIZE_MAX;
+        switch(tag)
+        {
+            case TAG_VRAM: expected = VRAM_SIZE; break;
+            case TAG_WRAM: expected = WRAM_SIZE; break;
+            case TAG_HRAM: expected = sizeof(gb->mmu.hram); break;
+            case TAG_OAM:  expected = sizeof(gb->mmu.oam);  break;
+            case TAG_CRAM: expected = cartRamSize(&gb->mmu); break;
+            case TAG_PPU:
+                if(length >= PPU_FIELDS_SIZE && r.at[PPU_FIELDS_SIZE - 1] > SCREEN_HEIGHT)
+                    return 4; // Corrupt latched line count
+                break;
+            default: break;
+        }
+        if(expected != SIZE_MAX && length != expected)
+        {
+            LOG_ERROR(LOG_GENERAL, "Save state section %08X is %u bytes, expected %zu", tag, length, expected);
+            return 4; // Memory size mismatch
+        }
+        r.at += length;
+    }
+    return 0;
+}
+
+static void loadAPU(APU *apu, Reader *r)
+{
+    apuCatchUp(apu); // Finish output from before the load with the old settings
+
+    if(!has(r, sizeof(apu->regs))) return;
+    memcpy(apu->regs, r->at, sizeof(apu->regs));
+    r->at += sizeof(apu->regs);
+    for(int channel = 0; channel < 4; ++channel)
+    {
+        APUChannel *ch = &apu->channels[channel];
+        ch->enabled = get8(r);
+        ch->length = get16(r);
+        ch->volume = get8(r);
+        ch->envelopeTimer = get8(r);
+        ch->timer = (int32_t)get32(r);
+        ch->position = get8(r);
+        ch->lfsr = get16(r);
+    }
+    apu->sweepShadow = get16(r);
+    apu->sweepTimer = get8(r);
+    apu->sweepEnabled = get8(r);
+    apu->sequencerStep = get8(r);
+    apu->sequencerSamples = get16(r);
+    apu->cycleRemainder = get32(r);
+    apu->pending = get32(r);
+    if(!apu->sequencerSamples || apu->sequencerSamples > APU_BLOCK_SAMPLES)
+        apu->sequencerSamples = APU_BLOCK_SAMPLES; // Older or corrupt state
+}
+
+static void loadPPU(PPU *ppu, Reader *r)
+{
+    ppu->LCDC = get8(r); ppu->STAT = get8(r); ppu->SCY  = get8(r); ppu->SCX  = get8(r);
+    ppu->LY   = get8(r); ppu->LYC  = get8(r); ppu->BGP  = get8(r); ppu->OBP0 = get8(r);
+    ppu->OBP1 = get8(r); ppu->WY   = get8(r); ppu->WX   = get8(r);
+    ppu->mode = (PPUMode)(get8(r) & 0x03);
+    ppu->modeClock = (int32_t)get32(r);
+    ppu->frameClock = get32(r);
+    ppu->frames = get64(r);
+    ppu->linesLatched = get8(r);
+
+    size_t latched = ppu->linesLatched * sizeof(PPULineRegs);
+    if(has(r, latched)) memcpy(ppu->lineRegs, r->at, latched);
+}
+
+int stateLoad(GameBoy *gb, const uint8_t *buffer, size_t size)
+{
+    int result = validate(gb, buffer, size);
+    if(result) return result;
+
+    CPU *cpu = &gb->cpu;
+    MMU *mmu = &gb->mmu;
+    ppuSync(&gb->ppu); // The worker must not be replaying writes while memory is replaced
+
+    Reader header = { buffer + 6, buffer + 8 };
+    uint16_t sections = get16(&header);
+    const uint8_t *at = buffer + STATE_HEADER_SIZE;
+
+    for(uint16_t i = 0; i < sections; ++i)
+    {
+        Reader section = { at, at + STATE_SECTION_SIZE };
+        uint32_t tag = get32(&section);
+        uint32_t length = get32(&section);
+        Reader r = { at + STATE_SECTION_SIZE, at + STATE_SECTION_SIZE + length };
+        at = r.end;
+
+        switch(tag)
+        {
+            case TAG_CPU:
+                cpu->af = get16(&r); cpu->bc = get16(&r); cpu->de = get16(&r);
+                cpu->hl = get16(&r); cpu->sp = get16(&r); cpu->pc = get16(&r);
+                cpu->ime = get8(&r);
+                break;
+            case TAG_MBC:
+                mmu->currentRomBank = get8(&r);
+                mmu->currentRamBank = get8(&r);
+                mmu->ramEnabled = get8(&r);
+                mmu->bankingMode = get8(&r);
+                break;
+            case TAG_IO:
+                mmu->ieRegisters = get8(&r);
+                mmu->joypad = get8(&r);
+                mmu->joypadSelect = get8(&r);
+                mmu->interruptFlags = get8(&r) & 0x1F; // Fields missing from older states read as 0
+                gb->serial.SB = get8(&r);
+                gb->serial.SC = get8(&r) & 0x81;
+                gb->serial.countdown = (int32_t)get32(&r);
+                break;
+            case TAG_PPU:
+                loadPPU(&gb->ppu, &r);
+                break;
+            case TAG_APU:
+                loadAPU(&gb->apu, &r);
+                break;
+            case TAG_CLK:
+                gb->cycles = get64(&r);
+                gb->instructions = get64(&r);
+                break;
+            case TAG_VRAM: memcpy(mmuVramWritable(mmu), r.at, length); break;
+            case TAG_WRAM:
+                for(int page = 0; page < MMU_WRAM_PAGES; ++page)
+                    memcpy(mmuWramWritable(mmu, page), r.at + page * MMU_PAGE_SIZE, MMU_PAGE_SIZE);
+                break;
+            case TAG_HRAM: memcpy(mmu->hram, r.at, length); break;
+            case TAG_OAM:  memcpy(mmu->oam,  r.at, length); break;
+            case TAG_CRAM: if(length) memcpy(mmu->ramData, r.at, length); break;
+            default:
+                LOG_DEBUG(LOG_GENERAL, "Skipping unknown save state section %08X", tag);
+                break;
+        }
+    }
+
+    mmuRemap(mmu); // Bank and RAM enable state changed under the maps
+    ppuResync(&gb->ppu, mmu);
+    return 0;
+}
+
+int stateSaveFile(const GameBoy *gb, const char *filename)
+{
+    size_t capacity = stateSize(gb);
+    uint8_t *buffer = malloc(capacity);
+    if(!buffer)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate save state buffer");
+        return 1; // Memory allocation error
+    }
+
+    size_t size = stateSave(gb, buffer, capacity);
+    FILE *file = fopen(filename, "wb");
+    int result = 0;
+    if(!file || fwrite(buffer, 1, size, file) != size)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to write save state: %s", filename);
+        result = 2; // Write error
+    }
+    if(file) fclose(file);
+    free(buffer);
+    return result;
+}
+
+int stateLoadFile(GameBoy *gb, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if(!file)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to open save state: %s", filename);
+        return 1; // Error opening file
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *buffer = size > 0 ? malloc(size) : NULL;
+    int result = 0;
+    if(!buffer || fread(buffer, 1, size, file) != (size_t)size)
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to read save state: %s", filename);
+        result = 2; // Read error
+    }
+    fclose(file);
+
+    if(!result && stateLoad(gb, buffer, size)) result = 3; // Invalid state
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include "../includes/stats.h"
+#include "../includes/log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define OVERLAY_X       2          // Top left corner of the text
+#define OVERLAY_Y       2
+#define OVERLAY_ADVANCE 4          // 3x5 glyphs, one pixel apart
+#define OVERLAY_LINE    6
+#define OVERLAY_INK     0xFFFFFFFF
+#define OVERLAY_PAPER   0xFF000000
+
+const char *const statsBucketNames[STATS_BUCKETS] =
+{
+    "cpu", "mmu", "ppu", "apu", "present", "log", "idle", "other"
+};
+
+static const char *const overlayNames[STATS_BUCKETS] =
+{
+    "CPU", "MMU", "PPU", "APU", "PRS", "LOG", "IDL", "OTH"
+};
+
+// 3x5 glyphs, one octal digit per row from the top, the high bit is the left column
+static const uint16_t digitGlyphs[10] =
+{
+    075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717
+};
+static const uint16_t letterGlyphs[26] =
+{
+    025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011152, 055655, 044447, 057755,
+    065555, 025552, 065644, 025563, 065655, 034216, 072222, 055557, 055552, 055775, 055255, 055222, 071247
+};
+
+uint64_t statsClock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Counters only grow, except the worker's, which restarts with a new pipeline
+static uint64_t advance(uint64_t *last, uint64_t now)
+{
+    uint64_t delta = now >= *last ? now - *last : now;
+    *last = now;
+    return delta;
+}
+
+void statsInit(Stats *stats, GameBoy *gb)
+{
+    memset(stats, 0, sizeof(Stats));
+    stats->windowStart = statsClock();
+    stats->lastMmu = gb->mmu.slowTime;
+    stats->lastMmuAccesses = gb->mmu.slowAccesses;
+    stats->lastPpu = gb->ppu.renderTime;
+    stats->lastWorker = ppuWorkerTime(&gb->ppu);
+    stats->lastApu = gb->apu.catchUpTime;
+    stats->lastLog = logTimeSpent();
+}
+
+void statsAdd(Stats *stats, StatsBucket bucket, uint64_t time)
+{
+    stats->time[bucket] += time;
+}
+
+void statsFrame(Stats *stats, GameBoy *gb, uint64_t time)
+{
+    uint64_t mmu = advance(&stats->lastMmu, gb->mmu.slowTime);
+    uint64_t ppu = advance(&stats->lastPpu, gb->ppu.renderTime);
+    uint64_t apu = advance(&stats->lastApu, gb->apu.catchUpTime);
+    uint64_t log = advance(&stats->lastLog, logTimeSpent());
+    stats->time[STATS_MMU] += mmu;
+    stats->time[STATS_PPU] += ppu;
+    stats->time[STATS_APU] += apu;
+    stats->time[STATS_LOG] += log;
+    stats->workerTime += advance(&stats->lastWorker, ppuWorkerTime(&gb->ppu));
+    stats->mmuAccesses += advance(&stats->lastMmuAccesses, gb->mmu.slowAccesses);
+
+    // The subsystems ran inside the frame; sampled MMU time can overshoot it on a short frame
+    uint64_t claimed = mmu + ppu + apu + log;
+    stats->time[STATS_CPU] += time > claimed ? time - claimed : 0;
+    stats->frames++;
+}
+
+bool statsUpdate(Stats *stats, bool force)
+{
+    uint64_t now = statsClock();
+    uint64_t elapsed = now - stats->windowStart;
+    if(!stats->frames || !elapsed || (!force && elapsed < STATS_WINDOW)) return false;
+
+    uint64_t accounted = 0;
+    for(int bucket = 0; bucket < STATS_OTHER; ++bucket)
+        accounted += stats->time[bucket];
+    stats->time[STATS_OTHER] = elapsed > accounted ? elapsed - accounted : 0;
+
+    for(int bucket = 0; bucket < STATS_BUCKETS; ++bucket)
+    {
+        stats->share[bucket] = stats->time[bucket] * 100.0 / elapsed;
+        stats->frameMs[bucket] = stats->time[bucket] / 1e6 / stats->frames;
+    }
+    stats->fps = stats->frames * 1e9 / elapsed;
+    stats->workerShare = stats->workerTime * 100.0 / elapsed;
+    stats->mmuPerFrame = (double)stats->mmuAccesses / stats->frames;
+    stats->ready = true;
+
+    memset(stats->time, 0, sizeof(stats->time));
+    stats->frames = stats->workerTime = stats->mmuAccesses = 0;
+    stats->windowStart = now;
+    return true;
+}
+
+int statsFormat(const Stats *stats, char *buffer, size_t size)
+{
+    int length = snprintf(buffer, size, "fps=%.2f", stats->fps);
+    for(int bucket = 0; bucket < STATS_BUCKETS && length >= 0 && (size_t)length < size; ++bucket)
+        length += snprintf(buffer + length, size - length, " %s=%.3fms/%.1f%%", statsBucketNames[bucket],
+                           stats->frameMs[bucket], stats->share[bucket]);
+    if(length >= 0 && (size_t)length < size)
+        length += snprintf(buffer + length, size - length, " ppu_worker=%.1f%% mmu_slow_per_frame=%.0f",
+                           stats->workerShare, stats->mmuPerFrame);
+    return length < 0 || (size_t)length >= size; // 1: truncated
+}
+
+static uint16_t glyphFor(char c)
+{
+    if(c >= '0' && c <= '9') return digitGlyphs[c - '0'];
+    if(c >= 'A' && c <= 'Z') return letterGlyphs[c - 'A'];
+    switch(c)
+    {
+        case '.': return 000002;
+        case '%': return 051245;
+        case '-': return 000700;
+        default:  return 0;
+    }
+}
+
+static void drawText(PPU *ppu, int x, int y, const char *text)
+{
+    for(; *text && x + 3 <= SCREEN_WIDTH; ++text, x += OVERLAY_ADVANCE)
+    {
+        uint16_t glyph = glyphFor(*text);
+        for(int row = 0; row < 5; ++row)
+            for(int column = 0; column < 3; ++column)
+                if((glyph >> ((4 - row) * 3 + 2 - column)) & 1)
+                    ppu->frameBuffer[y + row][x + column] = OVERLAY_INK;
+    }
+}
+
+void statsDrawOverlay(const Stats *stats, PPU *ppu)
+{
+    if(!stats->ready) return;
+
+    char lines[STATS_BUCKETS + 2][16];
+    int count = 0, width = 0;
+    snprintf(lines[count++], sizeof(lines[0]), "FPS %5.1f", stats->fps);
+    for(int bucket = 0; bucket < STATS_BUCKETS; ++bucket)
+        snprintf(lines[count++], sizeof(lines[0]), "%s %5.1f%%", overlayNames[bucket], stats->share[bucket]);
+    if(stats->workerShare > 0)
+        snprintf(lines[count++], sizeof(lines[0]), "WRK %5.1f%%", stats->workerShare);
+    for(int i = 0; i < count; ++i)
+        if((int)strlen(lines[i]) > width) width = (int)strlen(lines[i]);
+
+    int top = OVERLAY_Y - 1, bottom = OVERLAY_Y + count * OVERLAY_LINE;
+    int left = OVERLAY_X - 1, right = OVERLAY_X + width * OVERLAY_ADVANCE;
+    for(int y = top; y < bottom; ++y)
+        for(int x = left; x < right; ++x)
+            ppu->frameBuffer[y][x] = OVERLAY_PAPER;
+    for(int i = 0; i < count; ++i)
+        drawText(ppu, OVERLAY_X, OVERLAY_Y + i * OVERLAY_LINE, lines[i]);
+
+    // Forget what these lines held so the renderer puts the picture back next frame
+    for(int y = top; y < bottom; ++y)
+    {
+        ppu->lineHash[y] = ~ppu->lineHash[y];
+        ppu->lineDirty[y] = true;
+    }
+    ppu->frameDirty = true;
+}
@@ -0,0 +1,276 @@
+#define _POSIX_C_SOURCE 200809L // getc_unlocked
+#include "../includes/trace.h"
+#include "../includes/log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct TraceWriter
+{
+    FILE           *file;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  filled;   // A buffer was handed to the writer thread, or the trace is closing
+    pthread_cond_t  drained;  // The writer thread finished a buffer
+    uint8_t        *buffers;  // TRACE_BUFFERS * TRACE_BUFFER_SIZE
+    size_t          lengths[TRACE_BUFFERS];
+
+    // Under lock
+    int             pending;  // Buffers handed over and not yet written
+    bool            closing;
+    bool            failed;
+
+    // Recording thread only
+    int             produce;  // Buffer being filled
+    size_t          used;
+    TraceRecord     previous;
+    uint64_t        count;
+
+    // Writer thread only
+    int             consume;  // Next buffer to write
+};
+
+struct TraceReader
+{
+    FILE        *file;
+    TraceRecord  previous;
+};
+
+static void *writerThread(void *arg)
+{
+    TraceWriter *trace = arg;
+    pthread_mutex_lock(&trace->lock);
+    while(1)
+    {
+        while(!trace->pending && !trace->closing)
+            pthread_cond_wait(&trace->filled, &trace->lock);
+        if(!trace->pending) break; // Closing with everything written
+
+        int index = trace->consume;
+        pthread_mutex_unlock(&trace->lock);
+        bool ok = fwrite(trace->buffers + (size_t)index * TRACE_BUFFER_SIZE, 1, trace->lengths[index], trace->file)
+                  == trace->lengths[index];
+        trace->consume = (index + 1) % TRACE_BUFFERS;
+        pthread_mutex_lock(&trace->lock);
+
+        if(!ok) trace->failed = true;
+        trace->pending--;
+        pthread_cond_signal(&trace->drained);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+// Hands the current buffer to the writer thread, waiting only if every buffer is still queued
+static void handOver(TraceWriter *trace)
+{
+    trace->lengths[trace->produce] = trace->used;
+    pthread_mutex_lock(&trace->lock);
+    trace->pending++;
+    pthread_cond_signal(&trace->filled);
+    while(trace->pending == TRACE_BUFFERS)
+        pthread_cond_wait(&trace->drained, &trace->lock);
+    pthread_mutex_unlock(&trace->lock);
+    trace->produce = (trace->produce + 1) % TRACE_BUFFERS;
+    trace->used = 0;
+}
+
+TraceWriter *traceOpen(const char *path)
+{
+    TraceWriter *trace = calloc(1, sizeof(TraceWriter));
+    if(!trace || !(trace->buffers = malloc((size_t)TRACE_BUFFERS * TRACE_BUFFER_SIZE)))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to allocate trace buffers");
+        free(trace);
+        return NULL; // Memory allocation error
+    }
+
+    uint8_t header[8];
+    for(int i = 0; i < 4; ++i)
+    {
+        header[i]     = (uint8_t)(TRACE_MAGIC >> (i * 8));
+        header[i + 4] = (uint8_t)((uint32_t)TRACE_VERSION >> (i * 8));
+    }
+    trace->file = fopen(path, "wb");
+    if(!trace->file || fwrite(header, 1, sizeof(header), trace->file) != sizeof(header))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to create trace file: %s", path);
+        if(trace->file) fclose(trace->file);
+        free(trace->buffers);
+        free(trace);
+        return NULL; // File error
+    }
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->filled, NULL);
+    pthread_cond_init(&trace->drained, NULL);
+    if(pthread_create(&trace->thread, NULL, writerThread, trace))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to start the trace writer thread");
+        pthread_cond_destroy(&trace->drained);
+        pthread_cond_destroy(&trace->filled);
+        pthread_mutex_destroy(&trace->lock);
+        fclose(trace->file);
+        free(trace->buffers);
+        free(trace);
+        return NULL; // Thread creation failed
+    }
+    LOG_INFO(LOG_GENERAL, "Tracing instructions to %s", path);
+    return trace;
+}
+
+static inline uint8_t *put16(uint8_t *at, uint16_t value)
+{
+    at[0] = (uint8_t)value;
+    at[1] = (uint8_t)(value >> 8);
+    return at + 2;
+}
+
+void traceRecord(TraceWriter *trace, const TraceRecord *record)
+{
+    if(trace->used > TRACE_BUFFER_SIZE - TRACE_MAX_ENCODED) handOver(trace);
+
+    const TraceRecord *previous = &trace->previous;
+    bool key = !(trace->count++ % TRACE_KEY_INTERVAL);
+    int16_t step = (int16_t)(record->pc - previous->pc);
+    uint64_t elapsed = record->cycles - previous->cycles;
+
+    uint8_t flags = 0, extended = 0;
+    if(key)                             flags |= TRACE_PC_FAR | TRACE_SP | TRACE_AF | TRACE_BC | TRACE_DE | TRACE_HL;
+    else if(step < -128 || step > 127)  flags |= TRACE_PC_FAR;
+    else if(step != 1)                  flags |= TRACE_PC_NEAR;
+    if(record->sp != previous->sp)      flags |= TRACE_SP;
+    if(record->af != previous->af)      flags |= TRACE_AF;
+    if(record->bc != previous->bc)      flags |= TRACE_BC;
+    if(record->de != previous->de)      flags |= TRACE_DE;
+    if(record->hl != previous->hl)      flags |= TRACE_HL;
+    if(key || record->bank != previous->bank) extended |= TRACE_BANK;
+    if(key || record->cycles < previous->cycles || elapsed > 0xFF) extended |= TRACE_CYCLES;
+    if(extended) flags |= TRACE_EXTENDED;
+
+    uint8_t *at = trace->buffers + (size_t)trace->produce * TRACE_BUFFER_SIZE + trace->used, *start = at;
+    *at++ = flags;
+    if(extended) *at++ = extended;
+    *at++ = record->opcode;
+    if(flags & TRACE_PC_NEAR) *at++ = (uint8_t)step;
+    if(flags & TRACE_PC_FAR)  at = put16(at, record->pc);
+    if(flags & TRACE_SP)      at = put16(at, record->sp);
+    if(flags & TRACE_AF)      at = put16(at, record->af);
+    if(flags & TRACE_BC)      at = put16(at, record->bc);
+    if(flags & TRACE_DE)      at = put16(at, record->de);
+    if(flags & TRACE_HL)      at = put16(at, record->hl);
+    if(extended & TRACE_BANK) *at++ = record->bank;
+    if(extended & TRACE_CYCLES)
+        for(int i = 0; i < 8; ++i) *at++ = (uint8_t)(record->cycles >> (i * 8));
+    else
+        *at++ = (uint8_t)elapsed;
+
+    trace->used += (size_t)(at - start);
+    trace->previous = *record;
+}
+
+int traceClose(TraceWriter *trace)
+{
+    if(!trace) return 0;
+    if(trace->used) handOver(trace);
+
+    pthread_mutex_lock(&trace->lock);
+    trace->closing = true;
+    pthread_cond_signal(&trace->filled);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->thread, NULL);
+
+    int result = trace->failed;
+    if(fclose(trace->file)) result = 1;
+    if(result) LOG_ERROR(LOG_GENERAL, "Failed to write the instruction trace");
+    else LOG_INFO(LOG_GENERAL, "Traced %llu instructions", (unsigned long long)trace->count);
+
+    pthread_cond_destroy(&trace->drained);
+    pthread_cond_destroy(&trace->filled);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->buffers);
+    free(trace);
+    return result; // 1: write error
+}
+
+TraceReader *traceReaderOpen(const char *path)
+{
+    TraceReader *reader = calloc(1, sizeof(TraceReader));
+    if(!reader || !(reader->file = fopen(path, "rb")))
+    {
+        LOG_ERROR(LOG_GENERAL, "Failed to open trace file: %s", path);
+        free(reader);
+        return NULL;
+    }
+
+    uint8_t header[8];
+    uint32_t magic = 0, version = 0;
+    if(fread(header, 1, sizeof(header), reader->file) == sizeof(header))
+        for(int i = 0; i < 4; ++i)
+        {
+            magic   |= (uint32_t)header[i]     << (i * 8);
+            version |= (uint32_t)header[i + 4] << (i * 8);
+        }
+    if(magic != TRACE_MAGIC || version != TRACE_VERSION)
+    {
+        LOG_ERROR(LOG_GENERAL, "Not a version %d trace file: %s", TRACE_VERSION, path);
+        traceReaderClose(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+// Reads count little endian bytes, false at end of file
+static bool get(FILE *file, int count, uint64_t *value)
+{
+    *value = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        int byte = getc_unlocked(file);
+        if(byte == EOF) return false;
+        *value |= (uint64_t)byte << (i * 8);
+    }
+    return true;
+}
+
+int traceRead(TraceReader *reader, TraceRecord *record)
+{
+    int flags = getc_unlocked(reader->file);
+    if(flags == EOF) return 0; // End of trace
+
+    TraceRecord *previous = &reader->previous;
+    *record = *previous;
+    uint64_t extended = 0, value = 0;
+    bool ok = (!(flags & TRACE_EXTENDED) || get(reader->file, 1, &extended)) && get(reader->file, 1, &value);
+    record->opcode = (uint8_t)value;
+
+    record->pc = previous->pc + 1;
+    if(ok && (flags & TRACE_PC_NEAR)) { ok = get(reader->file, 1, &value); record->pc = previous->pc + (int8_t)value; }
+    if(ok && (flags & TRACE_PC_FAR))  { ok = get(reader->file, 2, &value); record->pc = (uint16_t)value; }
+    if(ok && (flags & TRACE_SP))      { ok = get(reader->file, 2, &value); record->sp = (uint16_t)value; }
+    if(ok && (flags & TRACE_AF))      { ok = get(reader->file, 2, &value); record->af = (uint16_t)value; }
+    if(ok && (flags & TRACE_BC))      { ok = get(reader->file, 2, &value); record->bc = (uint16_t)value; }
+    if(ok && (flags & TRACE_DE))      { ok = get(reader->file, 2, &value); record->de = (uint16_t)value; }
+    if(ok && (flags & TRACE_HL))      { ok = get(reader->file, 2, &value); record->hl = (uint16_t)value; }
+    if(ok && (extended & TRACE_BANK)) { ok = get(reader->file, 1, &value); record->bank = (uint8_t)value; }
+    if(ok && (extended & TRACE_CYCLES))
+        ok = get(reader->file, 8, &record->cycles);
+    else if(ok)
+    {
+        ok = get(reader->file, 1, &value);
+        record->cycles = previous->cycles + value;
+    }
+
+    if(!ok) return -1; // Truncated record
+    *previous = *record;
+    return 1;
+}
+
+void traceReaderClose(TraceReader *reader)
+{
+    if(!reader) return;
+    fclose(reader->file);
+    free(reader);
+}
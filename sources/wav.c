@@ -0,0 +1,78 @@
+#include "../includes/wav.h"
+#include "../includes/log.h"
+
+#include <string.h>
+
+static void put16(uint8_t *out, uint16_t value) { out[0] = value; out[1] = value >> 8; }
+static void put32(uint8_t *out, uint32_t value) { put16(out, value); put16(out + 2, value >> 16); }
+
+static void header(uint8_t out[44], uint32_t rate, uint32_t frames)
+{
+    uint32_t bytes = frames * 4;
+    memcpy(out, "RIFF", 4);      put32(out + 4, 36 + bytes);
+    memcpy(out + 8, "WAVEfmt ", 8);
+    put32(out + 16, 16);         // fmt chunk size
+    put16(out + 20, 1);          // PCM
+    put16(out + 22, 2);          // Channels
+    put32(out + 24, rate);
+    put32(out + 28, rate * 4);   // Byte rate
+    put16(out + 32, 4);          // Block align
+    put16(out + 34, 16);         // Bits per sample
+    memcpy(out + 36, "data", 4); put32(out + 40, bytes);
+}
+
+int wavOpen(WavWriter *wav, const char *filename, uint32_t rate)
+{
+    wav->rate = rate;
+    wav->frames = 0;
+    wav->file = fopen(filename, "wb");
+    if(!wav->file)
+    {
+        LOG_ERROR(LOG_IO, "Failed to open WAV file: %s", filename);
+        return 1; // Error opening file
+    }
+
+    uint8_t placeholder[44];
+    header(placeholder, rate, 0);
+    if(fwrite(placeholder, 1, sizeof(placeholder), wav->file) != sizeof(placeholder))
+    {
+        fclose(wav->file);
+        wav->file = NULL;
+        return 2; // Write error
+    }
+    return 0;
+}
+
+int wavWrite(WavWriter *wav, const int16_t (*frames)[2], size_t count)
+{
+    uint8_t buffer[4096];
+    for(size_t done = 0; done < count; )
+    {
+        size_t chunk = count - done < sizeof(buffer) / 4 ? count - done : sizeof(buffer) / 4;
+        for(size_t i = 0; i < chunk; ++i)
+        {
+            put16(buffer + i * 4, (uint16_t)frames[done + i][0]); // Little-endian whatever the host
+            put16(buffer + i * 4 + 2, (uint16_t)frames[done + i][1]);
+        }
+        if(fwrite(buffer, 4, chunk, wav->file) != chunk)
+        {
+            LOG_ERROR(LOG_IO, "Failed to write WAV data");
+            return 1; // Write error
+        }
+        done += chunk;
+    }
+    wav->frames += (uint32_t)count;
+    return 0;
+}
+
+int wavClose(WavWriter *wav)
+{
+    if(!wav->file) return 0;
+
+    uint8_t final[44];
+    header(final, wav->rate, wav->frames);
+    int result = fseek(wav->file, 0, SEEK_SET) || fwrite(final, 1, sizeof(final), wav->file) != sizeof(final);
+    result |= fclose(wav->file);
+    wav->file = NULL;
+    return result ? 1 : 0; // 1: failed to finalize the header
+}
@@ -0,0 +1,23 @@
+#include "../includes/log.h"
+
+#include <stdio.h>
+
+// Prints a --log-binary ring as text, oldest record first, whether or not it wrapped.
+//
+//   logdump file.binlog
+//
+// Exit status: 0 read to the write position, 1 not a binary log, 2 truncated or corrupt.
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "usage: %s file.binlog\n", argv[0]);
+        return 1; // Invalid arguments
+    }
+
+    int result = logDumpBinary(argv[1], stdout);
+    if(result)
+        fprintf(stderr, "%s: %s\n", argv[1], result == 1 ? "not a binary log" : "truncated or corrupt");
+    return result;
+}
@@ -0,0 +1,116 @@
+#include "../includes/trace.h"
+#include "../includes/log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Compares two instruction traces written with --trace and reports the first record
+// where they disagree, with the instructions that led up to it.
+//
+//   tracediff a.trace b.trace [--ignore-cycles]
+//
+// Exit status: 0 identical, 1 diverged or different lengths, 2 unreadable input.
+
+#define CONTEXT 8 // Common records shown before the divergence
+
+static void printRecord(const char *prefix, uint64_t index, const TraceRecord *r)
+{
+    printf("%s%10llu  pc=%02X:%04X op=%02X af=%04X bc=%04X de=%04X hl=%04X sp=%04X cycles=%llu\n", prefix,
+           (unsigned long long)index, r->bank, r->pc, r->opcode, r->af, r->bc, r->de, r->hl, r->sp,
+           (unsigned long long)r->cycles);
+}
+
+static void printDifferences(const TraceRecord *a, const TraceRecord *b, int ignoreCycles)
+{
+    printf("differs in:");
+    if(a->pc != b->pc)         printf(" pc");
+    if(a->bank != b->bank)     printf(" bank");
+    if(a->opcode != b->opcode) printf(" opcode");
+    if(a->af != b->af)         printf(" af");
+    if(a->bc != b->bc)         printf(" bc");
+    if(a->de != b->de)         printf(" de");
+    if(a->hl != b->hl)         printf(" hl");
+    if(a->sp != b->sp)         printf(" sp");
+    if(!ignoreCycles && a->cycles != b->cycles) printf(" cycles");
+    printf("\n");
+}
+
+static int same(const TraceRecord *a, const TraceRecord *b, int ignoreCycles)
+{
+    return a->pc == b->pc && a->bank == b->bank && a->opcode == b->opcode && a->af == b->af && a->bc == b->bc &&
+           a->de == b->de && a->hl == b->hl && a->sp == b->sp && (ignoreCycles || a->cycles == b->cycles);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *paths[2] = { NULL, NULL };
+    int ignoreCycles = 0, given = 0;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "--ignore-cycles")) ignoreCycles = 1;
+        else if(given < 2) paths[given++] = argv[i];
+    }
+    if(given != 2)
+    {
+        fprintf(stderr, "usage: %s a.trace b.trace [--ignore-cycles]\n", argv[0]);
+        return 2; // Invalid arguments
+    }
+
+    logSetOutput(NULL); // Keep stdout to the report, problems go to stderr below
+    if(logInit()) return 2;
+    TraceReader *readers[2] = { traceReaderOpen(paths[0]), traceReaderOpen(paths[1]) };
+    if(!readers[0] || !readers[1])
+    {
+        fprintf(stderr, "cannot read %s\n", readers[0] ? paths[1] : paths[0]);
+        traceReaderClose(readers[0]);
+        traceReaderClose(readers[1]);
+        logFree();
+        return 2; // Unreadable trace
+    }
+
+    TraceRecord history[CONTEXT];
+    uint64_t index = 0;
+    int result = 0;
+    while(1)
+    {
+        TraceRecord a, b;
+        int readA = traceRead(readers[0], &a), readB = traceRead(readers[1], &b);
+        if(readA < 0 || readB < 0)
+        {
+            fprintf(stderr, "%s is corrupt at record %llu\n", paths[readA < 0 ? 0 : 1], (unsigned long long)index);
+            result = 2; // Corrupt trace
+            break;
+        }
+        if(!readA || !readB)
+        {
+            if(readA != readB)
+            {
+                printf("%s ends after %llu records, the other goes on\n", paths[readA ? 1 : 0],
+                       (unsigned long long)index);
+                result = 1;
+            }
+            else
+                printf("identical, %llu records\n", (unsigned long long)index);
+            break;
+        }
+
+        if(!same(&a, &b, ignoreCycles))
+        {
+            printf("first divergence at record %llu\n", (unsigned long long)index);
+            uint64_t first = index > CONTEXT ? index - CONTEXT : 0;
+            for(uint64_t i = first; i < index; ++i)
+                printRecord("   ", i, &history[i % CONTEXT]);
+            printRecord(" a ", index, &a);
+            printRecord(" b ", index, &b);
+            printDifferences(&a, &b, ignoreCycles);
+            result = 1;
+            break;
+        }
+        history[index++ % CONTEXT] = a;
+    }
+
+    traceReaderClose(readers[0]);
+    traceReaderClose(readers[1]);
+    logFree();
+    return result;
+}